@@ -0,0 +1,197 @@
+#include "aggregate.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+
+#include "clock.h"
+#include "influxdb.h"
+
+
+bool Aggregator::parseOptions(std::string_view text, Options& options)
+{
+  options = Options();
+
+  const size_t colon = text.find(':');
+  if (std::string_view::npos == colon)
+    return false;
+
+  int64_t window;
+  const std::from_chars_result result = std::from_chars(text.data(), text.data()+colon, window);
+  if (result.ec!=std::errc() || window<=0)
+    return false;
+
+  const std::string_view unit = text.substr(result.ptr-text.data(), colon-(result.ptr-text.data()));
+  if (unit == "ms")                    options.window_ms = window;
+  else if (unit == "s" || unit == "")  options.window_ms = window*1000L;
+  else if (unit == "m")                options.window_ms = window*60*1000L;
+  else if (unit == "h")                options.window_ms = window*60*60*1000L;
+  else return false;
+
+  size_t start = colon+1;
+  while (start <= text.length()) //Parse ','-separated functions
+  {
+    size_t end = text.find(',', start);
+    if (std::string_view::npos == end)
+      end = text.length();
+
+    const std::string_view function = text.substr(start, end-start);
+    if (function == "min")        options.functions |= MIN;
+    else if (function == "max")   options.functions |= MAX;
+    else if (function == "mean")  options.functions |= MEAN;
+    else if (function == "count") options.functions |= COUNT;
+    else if (function == "last")  options.functions |= LAST;
+    else return false;
+
+    start = end+1;
+  }
+
+  return options.isEnabled();
+}
+
+
+Aggregator::Aggregator(size_t max_series)
+: m_windows(max_series, Window{0, 0, 0.0, 0.0, 0.0, 0.0, 0, 0}),
+  m_destinations(max_series),
+  m_tick_ms(MAX_TICK_MS),
+  m_series_end(0),
+  m_stop(false)
+{
+  m_thread = std::thread(&Aggregator::run, this);
+}
+
+Aggregator::~Aggregator()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_run_lock);
+    m_stop = true;
+  }
+  m_run_wakeup.notify_all();
+  m_thread.join();
+
+  // Emit windows still open
+  std::string line;
+  for (uint32_t series_id=0; series_id<m_series_end.load(); series_id++)
+  {
+    std::lock_guard<std::mutex> lock(getLock(series_id));
+    if (m_windows[series_id].end_ms != 0)
+      emit(series_id, line);
+  }
+}
+
+void Aggregator::reset(uint32_t series_id)
+{
+  std::lock_guard<std::mutex> lock(getLock(series_id));
+  if (m_windows[series_id].end_ms != 0)
+  {
+    std::string line;
+    emit(series_id, line);
+  }
+  m_destinations[series_id].measurement.clear();
+  m_destinations[series_id].writer.reset();
+}
+
+void Aggregator::add(uint32_t series_id, const Options& options, std::string_view measurement, const std::shared_ptr<InfluxDBWriter>& writer,
+                     double value, int64_t now_ms)
+{
+  if (options.window_ms < m_tick_ms.load(std::memory_order_relaxed))
+    m_tick_ms.store(options.window_ms, std::memory_order_relaxed);
+
+  uint32_t series_end = m_series_end.load(std::memory_order_relaxed);
+  while (series_id>=series_end && !m_series_end.compare_exchange_weak(series_end, series_id+1, std::memory_order_relaxed))
+    ;
+
+  std::lock_guard<std::mutex> lock(getLock(series_id));
+  Window& window = m_windows[series_id];
+  if (window.end_ms!=0 && now_ms>=window.end_ms) //The emitting thread hasn't got to it yet
+  {
+    thread_local std::string line;
+    emit(series_id, line);
+  }
+
+  if (window.end_ms == 0)
+  {
+    Destination& destination = m_destinations[series_id];
+    if (destination.measurement.empty())
+    {
+      destination.measurement = measurement;
+      destination.writer = writer;
+    }
+
+    // Windows are aligned to multiples of the window length, so all series of a rule share window boundaries
+    window.end_ms = (now_ms/options.window_ms + 1) * options.window_ms;
+    window.window_ms = options.window_ms;
+    window.functions = options.functions;
+    window.min = window.max = window.sum = window.last = value;
+    window.count = 1;
+    return;
+  }
+
+  window.min = std::min(window.min, value);
+  window.max = std::max(window.max, value);
+  window.sum += value;
+  window.last = value;
+  window.count++;
+}
+
+void Aggregator::emit(uint32_t series_id, std::string& line)
+{
+  Window& window = m_windows[series_id];
+  const Destination& destination = m_destinations[series_id];
+  char buffer[32];
+
+  // <measurement> min=..,max=..,mean=..,count=..i,last=.. <window start>
+  line = destination.measurement;
+  const auto append_field = [&line, &buffer](const char* name, double value)
+  {
+    if (line.back() != ' ')
+      line += ',';
+    line += name;
+    line += '=';
+    line.append(buffer, std::to_chars(buffer, buffer+sizeof(buffer), value).ptr);
+  };
+  if (window.functions & MIN)  append_field("min", window.min);
+  if (window.functions & MAX)  append_field("max", window.max);
+  if (window.functions & MEAN) append_field("mean", window.sum/window.count);
+  if (window.functions & COUNT)
+  {
+    append_field("count", window.count);
+    line += 'i';
+  }
+  if (window.functions & LAST) append_field("last", window.last);
+
+  line += ' ';
+  line.append(buffer, std::to_chars(buffer, buffer+sizeof(buffer), window.end_ms-window.window_ms).ptr);
+  line += '\n';
+
+  if (destination.writer)
+    destination.writer->write(line, nullptr, Clock::MILLISECONDS);
+
+  window.end_ms = 0;
+}
+
+void Aggregator::run()
+{
+  std::string line;
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> lock(m_run_lock);
+      if (m_run_wakeup.wait_for(lock, std::chrono::milliseconds(m_tick_ms.load(std::memory_order_relaxed)), [this] {return m_stop;}))
+        break;
+    }
+
+    const int64_t now_ms = Clock::realtimeMs();
+    const uint32_t series_end = m_series_end.load(std::memory_order_relaxed);
+    for (uint32_t block_start=0; block_start<series_end; block_start+=LOCK_BLOCK_LENGTH)
+    {
+      std::lock_guard<std::mutex> lock(getLock(block_start));
+      const uint32_t block_end = std::min<uint32_t>(block_start+LOCK_BLOCK_LENGTH, series_end);
+      for (uint32_t series_id=block_start; series_id<block_end; series_id++)
+      {
+        if (m_windows[series_id].end_ms!=0 && now_ms>=m_windows[series_id].end_ms)
+          emit(series_id, line);
+      }
+    }
+  }
+}
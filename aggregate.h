@@ -0,0 +1,91 @@
+#ifndef _AGGREGATE_H_
+#define _AGGREGATE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+class InfluxDBWriter;
+
+
+/*
+ * Pre-aggregates numeric values per series over fixed windows, and emits one point per window from a background thread.
+ * The running aggregates are kept in a flat array indexed by SeriesTable::Series::id, which the emitting thread scans.
+ */
+class Aggregator
+{
+public:
+  enum Function : uint8_t {
+    MIN   = 0x01,
+    MAX   = 0x02,
+    MEAN  = 0x04,
+    COUNT = 0x08,
+    LAST  = 0x10
+  };
+
+  struct Options {
+    int64_t window_ms = 0;
+    uint8_t functions = 0;
+
+    [[nodiscard]] bool isEnabled() const {return window_ms>0 && functions!=0;}
+  };
+
+private:
+  static constexpr size_t LOCK_COUNT = 64;
+  static constexpr size_t LOCK_BLOCK_LENGTH = 256; // Consecutive series ids share a lock, so the emitting thread scans a block per lock
+  static constexpr int64_t MAX_TICK_MS = 1000L;
+
+  struct Window { // Hot, scanned by the emitting thread
+    int64_t end_ms; // 0 if there are no values in the window
+    int64_t window_ms;
+    double min;
+    double max;
+    double sum;
+    double last;
+    uint32_t count;
+    uint8_t functions;
+  };
+
+  struct Destination { // Cold, only used when a window is emitted
+    std::string measurement; // Escaped, followed by a space
+    std::shared_ptr<InfluxDBWriter> writer;
+  };
+
+public:
+  // "10s:mean,max". The window is in ms, s, m or h
+  [[nodiscard]] static bool parseOptions(std::string_view text, Options& options);
+
+  Aggregator(size_t max_series);
+  ~Aggregator();
+
+  // Call when a series id is (re)assigned. A pending window of the previous series on that id is emitted first
+  void reset(uint32_t series_id);
+  void add(uint32_t series_id, const Options& options, std::string_view measurement, const std::shared_ptr<InfluxDBWriter>& writer,
+           double value, int64_t now_ms);
+
+private:
+  [[nodiscard]] std::mutex& getLock(uint32_t series_id) {return m_locks[(series_id/LOCK_BLOCK_LENGTH) % LOCK_COUNT];}
+  void run();
+  // Called with the lock for series_id held
+  void emit(uint32_t series_id, std::string& line);
+
+private:
+  std::vector<Window> m_windows;
+  std::vector<Destination> m_destinations;
+  std::mutex m_locks[LOCK_COUNT];
+
+  std::mutex m_run_lock;
+  std::condition_variable m_run_wakeup;
+  std::atomic<int64_t> m_tick_ms;
+  std::atomic<uint32_t> m_series_end; // Highest series id used, plus 1. Limits the scan
+  bool m_stop;
+  std::thread m_thread;
+};
+
+#endif // _AGGREGATE_H_
@@ -0,0 +1,51 @@
+#!/bin/sh
+
+# CONNECT storm, as after a broker restart: opens CONNECTIONS connections at once, each sending CONNECT, and reports
+# CONNACKs/sec and CONNACK latency. A second batch then reconnects with the same client ids while the first is still
+# connected, to measure session takeover.
+# Run against a started MQTTtoInfluxDB. Needs a file descriptor limit above twice CONNECTIONS, on both ends
+CONNECTIONS=${1:-50000}
+ulimit -n $((2*CONNECTIONS+1024)) || exit 1
+
+python3 - $CONNECTIONS <<'PYTHON'
+import asyncio, struct, sys, time
+
+CONNECTIONS = int(sys.argv[1])
+
+def connect_packet(client_id):
+    client_id = client_id.encode()
+    variable_header = b"\x00\x04MQTT\x04\x02\x00\x3c" # MQTT 3.1.1, Clean Session, Keep Alive 60 s
+    payload = struct.pack("!H", len(client_id)) + client_id
+    return bytes([0x10, len(variable_header)+len(payload)]) + variable_header + payload
+
+async def connect(i, latencies, writers):
+    reader, writer = await asyncio.open_connection("localhost", 1883)
+    start = time.monotonic()
+    writer.write(connect_packet(f"bench{i}"))
+    connack = await reader.readexactly(4)
+    if connack[0] == 0x20 and connack[3] == 0x00:
+        latencies.append(time.monotonic()-start)
+    writers.append(writer)
+
+async def batch(name, writers):
+    latencies = []
+    start = time.monotonic()
+    await asyncio.gather(*(connect(i, latencies, writers) for i in range(CONNECTIONS)), return_exceptions=True)
+    seconds = time.monotonic()-start
+    failed = CONNECTIONS - len(latencies)
+    latencies.sort()
+    print(f"{name}: {len(latencies)} CONNACKs in {seconds:.2f} s ({len(latencies)/seconds:.0f}/s), {failed} failed")
+    if latencies:
+        for percentile in (0.5, 0.99, 1.0):
+            print(f"p{percentile*100:g} {latencies[min(len(latencies)-1, int(percentile*len(latencies)))]*1000:.1f} ms")
+
+async def main():
+    writers = []
+    await batch("connect", writers)
+    # Same client ids, so each CONNECT takes over a connected session
+    await batch("takeover", writers)
+    for writer in writers:
+        writer.close()
+
+asyncio.run(main())
+PYTHON
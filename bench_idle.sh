@@ -0,0 +1,22 @@
+#!/bin/sh
+
+# Socket syscalls while a stream of PUBLISH packets arrives among many mostly idle connections.
+# Run against a started MQTTtoInfluxDB. strace needs permission to attach to it. To compare the connection backends, run it
+# once against a build made with IO_URING=YES and once against one without. MQTTtoInfluxDB --bench-io compares them in-process
+CONNECTIONS=${1:-1000}
+MESSAGES=${2:-100000}
+PID=$(pidof MQTTtoInfluxDB)
+
+for i in $(seq $CONNECTIONS); do
+  mosquitto_sub -h localhost -p 1883 -t "idle/$i" > /dev/null &
+done
+sleep 5
+
+strace -c -f -p $PID -e trace=read,recvfrom,recvmsg,write,sendto,sendmsg,poll,io_uring_enter &
+STRACE=$!
+sleep 1
+seq $MESSAGES | mosquitto_pub -h localhost -p 1883 -q 1 -t "minidrivhus/sensor1/temp" -l
+kill -INT $STRACE
+wait $STRACE
+
+kill $(jobs -p) 2> /dev/null
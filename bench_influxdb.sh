@@ -0,0 +1,78 @@
+#!/bin/sh
+
+# Stand-in InfluxDB for watching the write controller adapt. Listens on PORT, answers /write after a latency that grows with
+# the batch length and with the number of concurrent writes, and answers ERROR_PERCENT of writes with 503 and Retry-After: 1.
+# Prints writes, mean batch length and concurrent writes every second, while publishing RATE messages/sec over MQTT.
+# Run against a started MQTTtoInfluxDB with a [server] section pointing at localhost:PORT and a rule for bench/{1}/value
+PORT=${1:-8087}
+RATE=${2:-20000}
+ERROR_PERCENT=${3:-0}
+
+python3 - $PORT $RATE $ERROR_PERCENT <<'PYTHON'
+import http.server, random, socket, socketserver, struct, sys, threading, time
+
+PORT, RATE, ERROR_PERCENT = int(sys.argv[1]), int(sys.argv[2]), float(sys.argv[3])
+lock = threading.Lock()
+stats = {"writes": 0, "bytes": 0, "errors": 0, "concurrent": 0, "peak": 0}
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_POST(self):
+        body = self.rfile.read(int(self.headers["Content-Length"]))
+        with lock:
+            stats["concurrent"] += 1
+            stats["peak"] = max(stats["peak"], stats["concurrent"])
+            concurrent = stats["concurrent"]
+        # 5 ms per request, 20 ms per MB, and twice that for every other write in flight
+        time.sleep((0.005 + 0.02*len(body)/1e6) * (1 + 2*(concurrent-1)))
+        failed = random.uniform(0, 100) < ERROR_PERCENT
+        with lock:
+            stats["concurrent"] -= 1
+            stats["writes"] += 1
+            stats["bytes"] += len(body)
+            stats["errors"] += failed
+        self.send_response(503 if failed else 204)
+        if failed:
+            self.send_header("Retry-After", "1")
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    def log_message(self, *args):
+        pass
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+def publish():
+    def packet(fixed_header, body):
+        length, encoded = len(body), b""
+        while True:
+            byte, length = length % 128, length // 128
+            encoded += bytes([byte | (0x80 if length else 0)])
+            if not length:
+                return bytes([fixed_header]) + encoded + body
+    mqtt = socket.create_connection(("localhost", 1883))
+    mqtt.sendall(packet(0x10, b"\x00\x04MQTT\x04\x02\x00\x3c" + struct.pack("!H", 5) + b"bench"))
+    mqtt.recv(4)
+    sent, start = 0, time.monotonic()
+    while True:
+        topic = f"bench/{sent%1000}/value".encode()
+        mqtt.sendall(packet(0x30, struct.pack("!H", len(topic)) + topic + str(random.uniform(0, 100)).encode()))
+        sent += 1
+        if sent % 100 == 0:
+            time.sleep(max(0, start + sent/RATE - time.monotonic()))
+
+server = Server(("", PORT), Handler)
+threading.Thread(target=server.serve_forever, daemon=True).start()
+threading.Thread(target=publish, daemon=True).start()
+print("second\twrites\tmean_batch_bytes\tpeak_concurrent\terrors")
+second = 0
+while True:
+    time.sleep(1)
+    second += 1
+    with lock:
+        writes, bytes_, peak, errors = stats["writes"], stats["bytes"], stats["peak"], stats["errors"]
+        stats.update(writes=0, bytes=0, peak=stats["concurrent"], errors=0)
+    print(f"{second}\t{writes}\t{bytes_//max(1, writes)}\t{peak}\t{errors}", flush=True)
+PYTHON
@@ -0,0 +1,6 @@
+#!/bin/sh
+
+# Handshakes/sec against mqtt_port_tls, with full handshakes (-new) and with session resumption (-reuse).
+# Requires tls_certificate= and tls_private_key= in [settings]
+openssl s_time -connect localhost:8883 -new -time 10
+openssl s_time -connect localhost:8883 -reuse -time 10
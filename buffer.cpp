@@ -1,18 +1,27 @@
 #include "buffer.h"
 
+#include <algorithm>
 
-Buffer::Buffer(asio::ip::tcp::socket& socket) noexcept
-: m_socket(&socket),
+
+Buffer::Buffer(Connection& connection) noexcept
+: m_connection(&connection),
   m_capacity(0L),
   m_length(0L),
   m_parse_pos(0L)
 {
 }
 
+Buffer::~Buffer()
+{
+  if (m_capacity > 0)
+    m_connection->getMemoryAccount()->release(MemoryAccount::PACKET_BUFFER, m_capacity);
+}
+
 std::error_code Buffer::grow(size_t capacity)
 {
   if (capacity > m_capacity)
   {
+    capacity = std::max(capacity, DEFAULT_LENGTH); //The fixed header is read a byte at a time. Small packets fit the first allocation
     std::unique_ptr databuffer = std::make_unique<uint8_t[]>(capacity);
     if (!databuffer)
       return std::make_error_code(std::errc::not_enough_memory);
@@ -22,6 +31,7 @@ std::error_code Buffer::grow(size_t capacity)
       std::memcpy(databuffer.get(), m_databuffer.get(), m_length);
     }
     m_databuffer = std::move(databuffer);
+    m_connection->getMemoryAccount()->charge(MemoryAccount::PACKET_BUFFER, capacity-m_capacity);
     m_capacity = capacity;
   }
 
@@ -41,7 +51,7 @@ std::error_code Buffer::read(size_t length)
 
 std::error_code Buffer::append(size_t length)
 {
-  if (!m_socket)
+  if (!m_connection)
   {
     return std::make_error_code(std::errc::not_a_socket);
   }
@@ -49,9 +59,10 @@ std::error_code Buffer::append(size_t length)
   std::error_code error_code;
   try
   {
-    if (IS_OK(error_code=grow(m_length+length)))
+    if (IS_OK(error_code=grow(m_length+length)) &&
+        IS_OK(error_code=m_connection->read(m_databuffer.get()+m_length, length)))
     {
-      m_length += m_socket->read_some(asio::buffer(m_databuffer.get()+m_length, m_capacity-m_length), error_code);
+      m_length += length;
     }
 
     return error_code;
@@ -65,31 +76,27 @@ std::error_code Buffer::append(size_t length)
 
 // If returning OK, parsed_length will be incremented by the number of bytes consumed
 std::error_code Buffer::parseString(const uint8_t* buffer, size_t length, size_t& parse_pos, std::string& value)
+{
+  std::string_view view;
+  std::error_code error_code = parseString(buffer, length, parse_pos, view);
+  value.assign(view);
+  return error_code;
+}
+
+// If returning OK, parsed_length will be incremented by the number of bytes consumed
+std::error_code Buffer::parseString(const uint8_t* buffer, size_t length, size_t& parse_pos, std::string_view& value)
 {
   size_t local_parse_pos = parse_pos;
   uint16_t string_length;
   std::error_code error_code;
+  value = std::string_view();
   if (IS_ERROR(error_code=parseUint16(buffer, length, local_parse_pos, string_length)))
-  {
-    value = "";
     return error_code;
-  }
 
   if (local_parse_pos+string_length > length)
-  {
-    value = "";
     return std::make_error_code(std::errc::message_size);
-  }
-
-  if (string_length == 0)
-  {
-    value = "";
-  }
-  else
-  {
-    value.assign(reinterpret_cast<const char*>(buffer+local_parse_pos), string_length);
-  }
 
+  value = std::string_view(reinterpret_cast<const char*>(buffer+local_parse_pos), string_length);
   parse_pos = local_parse_pos + string_length;
   return error_code;
 }
@@ -97,7 +104,7 @@ std::error_code Buffer::parseString(const uint8_t* buffer, size_t length, size_t
 // If returning OK, parsed_length will be incremented by the number of bytes consumed
 std::error_code Buffer::parseUint8(const uint8_t* buffer, size_t length, size_t& parse_pos, uint8_t& value)
 {
-  if (parse_pos+1 >= length)
+  if (parse_pos+1 > length)
   {
     value = 0;
     return std::make_error_code(std::errc::message_size);
@@ -111,7 +118,7 @@ std::error_code Buffer::parseUint8(const uint8_t* buffer, size_t length, size_t&
 // If returning OK, parsed_length will be incremented by the number of bytes consumed
 std::error_code Buffer::parseUint16(const uint8_t* buffer, size_t length, size_t& parse_pos, uint16_t& value)
 {
-  if (parse_pos+2 >= length)
+  if (parse_pos+2 > length)
   {
     value = 0;
     return std::make_error_code(std::errc::message_size);
@@ -125,7 +132,7 @@ std::error_code Buffer::parseUint16(const uint8_t* buffer, size_t length, size_t
 // If returning OK, parsed_length will be incremented by the number of bytes consumed
 std::error_code Buffer::parseUint32(const uint8_t* buffer, size_t length, size_t& parse_pos, uint32_t& value)
 {
-  if (parse_pos+4 >= length)
+  if (parse_pos+4 > length)
   {
     value = 0;
     return std::make_error_code(std::errc::message_size);
@@ -171,6 +178,19 @@ std::error_code Buffer::parseVariableByteInteger(const uint8_t* buffer, size_t l
 
 // If returning OK, parsed_length will be incremented by the number of bytes consumed
 std::error_code Buffer::parseBinaryData(const uint8_t* buffer, size_t length, size_t& parse_pos, std::shared_ptr<uint8_t[]>& value)
+{
+  std::span<const uint8_t> view;
+  std::error_code error_code;
+  if (IS_ERROR(error_code=parseBinaryData(buffer, length, parse_pos, view)))
+    return error_code;
+
+  value = std::shared_ptr<uint8_t[]>(new uint8_t[view.size()]);
+  std::memcpy(value.get(), view.data(), view.size());
+  return error_code;
+}
+
+// If returning OK, parsed_length will be incremented by the number of bytes consumed
+std::error_code Buffer::parseBinaryData(const uint8_t* buffer, size_t length, size_t& parse_pos, std::span<const uint8_t>& value)
 {
   size_t local_parse_pos = parse_pos;
   uint16_t data_length;
@@ -183,8 +203,7 @@ std::error_code Buffer::parseBinaryData(const uint8_t* buffer, size_t length, si
     return std::make_error_code(std::errc::message_size);
   }
 
-  value = std::shared_ptr<uint8_t[]>(new uint8_t[data_length]);
-  std::memcpy(value.get(), buffer+local_parse_pos, data_length);
+  value = std::span<const uint8_t>(buffer+local_parse_pos, data_length);
   parse_pos = local_parse_pos + data_length;
   return error_code;
 }
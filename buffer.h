@@ -1,8 +1,12 @@
 #ifndef _BUFFER_H_
 #define _BUFFER_H_
 
-#include <asio.hpp>
 #include <memory>
+#include <span>
+#include <string_view>
+#include <system_error>
+
+#include "connection.h"
 
 #define IS_OK(x) (!(x))
 #define IS_ERROR(x) ((x))
@@ -14,7 +18,8 @@ private:
   static constexpr size_t DEFAULT_LENGTH = 20L;
 
 public:
-  Buffer(asio::ip::tcp::socket& socket) noexcept;
+  Buffer(Connection& connection) noexcept;
+  ~Buffer();
 
 private:
   [[nodiscard]] std::error_code grow(size_t capacity);
@@ -22,29 +27,40 @@ private:
 public:
   void clear();
   [[nodiscard]] std::error_code read(size_t length=DEFAULT_LENGTH);
-  [[nodiscard]] std::error_code append(size_t length=DEFAULT_LENGTH);
+  [[nodiscard]] std::error_code append(size_t length=DEFAULT_LENGTH); // Blocks until exactly length bytes are read
 
   [[nodiscard]] size_t getReadLength() const {return m_length;}
   [[nodiscard]] size_t getParsePos() const {return m_parse_pos;}
   [[nodiscard]] size_t getUnparsedLength() const {return m_length-m_parse_pos;}
+  [[nodiscard]] const uint8_t* getUnparsedData() const {return m_databuffer.get()+m_parse_pos;}
+  [[nodiscard]] uint8_t getByte(size_t pos) const {return m_databuffer[pos];}
+  [[nodiscard]] const uint8_t* getData() const {return m_databuffer.get();}
+
+  [[nodiscard]] Connection* getConnection() const {return m_connection;}
 
 public:
   [[nodiscard]] std::error_code parseString(std::string& value) {return parseString(m_databuffer.get(), m_length, m_parse_pos, value);}
+  // Points into this Buffer
+  [[nodiscard]] std::error_code parseString(std::string_view& value) {return parseString(m_databuffer.get(), m_length, m_parse_pos, value);}
   [[nodiscard]] std::error_code parseUint8(uint8_t& value) {return parseUint8(m_databuffer.get(), m_length, m_parse_pos, value);}
   [[nodiscard]] std::error_code parseUint16(uint16_t& value) {return parseUint16(m_databuffer.get(), m_length, m_parse_pos, value);}
   [[nodiscard]] std::error_code parseUint32(uint32_t& value) {return parseUint32(m_databuffer.get(), m_length, m_parse_pos, value);}
   [[nodiscard]] std::error_code parseVariableByteInteger(uint32_t& value) {return parseVariableByteInteger(m_databuffer.get(), m_length, m_parse_pos, value);}
   [[nodiscard]] std::error_code parseBinaryData(std::shared_ptr<uint8_t[]>& value) {return parseBinaryData(m_databuffer.get(), m_length, m_parse_pos, value);}
+  // Points into this Buffer
+  [[nodiscard]] std::error_code parseBinaryData(std::span<const uint8_t>& value) {return parseBinaryData(m_databuffer.get(), m_length, m_parse_pos, value);}
 private:
   [[nodiscard]] std::error_code parseString(const uint8_t* buffer, size_t length, size_t& parse_pos, std::string& value);
+  [[nodiscard]] std::error_code parseString(const uint8_t* buffer, size_t length, size_t& parse_pos, std::string_view& value);
   [[nodiscard]] std::error_code parseUint8(const uint8_t* buffer, size_t length, size_t& parse_pos, uint8_t& value);
   [[nodiscard]] std::error_code parseUint16(const uint8_t* buffer, size_t length, size_t& parse_pos, uint16_t& value);
   [[nodiscard]] std::error_code parseUint32(const uint8_t* buffer, size_t length, size_t& parse_pos, uint32_t& value);
   [[nodiscard]] std::error_code parseVariableByteInteger(const uint8_t* buffer, size_t length, size_t& parse_pos, uint32_t& value);
   [[nodiscard]] std::error_code parseBinaryData(const uint8_t* buffer, size_t length, size_t& parse_pos, std::shared_ptr<uint8_t[]>& value);
+  [[nodiscard]] std::error_code parseBinaryData(const uint8_t* buffer, size_t length, size_t& parse_pos, std::span<const uint8_t>& value);
 
 private:
-  asio::ip::tcp::socket* m_socket;
+  Connection* m_connection;
   std::unique_ptr<uint8_t[]> m_databuffer;
   size_t m_capacity;
   size_t m_length;
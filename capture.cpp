@@ -0,0 +1,223 @@
+#include "capture.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+
+#include "clock.h"
+#include "connection.h"
+#include "log.h"
+#include "session.h"
+#include "packets/packet.h"
+
+
+std::atomic<bool> Capture::s_enabled(false);
+std::mutex Capture::s_file_lock;
+std::FILE* Capture::s_file = nullptr;
+
+
+// Appends to an existing capture, as a new run
+bool Capture::start(const std::string& filename)
+{
+  std::lock_guard<std::mutex> lock(s_file_lock);
+  s_file = std::fopen(filename.c_str(), "a+b");
+  if (!s_file)
+  {
+    std::cerr << "Could not open capture file \"" << filename << "\": " << std::strerror(errno) << std::endl;
+    return false;
+  }
+
+  std::setvbuf(s_file, nullptr, _IOFBF, FILE_BUFFER_LENGTH);
+
+  char magic[sizeof(MAGIC)];
+  std::fseek(s_file, 0, SEEK_END);
+  if (0 == std::ftell(s_file))
+  {
+    std::fwrite(MAGIC, sizeof(MAGIC), 1, s_file);
+  }
+  else if (0!=std::fseek(s_file, 0, SEEK_SET) || 1!=std::fread(magic, sizeof(magic), 1, s_file) || 0!=std::memcmp(magic, MAGIC, sizeof(MAGIC)))
+  {
+    std::cerr << "\"" << filename << "\" is not a capture file of this version, not appending to it" << std::endl;
+    std::fclose(s_file);
+    s_file = nullptr;
+    return false;
+  }
+  std::fseek(s_file, 0, SEEK_END); //Before writing after a read
+
+  s_enabled.store(true, std::memory_order_relaxed);
+  writeRecord(Clock::realtimeNs(), RUN_START, nullptr, 0);
+  return true;
+}
+
+void Capture::write(const Connection& connection, const uint8_t* frame, size_t length)
+{
+  const int64_t timestamp = Clock::realtimeNs();
+  std::lock_guard<std::mutex> lock(s_file_lock);
+  if (s_file)
+    writeRecord(timestamp, connection.getId(), frame, length);
+}
+
+// Called with s_file_lock held
+void Capture::writeRecord(int64_t timestamp, uint32_t connection_id, const uint8_t* frame, size_t length)
+{
+  const uint32_t frame_length = static_cast<uint32_t>(length);
+  uint8_t header[RECORD_HEADER_LENGTH];
+  std::memcpy(header, &timestamp, 8);
+  std::memcpy(header+8, &connection_id, 4);
+  std::memcpy(header+12, &frame_length, 4);
+
+  std::fwrite(header, sizeof(header), 1, s_file);
+  if (length > 0)
+    std::fwrite(frame, 1, length, s_file);
+}
+
+bool Capture::load(const std::string& filename, std::vector<Record>& records)
+{
+  std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(filename.c_str(), "rb"), std::fclose);
+  char magic[sizeof(MAGIC)];
+  if (!file || 1!=std::fread(magic, sizeof(magic), 1, file.get()) || 0!=std::memcmp(magic, MAGIC, sizeof(MAGIC)))
+  {
+    std::cerr << "\"" << filename << "\" is not a capture file of this version" << std::endl;
+    return false;
+  }
+
+  uint32_t run = 0;
+  int64_t run_timestamp = 0; // Of the first record of the run
+  int64_t run_offset = 0;
+  int64_t end_offset = 0;
+  bool first = true;
+  uint8_t header[RECORD_HEADER_LENGTH];
+  while (1 == std::fread(header, sizeof(header), 1, file.get()))
+  {
+    Record record;
+    int64_t timestamp;
+    uint32_t frame_length;
+    std::memcpy(&timestamp, header, 8);
+    std::memcpy(&record.connection_id, header+8, 4);
+    std::memcpy(&frame_length, header+12, 4);
+
+    if (record.connection_id==RUN_START || first)
+    {
+      if (!first)
+        run++;
+      run_timestamp = timestamp;
+      run_offset = end_offset;
+      first = false;
+    }
+    if (record.connection_id == RUN_START)
+      continue;
+
+    record.run = run;
+    record.offset = run_offset + std::max<int64_t>(0, timestamp-run_timestamp);
+    end_offset = std::max(end_offset, record.offset);
+    record.frame.resize(frame_length);
+    if (frame_length>0 && 1!=std::fread(record.frame.data(), frame_length, 1, file.get()))
+    {
+      std::cerr << "Capture file \"" << filename << "\" is truncated after " << records.size() << " frames" << std::endl;
+      break;
+    }
+    records.push_back(std::move(record));
+  }
+
+  return true;
+}
+
+bool Capture::replay(const std::string& filename, unsigned int threads, bool recorded_speed)
+{
+  std::vector<Record> records;
+  if (!load(filename, records))
+    return false;
+
+  if (records.empty())
+    return true;
+
+  threads = std::max(1U, threads);
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (unsigned int worker=0; worker<threads; worker++)
+  {
+    workers.emplace_back(&Capture::replayWorker, std::cref(records), worker, threads, recorded_speed);
+  }
+  for (std::thread& worker : workers)
+  {
+    worker.join();
+  }
+
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+  std::cout << "Replayed " << records.size() << " frames in " << seconds << " s (" << records.size()/seconds << " frames/s) on "
+            << threads << " threads" << std::endl;
+  return true;
+}
+
+void Capture::replayWorker(const std::vector<Record>& records, unsigned int worker, unsigned int threads, bool recorded_speed)
+{
+  struct Replayed {
+    std::unique_ptr<MemoryConnection> connection = std::make_unique<MemoryConnection>();
+    std::shared_ptr<Session> session;
+    bool closed = false;
+  };
+
+  // Only connections of the current run
+  std::unordered_map<uint32_t,Replayed> connections;
+  uint32_t run = records.front().run;
+  const auto detachAll = [&connections]()
+  {
+    for (auto& connection : connections)
+    {
+      if (!connection.second.closed && connection.second.session)
+        connection.second.session->detach();
+    }
+    connections.clear();
+  };
+
+  const auto start = std::chrono::steady_clock::now();
+  for (const Record& record : records)
+  {
+    if ((record.connection_id+record.run)%threads != worker)
+      continue;
+
+    if (record.run != run)
+    {
+      detachAll();
+      run = record.run;
+    }
+
+    Replayed& replayed = connections[record.connection_id];
+    if (replayed.closed) // The server would have closed the connection at the first error, as in Server::session
+      continue;
+
+    if (recorded_speed)
+      std::this_thread::sleep_until(start + std::chrono::nanoseconds(record.offset));
+
+    replayed.connection->feed(record.frame.data(), record.frame.size());
+    try
+    {
+      size_t fixed_header_length;
+      size_t total_length;
+      std::shared_ptr<BasePacket> packet;
+      if (IS_OK(BasePacket::createPacket(*replayed.connection, packet, fixed_header_length, total_length)))
+      {
+        packet->setSession(replayed.session);
+        if (IS_ERROR(packet->parse()))
+          replayed.closed = true;
+        replayed.session = packet->getSession();
+      }
+      else
+      {
+        replayed.closed = true;
+      }
+    }
+    catch (std::exception& e)
+    {
+      Log::write(Log::REPLAY_EXCEPTION, e.what());
+    }
+
+    if (replayed.closed && replayed.session)
+      replayed.session->detach();
+  }
+
+  detachAll();
+}
@@ -0,0 +1,66 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <system_error>
+#include <vector>
+
+class Connection;
+
+
+/*
+ * Captures every inbound MQTT frame to a binary file, and replays such a file through the packet parser and the router
+ * without sockets.
+ *
+ * The file starts with MAGIC, followed by one record per frame, in host byte order:
+ *   int64 receive timestamp (ns since epoch), uint32 connection id, uint32 frame length, frame (Fixed Header included)
+ * Every start of the server appends a record with connection id 0 and no frame, which begins a run. Connection ids restart
+ * with each run, so a connection is identified by its run and id. The client id is in the CONNECT frame of the connection.
+ * A PUBLISH larger than PublishPacket::MAX_BUFFERED_LENGTH is streamed rather than held in memory, and is not captured.
+ */
+class Capture
+{
+private:
+  static constexpr char MAGIC[8] = {'M','Q','T','T','C','A','P','2'};
+  static constexpr size_t RECORD_HEADER_LENGTH = 8+4+4;
+  static constexpr uint32_t RUN_START = 0; // Connection ids start at 1
+  static constexpr size_t FILE_BUFFER_LENGTH = 1024*1024L;
+
+  struct Record {
+    int64_t offset; // ns since the first frame, with the time between runs left out
+    uint32_t run;
+    uint32_t connection_id;
+    std::vector<uint8_t> frame;
+  };
+
+public:
+  [[nodiscard]] static bool start(const std::string& filename);
+
+  static void record(const Connection& connection, const uint8_t* frame, size_t length)
+  {
+    if (s_enabled.load(std::memory_order_relaxed))
+      write(connection, frame, length);
+  }
+
+  // Replays filename on threads worker threads. A connection is always replayed by the same worker, in capture order. The
+  // sessions of a run are detached when the next run starts, as the server's restart closed them.
+  // With recorded_speed, frames are held back until the time they were received, relative to the first frame
+  [[nodiscard]] static bool replay(const std::string& filename, unsigned int threads, bool recorded_speed);
+
+private:
+  static void write(const Connection& connection, const uint8_t* frame, size_t length);
+  static void writeRecord(int64_t timestamp, uint32_t connection_id, const uint8_t* frame, size_t length);
+  [[nodiscard]] static bool load(const std::string& filename, std::vector<Record>& records);
+  static void replayWorker(const std::vector<Record>& records, unsigned int worker, unsigned int threads, bool recorded_speed);
+
+private:
+  static std::atomic<bool> s_enabled;
+  static std::mutex s_file_lock;
+  static std::FILE* s_file;
+};
+
+#endif // _CAPTURE_H_
@@ -0,0 +1,63 @@
+#include "clock.h"
+
+#include <thread>
+#include <time.h>
+
+
+std::atomic<int64_t> Clock::s_realtime_ns(0);
+std::atomic<int64_t> Clock::s_monotonic_ns(0);
+
+namespace
+{
+  clockid_t s_realtime_clock = CLOCK_REALTIME;
+  clockid_t s_monotonic_clock = CLOCK_MONOTONIC;
+
+  // The coarse clocks skip the hardware read, but tick once per jiffy. Only use them if that is as fine as the update interval
+  bool isFineEnough(clockid_t clock)
+  {
+    timespec resolution;
+    return 0==::clock_getres(clock, &resolution) && resolution.tv_sec==0 && resolution.tv_nsec<=1000000L;
+  }
+
+  int64_t read(clockid_t clock)
+  {
+    timespec now;
+    ::clock_gettime(clock, &now);
+    return now.tv_sec*1000000000L + now.tv_nsec;
+  }
+}
+
+
+bool Clock::parsePrecision(std::string_view text, Precision& precision)
+{
+  if (text == "s")       precision = SECONDS;
+  else if (text == "ms") precision = MILLISECONDS;
+  else if (text == "us") precision = MICROSECONDS;
+  else if (text == "ns") precision = NANOSECONDS;
+  else return false;
+  return true;
+}
+
+void Clock::start()
+{
+  if (isFineEnough(CLOCK_REALTIME_COARSE))
+    s_realtime_clock = CLOCK_REALTIME_COARSE;
+  if (isFineEnough(CLOCK_MONOTONIC_COARSE))
+    s_monotonic_clock = CLOCK_MONOTONIC_COARSE;
+  update();
+
+  std::thread([]()
+  {
+    while (true)
+    {
+      std::this_thread::sleep_for(UPDATE_INTERVAL);
+      update();
+    }
+  }).detach();
+}
+
+void Clock::update()
+{
+  s_realtime_ns.store(read(s_realtime_clock), std::memory_order_relaxed);
+  s_monotonic_ns.store(read(s_monotonic_clock), std::memory_order_relaxed);
+}
@@ -0,0 +1,52 @@
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <string_view>
+
+
+/*
+ * Process wide cached clock. A background thread refreshes the cached realtime and monotonic time every millisecond, so the
+ * message path reads "now" with a relaxed atomic load instead of calling clock_gettime. The resolution is one millisecond.
+ */
+class Clock
+{
+public:
+  enum Precision : uint8_t {
+    SECONDS,
+    MILLISECONDS,
+    MICROSECONDS,
+    NANOSECONDS,
+    PRECISION_COUNT
+  };
+
+private:
+  static constexpr std::chrono::milliseconds UPDATE_INTERVAL{1};
+  static constexpr const char* PRECISION_NAMES[PRECISION_COUNT] = {"s", "ms", "u", "ns"}; // As in the InfluxDB precision parameter
+  static constexpr int64_t PRECISION_DIVISORS[PRECISION_COUNT] = {1000000000L, 1000000L, 1000L, 1L};
+
+public:
+  [[nodiscard]] static int64_t realtimeNs() {return s_realtime_ns.load(std::memory_order_relaxed);}
+  [[nodiscard]] static int64_t realtimeMs() {return realtimeNs()/1000000L;}
+  [[nodiscard]] static int64_t monotonicNs() {return s_monotonic_ns.load(std::memory_order_relaxed);}
+  [[nodiscard]] static int64_t monotonicMs() {return monotonicNs()/1000000L;}
+
+  // "s", "ms", "us" or "ns"
+  [[nodiscard]] static bool parsePrecision(std::string_view text, Precision& precision);
+  [[nodiscard]] static const char* getPrecisionName(Precision precision) {return PRECISION_NAMES[precision];}
+  [[nodiscard]] static int64_t toPrecision(int64_t ns, Precision precision) {return ns/PRECISION_DIVISORS[precision];}
+
+  // Sets the cached time, and starts refreshing it. Call before anything reads the clock
+  static void start();
+
+private:
+  static void update();
+
+private:
+  static std::atomic<int64_t> s_realtime_ns;
+  static std::atomic<int64_t> s_monotonic_ns;
+};
+
+#endif // _CLOCK_H_
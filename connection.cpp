@@ -0,0 +1,679 @@
+#include "connection.h"
+
+#include <algorithm>
+#include <cstring>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "clock.h"
+#include "log.h"
+
+
+Connection::~Connection()
+{
+  m_memory_account->release(MemoryAccount::WRITE_QUEUE, m_posted.size()+m_unwritten_length.load(std::memory_order_relaxed));
+}
+
+std::error_code Connection::post(const uint8_t* data, size_t length, size_t limit)
+{
+  bool was_empty;
+  {
+    std::lock_guard<std::mutex> lock(m_post_lock);
+    if (isClosing())
+      return std::make_error_code(std::errc::not_connected);
+    if (m_posted.size() + m_unwritten_length.load(std::memory_order_relaxed) + length > limit)
+      return std::make_error_code(std::errc::no_buffer_space);
+
+    was_empty = m_posted.empty();
+    m_posted.insert(m_posted.end(), data, data+length);
+    m_memory_account->charge(MemoryAccount::WRITE_QUEUE, length);
+    m_has_posted.store(true, std::memory_order_release);
+  }
+
+  // A wake for earlier posts is still due, as the session thread takes everything posted after it was woken
+  if (was_empty)
+    wake();
+  return std::error_code();
+}
+
+void Connection::close()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_post_lock);
+    m_closing.store(true, std::memory_order_release);
+  }
+  wake();
+}
+
+void Connection::takePosted(std::vector<uint8_t>& output)
+{
+  std::lock_guard<std::mutex> lock(m_post_lock);
+  m_memory_account->release(MemoryAccount::WRITE_QUEUE, m_posted.size()); //Charged again as unwritten, if it is not written at once
+  if (output.empty())
+    output.swap(m_posted);
+  else
+    output.insert(output.end(), m_posted.begin(), m_posted.end());
+  m_posted.clear();
+  m_has_posted.store(false, std::memory_order_release);
+}
+
+
+void Connection::setUnwrittenLength(size_t length)
+{
+  const size_t previous = m_unwritten_length.exchange(length, std::memory_order_relaxed);
+  if (length > previous)
+    m_memory_account->charge(MemoryAccount::WRITE_QUEUE, length-previous);
+  else if (length < previous)
+    m_memory_account->release(MemoryAccount::WRITE_QUEUE, previous-length);
+}
+
+
+SocketConnection::SocketConnection(asio::ip::tcp::socket socket)
+: m_socket(std::move(socket)),
+  m_wakeup_fd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), // poll() skips it if this failed. Posts then wait for the next read
+  m_read_buffer(std::make_unique_for_overwrite<uint8_t[]>(READ_BUFFER_LENGTH)),
+  m_read_pos(0),
+  m_read_end(0),
+  m_output_pos(0)
+{
+}
+
+SocketConnection::~SocketConnection()
+{
+  if (m_wakeup_fd >= 0)
+    ::close(m_wakeup_fd);
+}
+
+std::error_code SocketConnection::read(uint8_t* data, size_t length)
+{
+  std::error_code error_code;
+  short events;
+
+  // A session that always has input waiting still sends what was posted for it
+  if (hasPosted() && IS_ERROR(error_code=writeOutput(events)))
+    return error_code;
+
+  while (length > 0)
+  {
+    if (m_read_pos == m_read_end)
+    {
+      // A large payload bypasses the buffer
+      const bool bypass = length >= READ_BUFFER_LENGTH;
+      size_t received;
+      if (IS_ERROR(error_code=receive(bypass ? data : m_read_buffer.get(), bypass ? length : READ_BUFFER_LENGTH, received, events)))
+        return error_code;
+
+      if (received == 0)
+      {
+        if (IS_ERROR(error_code=wait(events, -1)))
+          return error_code;
+      }
+      else if (bypass)
+      {
+        data += received;
+        length -= received;
+      }
+      else
+      {
+        m_read_pos = 0;
+        m_read_end = received;
+      }
+      continue;
+    }
+
+    const size_t available = std::min(length, m_read_end-m_read_pos);
+    std::memcpy(data, m_read_buffer.get()+m_read_pos, available);
+    m_read_pos += available;
+    data += available;
+    length -= available;
+  }
+  return error_code;
+}
+
+// Queued behind what was posted, so packets go out in the order they were written
+std::error_code SocketConnection::write(const uint8_t* data, size_t length)
+{
+  takePosted(m_output);
+  m_output.insert(m_output.end(), data, data+length);
+
+  const int64_t deadline_ms = Clock::monotonicMs() + std::chrono::milliseconds(WRITE_TIMEOUT).count();
+  std::error_code error_code;
+  while (IS_OK(error_code) && m_output_pos<m_output.size())
+  {
+    error_code = wait(0, deadline_ms);
+  }
+  return error_code;
+}
+
+void SocketConnection::wake()
+{
+  const uint64_t count = 1;
+  if (m_wakeup_fd >= 0)
+    (void)!::write(m_wakeup_fd, &count, sizeof(count));
+}
+
+std::error_code SocketConnection::writeOutput(short& events)
+{
+  std::error_code error_code;
+  events = 0;
+  if (hasPosted())
+    takePosted(m_output);
+
+  while (m_output_pos < m_output.size())
+  {
+    size_t sent;
+    if (IS_ERROR(error_code=send(m_output.data()+m_output_pos, m_output.size()-m_output_pos, sent, events)))
+      return error_code;
+    if (sent == 0)
+      break;
+    m_output_pos += sent;
+  }
+
+  if (m_output_pos == m_output.size())
+  {
+    m_output.clear();
+    m_output_pos = 0;
+  }
+  else if (m_output_pos > m_output.size()/2)
+  {
+    m_output.erase(m_output.begin(), m_output.begin()+m_output_pos);
+    m_output_pos = 0;
+  }
+  setUnwrittenLength(m_output.size()-m_output_pos);
+  return error_code;
+}
+
+std::error_code SocketConnection::wait(short events, int64_t deadline_ms)
+{
+  while (true)
+  {
+    short output_events;
+    std::error_code error_code;
+    if (IS_ERROR(error_code=writeOutput(output_events)))
+      return error_code;
+    if (isClosing())
+      return std::make_error_code(std::errc::connection_aborted);
+    if (events==0 && m_output_pos==m_output.size()) //Only waited for output to be written
+      return error_code;
+
+    int timeout_ms = -1;
+    if (deadline_ms >= 0)
+    {
+      const int64_t now = Clock::monotonicMs();
+      if (now >= deadline_ms)
+        return std::make_error_code(std::errc::timed_out);
+      timeout_ms = static_cast<int>(deadline_ms-now);
+    }
+
+    struct pollfd fds[2] = {{m_socket.native_handle(), static_cast<short>(events | output_events), 0}, {m_wakeup_fd, POLLIN, 0}};
+    if (::poll(fds, 2, timeout_ms) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return std::error_code(errno, std::generic_category());
+    }
+
+    if (fds[1].revents & POLLIN)
+    {
+      uint64_t count;
+      (void)!::read(m_wakeup_fd, &count, sizeof(count));
+    }
+    if (fds[0].revents & (events | POLLERR | POLLHUP))
+      return error_code;
+  }
+}
+
+
+TcpConnection::TcpConnection(asio::ip::tcp::socket socket)
+: SocketConnection(std::move(socket))
+{
+  std::error_code error_code;
+  m_socket.non_blocking(true, error_code);
+}
+
+std::error_code TcpConnection::receive(uint8_t* data, size_t length, size_t& received, short& events)
+{
+  std::error_code error_code;
+  received = m_socket.read_some(asio::buffer(data, length), error_code);
+  events = 0;
+  if (error_code == asio::error::would_block)
+  {
+    error_code.clear();
+    events = POLLIN;
+  }
+  return error_code;
+}
+
+std::error_code TcpConnection::send(const uint8_t* data, size_t length, size_t& sent, short& events)
+{
+  std::error_code error_code;
+  sent = m_socket.write_some(asio::buffer(data, length), error_code);
+  events = 0;
+  if (error_code == asio::error::would_block)
+  {
+    error_code.clear();
+    events = POLLOUT;
+  }
+  return error_code;
+}
+
+
+#ifdef USE_IO_URING
+UringConnection::UringConnection(asio::ip::tcp::socket socket)
+: m_socket(std::move(socket)),
+  m_wakeup_fd(::eventfd(0, EFD_CLOEXEC)), // Read by the ring, which does not care about blocking
+  m_wakeup_count(0),
+  m_in_flight(0),
+  m_buffers(std::make_unique<ReceiveBuffers>()),
+  m_buffer_tail(0),
+  m_multishot(true),
+  m_receiving(false),
+  m_waking(false),
+  m_received_first(0),
+  m_received_count(0),
+  m_read_pos(0),
+  m_output_pos(0),
+  m_sending(false)
+{
+}
+
+std::unique_ptr<Connection> UringConnection::create(asio::ip::tcp::socket socket)
+{
+  if (s_unavailable.load(std::memory_order_relaxed))
+    return std::make_unique<TcpConnection>(std::move(socket));
+
+  std::unique_ptr<UringConnection> connection(new UringConnection(std::move(socket)));
+  const std::error_code error_code = connection->setup();
+  if (IS_OK(error_code))
+    return connection;
+
+  // Running out of memory or file descriptors only fails this connection over to poll
+  if (error_code!=std::errc::not_enough_memory && error_code!=std::errc::too_many_files_open &&
+      error_code!=std::errc::too_many_files_open_in_system && error_code!=std::errc::resource_unavailable_try_again &&
+      !s_unavailable.exchange(true, std::memory_order_relaxed))
+  {
+    Log::write(Log::IO_URING_UNAVAILABLE, error_code);
+  }
+  return std::make_unique<TcpConnection>(std::move(connection->m_socket));
+}
+
+std::error_code UringConnection::setup()
+{
+  std::error_code error_code;
+  if (m_wakeup_fd < 0)
+    return std::error_code(errno, std::generic_category());
+  if (IS_ERROR(error_code=m_ring.setup(RING_ENTRIES)))
+    return error_code;
+  if (IS_ERROR(error_code=m_ring.registerBufferRing(m_buffers->ring, BUFFER_COUNT, BUFFER_GROUP)))
+    return error_code;
+
+  for (uint16_t buffer=0; buffer<BUFFER_COUNT; buffer++)
+  {
+    recycle(buffer);
+  }
+  return error_code;
+}
+
+// Requests still in flight are cancelled and waited for, as they write to the buffers and m_wakeup_count
+UringConnection::~UringConnection()
+{
+  if (m_in_flight > 0)
+  {
+    io_uring_sqe* sqe = m_ring.getSqe();
+    if (sqe)
+    {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+      sqe->user_data = CANCEL;
+      m_in_flight++;
+    }
+    while (m_in_flight > 0)
+    {
+      if (IS_ERROR(m_ring.enter(true, -1)))
+      {
+        (void)m_buffers.release(); //Leaked rather than freed while the kernel may write to them
+        break;
+      }
+      while (const io_uring_cqe* cqe = m_ring.peekCqe())
+      {
+        complete(*cqe);
+        m_ring.popCqe();
+      }
+    }
+  }
+
+  if (m_wakeup_fd >= 0)
+    ::close(m_wakeup_fd);
+}
+
+std::error_code UringConnection::read(uint8_t* data, size_t length)
+{
+  std::error_code error_code;
+
+  // Submitted with the next wait, at the latest once the received buffers are read. A session that always has input
+  // waiting still sends what was posted for it
+  if (hasPosted())
+    queueOutput();
+
+  while (length > 0)
+  {
+    if (m_received_count == 0)
+    {
+      if (IS_ERROR(m_receive_error))
+        return m_receive_error;
+      if (IS_ERROR(error_code=wait(-1)))
+        return error_code;
+      continue;
+    }
+
+    const Received& received = m_received[m_received_first];
+    const size_t available = std::min(length, received.length-m_read_pos);
+    std::memcpy(data, m_buffers->data[received.buffer]+m_read_pos, available);
+    m_read_pos += available;
+    data += available;
+    length -= available;
+
+    if (m_read_pos == received.length)
+    {
+      recycle(received.buffer);
+      m_received_first = (m_received_first+1) % BUFFER_COUNT;
+      m_received_count--;
+      m_read_pos = 0;
+    }
+  }
+  return error_code;
+}
+
+// Queued behind what was posted, so packets go out in the order they were written
+std::error_code UringConnection::write(const uint8_t* data, size_t length)
+{
+  takePosted(m_queued);
+  m_queued.insert(m_queued.end(), data, data+length);
+
+  const int64_t deadline_ms = Clock::monotonicMs() + std::chrono::milliseconds(WRITE_TIMEOUT).count();
+  std::error_code error_code;
+  while (IS_OK(error_code) && (m_sending || m_output_pos<m_output.size() || !m_queued.empty()))
+  {
+    error_code = wait(deadline_ms);
+  }
+  return error_code;
+}
+
+void UringConnection::wake()
+{
+  const uint64_t count = 1;
+  if (m_wakeup_fd >= 0)
+    (void)!::write(m_wakeup_fd, &count, sizeof(count));
+}
+
+void UringConnection::recycle(uint16_t buffer)
+{
+  io_uring_buf& entry = m_buffers->ring[m_buffer_tail % BUFFER_COUNT];
+  entry.addr = reinterpret_cast<uint64_t>(m_buffers->data[buffer]);
+  entry.len = BUFFER_LENGTH;
+  entry.bid = buffer;
+  m_buffer_tail++;
+  std::atomic_ref<uint16_t>(m_buffers->ring[0].resv).store(m_buffer_tail, std::memory_order_release);
+}
+
+void UringConnection::queueOutput()
+{
+  if (hasPosted())
+    takePosted(m_queued);
+
+  if (!m_sending)
+  {
+    if (m_output_pos == m_output.size())
+    {
+      m_output.clear();
+      m_output_pos = 0;
+      m_output.swap(m_queued);
+    }
+
+    io_uring_sqe* sqe;
+    if (m_output_pos<m_output.size() && (sqe=m_ring.getSqe()))
+    {
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = m_socket.native_handle();
+      sqe->addr = reinterpret_cast<uint64_t>(m_output.data()+m_output_pos);
+      sqe->len = static_cast<uint32_t>(std::min<size_t>(m_output.size()-m_output_pos, INT32_MAX));
+      sqe->msg_flags = MSG_NOSIGNAL;
+      sqe->user_data = SEND;
+      m_sending = true;
+      m_in_flight++;
+    }
+  }
+  setUnwrittenLength(m_output.size()-m_output_pos + m_queued.size());
+}
+
+std::error_code UringConnection::wait(int64_t deadline_ms, bool block)
+{
+  io_uring_sqe* sqe;
+  // Without free buffers, a receive would only fail with ENOBUFS. It is queued again once one is read
+  if (!m_receiving && IS_OK(m_receive_error) && m_received_count<BUFFER_COUNT && (sqe=m_ring.getSqe()))
+  {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = m_socket.native_handle();
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->ioprio = m_multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = RECEIVE;
+    m_receiving = true;
+    m_in_flight++;
+  }
+  if (!m_waking && m_wakeup_fd>=0 && (sqe=m_ring.getSqe()))
+  {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = m_wakeup_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&m_wakeup_count);
+    sqe->len = sizeof(m_wakeup_count);
+    sqe->user_data = WAKEUP;
+    m_waking = true;
+    m_in_flight++;
+  }
+  queueOutput();
+
+  // Once closing, what was posted is still submitted, so a DISCONNECT goes out if the client takes it at once
+  const bool closing = isClosing();
+  int timeout_ms = -1;
+  if (deadline_ms >= 0)
+  {
+    const int64_t now = Clock::monotonicMs();
+    if (now >= deadline_ms)
+      return std::make_error_code(std::errc::timed_out);
+    timeout_ms = static_cast<int>(deadline_ms-now);
+  }
+
+  std::error_code error_code;
+  if (IS_ERROR(error_code=m_ring.enter(block && !closing, timeout_ms)))
+    return error_code;
+  while (const io_uring_cqe* cqe = m_ring.peekCqe())
+  {
+    complete(*cqe);
+    m_ring.popCqe();
+  }
+
+  if (closing)
+    return std::make_error_code(std::errc::connection_aborted);
+  return m_send_error;
+}
+
+void UringConnection::complete(const io_uring_cqe& cqe)
+{
+  const bool more = cqe.flags & IORING_CQE_F_MORE;
+  if (!more)
+    m_in_flight--;
+
+  switch (cqe.user_data)
+  {
+    case RECEIVE:
+      if (!more)
+        m_receiving = false;
+      if (cqe.flags & IORING_CQE_F_BUFFER)
+      {
+        const uint16_t buffer = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        if (cqe.res > 0)
+          m_received[(m_received_first+m_received_count++) % BUFFER_COUNT] = Received{buffer, static_cast<uint32_t>(cqe.res)};
+        else
+          recycle(buffer);
+      }
+
+      if (cqe.res == 0)
+        m_receive_error = asio::error::make_error_code(asio::error::eof);
+      else if (cqe.res==-EINVAL && m_multishot)
+        m_multishot = false;
+      else if (cqe.res<0 && cqe.res!=-ENOBUFS && cqe.res!=-ECANCELED)
+        m_receive_error = std::error_code(-cqe.res, std::generic_category());
+      break;
+
+    case WAKEUP:
+      // After a failed read it is not queued again. Posts then wait for the next read, as without an eventfd. Requests are
+      // cancelled when the thread that submitted them exits, which is not a failure
+      if (cqe.res>=0 || cqe.res==-ECANCELED)
+        m_waking = false;
+      break;
+
+    case SEND:
+      m_sending = false;
+      if (cqe.res >= 0)
+        m_output_pos += static_cast<size_t>(cqe.res);
+      else if (cqe.res != -ECANCELED)
+        m_send_error = std::error_code(-cqe.res, std::generic_category());
+      break;
+  }
+}
+#endif // USE_IO_URING
+
+
+TlsConnection::TlsConnection(asio::ip::tcp::socket socket, asio::ssl::context& context)
+: SocketConnection(std::move(socket)),
+  m_ssl(::SSL_new(context.native_handle()))
+{
+  if (m_ssl)
+  {
+    ::SSL_set_fd(m_ssl, m_socket.native_handle());
+    // Read whatever the socket has, instead of a record header and then its body
+    ::SSL_set_read_ahead(m_ssl, 1);
+    // SSL_write is retried with the output buffer as it is then, which may have moved, and grown by what was posted since
+    ::SSL_set_mode(m_ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  }
+}
+
+TlsConnection::~TlsConnection()
+{
+  if (m_ssl)
+  {
+    ::SSL_shutdown(m_ssl); //Sends close_notify if the socket takes it at once
+    ::SSL_free(m_ssl);
+  }
+}
+
+// Runs on the handshake thread pool. The whole handshake must be done within HANDSHAKE_TIMEOUT, so a client that trickles it
+// in a byte at a time does not hold a pool thread either
+std::error_code TlsConnection::handshake()
+{
+  if (!m_ssl)
+    return std::make_error_code(std::errc::not_enough_memory);
+
+  std::error_code error_code;
+  m_socket.non_blocking(true, error_code);
+  if (IS_ERROR(error_code))
+    return error_code;
+
+  const int64_t deadline_ms = Clock::monotonicMs() + std::chrono::milliseconds(HANDSHAKE_TIMEOUT).count();
+  while (true)
+  {
+    const int result = ::SSL_accept(m_ssl);
+    if (result == 1)
+      return error_code;
+
+    short events;
+    if (IS_ERROR(error_code=getEvents(result, events)))
+      return error_code;
+
+    const int64_t now = Clock::monotonicMs();
+    if (now >= deadline_ms)
+      return std::make_error_code(std::errc::timed_out);
+
+    struct pollfd fd = {m_socket.native_handle(), events, 0};
+    if (::poll(&fd, 1, static_cast<int>(deadline_ms-now)) < 0 && errno != EINTR)
+      return std::error_code(errno, std::generic_category());
+  }
+}
+
+bool TlsConnection::isSessionReused() const
+{
+  return m_ssl && 1==::SSL_session_reused(m_ssl);
+}
+
+std::error_code TlsConnection::receive(uint8_t* data, size_t length, size_t& received, short& events)
+{
+  const int result = ::SSL_read(m_ssl, data, static_cast<int>(std::min<size_t>(length, INT32_MAX)));
+  received = result>0 ? static_cast<size_t>(result) : 0;
+  return getEvents(result, events);
+}
+
+std::error_code TlsConnection::send(const uint8_t* data, size_t length, size_t& sent, short& events)
+{
+  const int result = ::SSL_write(m_ssl, data, static_cast<int>(std::min<size_t>(length, INT32_MAX)));
+  sent = result>0 ? static_cast<size_t>(result) : 0;
+  return getEvents(result, events);
+}
+
+// Either call may need the socket to be readable or writable, a TLS 1.3 key update for one
+std::error_code TlsConnection::getEvents(int result, short& events) const
+{
+  events = 0;
+  if (result > 0)
+    return std::error_code();
+
+  switch (::SSL_get_error(m_ssl, result))
+  {
+    case SSL_ERROR_WANT_READ:
+      events = POLLIN;
+      return std::error_code();
+    case SSL_ERROR_WANT_WRITE:
+      events = POLLOUT;
+      return std::error_code();
+    case SSL_ERROR_ZERO_RETURN:
+      return asio::error::make_error_code(asio::error::eof);
+    default:
+      return std::make_error_code(std::errc::io_error);
+  }
+}
+
+
+void MemoryConnection::feed(const uint8_t* data, size_t length)
+{
+  // Bytes already read are dropped, so the buffer only holds what is not yet parsed
+  m_data.erase(m_data.begin(), m_data.begin()+m_read_pos);
+  m_read_pos = 0;
+  m_data.insert(m_data.end(), data, data+length);
+}
+
+std::error_code MemoryConnection::read(uint8_t* data, size_t length)
+{
+  if (hasPosted())
+  {
+    std::vector<uint8_t> posted;
+    takePosted(posted);
+    m_bytes_written.fetch_add(posted.size(), std::memory_order_relaxed);
+  }
+
+  if (m_data.size()-m_read_pos < length)
+    return asio::error::make_error_code(asio::error::eof);
+
+  std::memcpy(data, m_data.data()+m_read_pos, length);
+  m_read_pos += length;
+  return std::error_code();
+}
+
+std::error_code MemoryConnection::write(const uint8_t* /*data*/, size_t length)
+{
+  m_bytes_written.fetch_add(length, std::memory_order_relaxed);
+  return std::error_code();
+}
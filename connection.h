@@ -0,0 +1,269 @@
+#ifndef _CONNECTION_H_
+#define _CONNECTION_H_
+
+#include <asio.hpp>
+#include <asio/ssl.hpp>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "memory_account.h"
+#include "uring.h"
+
+
+/*
+ * A byte stream for one client. Only the session thread reads and writes the client. Other threads post what they send,
+ * and the session thread writes it out while it waits for input, so no other thread ever waits on a slow client.
+ */
+class Connection
+{
+public:
+  Connection() : m_id(s_next_id.fetch_add(1, std::memory_order_relaxed)), m_memory_account(std::make_shared<MemoryAccount>()),
+                 m_has_posted(false), m_unwritten_length(0), m_closing(false) {}
+  virtual ~Connection();
+
+  // Session thread. Blocks until exactly length bytes are read
+  [[nodiscard]] virtual std::error_code read(uint8_t* data, size_t length) = 0;
+  // Session thread. Blocks until what was posted before, and data, are written
+  [[nodiscard]] virtual std::error_code write(const uint8_t* data, size_t length) = 0;
+  // Any thread. Queues data for the session thread and wakes it. Fails with no_buffer_space instead of letting more than limit
+  // bytes wait for the client. Bytes waiting are charged to the memory account as WRITE_QUEUE until they are written
+  [[nodiscard]] std::error_code post(const uint8_t* data, size_t length, size_t limit);
+  // Any thread. The session thread writes what was posted as far as the client takes it at once, and then fails its read
+  void close();
+
+  [[nodiscard]] uint32_t getId() const {return m_id;}
+  // Set by CONNECT. Only accessed from the session thread
+  void setClientId(const std::string& client_id) {m_client_id=client_id;}
+  [[nodiscard]] const std::string& getClientId() const {return m_client_id;}
+
+  // Shared with InfluxDB batches, which may outlive the connection
+  [[nodiscard]] const std::shared_ptr<MemoryAccount>& getMemoryAccount() const {return m_memory_account;}
+
+protected:
+  virtual void wake() = 0;
+
+  [[nodiscard]] bool hasPosted() const {return m_has_posted.load(std::memory_order_acquire);}
+  // Appends what was posted to output
+  void takePosted(std::vector<uint8_t>& output);
+  // Bytes the session thread took, and has not written yet. They count against the limit of post(), and are charged
+  void setUnwrittenLength(size_t length);
+  [[nodiscard]] bool isClosing() const {return m_closing.load(std::memory_order_acquire);}
+
+private:
+  static inline std::atomic<uint32_t> s_next_id{1};
+  uint32_t m_id;
+  std::string m_client_id;
+  std::shared_ptr<MemoryAccount> m_memory_account;
+
+  std::mutex m_post_lock; // Guards m_posted
+  std::vector<uint8_t> m_posted;
+  std::atomic<bool> m_has_posted;
+  std::atomic<size_t> m_unwritten_length;
+  std::atomic<bool> m_closing;
+};
+
+
+/*
+ * A non-blocking socket, waited for with poll() together with an eventfd that post() and close() signal.
+ * Reads are served from a small per-connection buffer, filled by one receive of whatever the socket has. The Fixed Header,
+ * the rest of the packet, and any packets behind it then take one recv instead of one each.
+ */
+class SocketConnection : public Connection
+{
+private:
+  static constexpr size_t READ_BUFFER_LENGTH = 2048;
+  static constexpr std::chrono::seconds WRITE_TIMEOUT{10}; // For the session thread's own writes. A client taking longer is dropped
+
+public:
+  SocketConnection(asio::ip::tcp::socket socket);
+  virtual ~SocketConnection();
+
+  [[nodiscard]] virtual std::error_code read(uint8_t* data, size_t length) override;
+  [[nodiscard]] virtual std::error_code write(const uint8_t* data, size_t length) override;
+
+protected:
+  // Never block. If nothing could be transferred, return OK with received or sent 0, and events set to what to poll for
+  [[nodiscard]] virtual std::error_code receive(uint8_t* data, size_t length, size_t& received, short& events) = 0;
+  [[nodiscard]] virtual std::error_code send(const uint8_t* data, size_t length, size_t& sent, short& events) = 0;
+
+  virtual void wake() override;
+
+private:
+  // Writes what was posted, and what is left of earlier output, as far as the socket takes it. events is set to what to
+  // poll for while output is left
+  [[nodiscard]] std::error_code writeOutput(short& events);
+  // Writes output while waiting for the socket to become ready for events (0 to wait until all output is written), for
+  // another thread to close, or for deadline_ms (Clock::monotonicMs, -1 for none)
+  [[nodiscard]] std::error_code wait(short events, int64_t deadline_ms);
+
+protected:
+  asio::ip::tcp::socket m_socket;
+
+private:
+  int m_wakeup_fd;
+  std::unique_ptr<uint8_t[]> m_read_buffer;
+  size_t m_read_pos;
+  size_t m_read_end;
+  std::vector<uint8_t> m_output; // Only used by the session thread
+  size_t m_output_pos;
+};
+
+
+class TcpConnection : public SocketConnection
+{
+public:
+  TcpConnection(asio::ip::tcp::socket socket);
+
+protected:
+  [[nodiscard]] virtual std::error_code receive(uint8_t* data, size_t length, size_t& received, short& events) override;
+  [[nodiscard]] virtual std::error_code send(const uint8_t* data, size_t length, size_t& sent, short& events) override;
+};
+
+
+#ifdef USE_IO_URING
+/*
+ * A plain TCP socket served through an io_uring of its own. A multishot receive fills a ring of buffers registered with the
+ * kernel, a read of the eventfd stands in for polling it, and posted output is sent by the same io_uring_enter that waits.
+ * A busy session then takes one system call per wakeup, instead of a poll, a recv and a send. The receive buffers, and the
+ * ring they are handed back to the kernel in, fill exactly one page.
+ */
+class UringConnection : public Connection
+{
+private:
+  static constexpr unsigned int RING_ENTRIES = 8; // At most a receive, a wakeup read, a send and a cancel are in flight
+  static constexpr uint16_t BUFFER_COUNT = 4;     // A power of 2
+  static constexpr size_t BUFFER_LENGTH = (4096-BUFFER_COUNT*sizeof(io_uring_buf))/BUFFER_COUNT;
+  static constexpr uint16_t BUFFER_GROUP = 0;
+  static constexpr std::chrono::seconds WRITE_TIMEOUT{10}; // As for SocketConnection
+
+  enum Request : uint64_t {
+    RECEIVE = 1,
+    WAKEUP,
+    SEND,
+    CANCEL
+  };
+
+  struct alignas(4096) ReceiveBuffers {
+    io_uring_buf ring[BUFFER_COUNT]; // The kernel's tail is stored over ring[0].resv
+    uint8_t data[BUFFER_COUNT][BUFFER_LENGTH];
+  };
+
+  struct Received {
+    uint16_t buffer;
+    uint32_t length;
+  };
+
+public:
+  // A UringConnection, or a TcpConnection if io_uring can't be set up. After io_uring turned out to be missing or disabled,
+  // it is not tried again
+  [[nodiscard]] static std::unique_ptr<Connection> create(asio::ip::tcp::socket socket);
+  virtual ~UringConnection();
+
+  [[nodiscard]] virtual std::error_code read(uint8_t* data, size_t length) override;
+  [[nodiscard]] virtual std::error_code write(const uint8_t* data, size_t length) override;
+
+protected:
+  virtual void wake() override;
+
+private:
+  UringConnection(asio::ip::tcp::socket socket);
+
+  [[nodiscard]] std::error_code setup();
+  // Hands a buffer that was read to the end back to the kernel
+  void recycle(uint16_t buffer);
+  // Queues the send of what was posted and written, if no send is in flight
+  void queueOutput();
+  // Queues what is not in flight, submits it and waits for completions, for another thread to close, or for deadline_ms
+  // (Clock::monotonicMs, -1 for none). Without block, only submits
+  [[nodiscard]] std::error_code wait(int64_t deadline_ms, bool block = true);
+  void complete(const io_uring_cqe& cqe);
+
+private:
+  static inline std::atomic<bool> s_unavailable{false};
+
+  asio::ip::tcp::socket m_socket;
+  int m_wakeup_fd;
+  uint64_t m_wakeup_count;
+  Uring m_ring;
+  unsigned int m_in_flight; // Requests that may still write to the buffers
+  std::unique_ptr<ReceiveBuffers> m_buffers;
+  uint16_t m_buffer_tail;
+
+  bool m_multishot; // Cleared if the kernel predates multishot receive (6.0). Each receive is then queued on its own
+  bool m_receiving;
+  bool m_waking;
+  Received m_received[BUFFER_COUNT]; // In the order received
+  size_t m_received_first;
+  size_t m_received_count;
+  size_t m_read_pos; // In the first received buffer
+  std::error_code m_receive_error; // End of stream, or an error. Returned once what was received before is read
+
+  std::vector<uint8_t> m_output; // Being sent. Not moved while a send is in flight
+  size_t m_output_pos;
+  std::vector<uint8_t> m_queued; // Sent after m_output
+  bool m_sending;
+  std::error_code m_send_error;
+};
+#endif // USE_IO_URING
+
+
+/*
+ * OpenSSL is driven directly on the socket (instead of through asio::ssl::stream), so no decrypted or undecrypted bytes
+ * are buffered where a wait for socket readability can't see them. The handshake runs on the handshake thread pool, polling
+ * the non-blocking socket against one deadline. After it only the session thread calls into OpenSSL, so no lock is needed.
+ */
+class TlsConnection : public SocketConnection
+{
+private:
+  static constexpr std::chrono::seconds HANDSHAKE_TIMEOUT{10}; // For the whole handshake
+
+public:
+  TlsConnection(asio::ip::tcp::socket socket, asio::ssl::context& context);
+  virtual ~TlsConnection();
+
+  [[nodiscard]] std::error_code handshake();
+  [[nodiscard]] bool isSessionReused() const;
+
+protected:
+  [[nodiscard]] virtual std::error_code receive(uint8_t* data, size_t length, size_t& received, short& events) override;
+  [[nodiscard]] virtual std::error_code send(const uint8_t* data, size_t length, size_t& sent, short& events) override;
+
+private:
+  // For an SSL_read or SSL_write that returned result
+  [[nodiscard]] std::error_code getEvents(int result, short& events) const;
+
+private:
+  SSL* m_ssl;
+};
+
+
+/*
+ * Serves bytes fed to it from memory, and discards what is written or posted. Used to replay captured frames without sockets.
+ */
+class MemoryConnection : public Connection
+{
+public:
+  MemoryConnection() : m_read_pos(0), m_bytes_written(0) {}
+
+  void feed(const uint8_t* data, size_t length);
+
+  [[nodiscard]] virtual std::error_code read(uint8_t* data, size_t length) override;
+  [[nodiscard]] virtual std::error_code write(const uint8_t* data, size_t length) override;
+
+  [[nodiscard]] size_t getBytesWritten() const {return m_bytes_written.load(std::memory_order_relaxed);}
+
+protected:
+  virtual void wake() override {}
+
+private:
+  std::vector<uint8_t> m_data;
+  size_t m_read_pos;
+  std::atomic<size_t> m_bytes_written;
+};
+
+#endif // _CONNECTION_H_
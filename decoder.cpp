@@ -0,0 +1,680 @@
+#include "decoder.h"
+
+#include <bit>
+#include <charconv>
+#include <cctype>
+#include <cmath>
+
+#include "escape.h"
+
+
+namespace
+{
+  const PlainDecoder s_plain;
+  const JsonDecoder s_json;
+  const CborDecoder s_cbor;
+  const MessagePackDecoder s_msgpack;
+
+  bool isWhitespace(char c)
+  {
+    return c==' ' || c=='\t' || c=='\r' || c=='\n';
+  }
+
+  bool equalsIgnoreCase(std::string_view a, std::string_view b)
+  {
+    if (a.length() != b.length())
+      return false;
+    for (size_t i=0; i<a.length(); i++)
+    {
+      if (tolower(static_cast<unsigned char>(a[i])) != tolower(static_cast<unsigned char>(b[i])))
+        return false;
+    }
+    return true;
+  }
+
+  bool endsWithIgnoreCase(std::string_view text, std::string_view suffix)
+  {
+    return text.length()>=suffix.length() && equalsIgnoreCase(text.substr(text.length()-suffix.length()), suffix);
+  }
+}
+
+
+const PayloadDecoder& PayloadDecoder::get(Format format)
+{
+  switch (format)
+  {
+    case PLAIN: return s_plain;
+    case CBOR: return s_cbor;
+    case MSGPACK: return s_msgpack;
+    default: return s_json;
+  }
+}
+
+bool PayloadDecoder::parseFormat(std::string_view name, Format& format)
+{
+  for (int i=0; i<FORMAT_COUNT; i++)
+  {
+    if (name == FORMAT_NAMES[i])
+    {
+      format = static_cast<Format>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+// "application/json; charset=utf-8", and structured syntax suffixes like "application/senml+cbor"
+PayloadDecoder::Format PayloadDecoder::fromContentType(std::string_view content_type)
+{
+  if (content_type.empty())
+    return AUTO;
+
+  std::string_view media_type = content_type.substr(0, content_type.find(';'));
+  while (!media_type.empty() && isWhitespace(media_type.back()))
+    media_type.remove_suffix(1);
+
+  if (equalsIgnoreCase(media_type, "application/json") || equalsIgnoreCase(media_type, "text/json") || endsWithIgnoreCase(media_type, "+json"))
+    return JSON;
+  if (equalsIgnoreCase(media_type, "text/plain"))
+    return PLAIN;
+  if (equalsIgnoreCase(media_type, "application/cbor") || endsWithIgnoreCase(media_type, "+cbor"))
+    return CBOR;
+  if (equalsIgnoreCase(media_type, "application/msgpack") || equalsIgnoreCase(media_type, "application/x-msgpack") ||
+      equalsIgnoreCase(media_type, "application/vnd.msgpack"))
+    return MSGPACK;
+  return AUTO;
+}
+
+// Text starts with a printable character. Binary payloads are nearly always maps, and the map headers of CBOR (0xA0-0xBB, 0xBF)
+// and MessagePack (0x80-0x8F, 0xDE, 0xDF) don't overlap
+PayloadDecoder::Format PayloadDecoder::detect(std::string_view payload, uint8_t payload_format_indicator)
+{
+  size_t pos = 0;
+  while (pos<payload.length() && isWhitespace(payload[pos]))
+    pos++;
+  if (pos == payload.length())
+    return JSON;
+
+  const uint8_t first = static_cast<uint8_t>(payload[pos]);
+  if (payload_format_indicator==1 || (first>=0x20 && first<0x7F) || pos>0)
+    return first=='{' || first=='[' ? JSON : PLAIN;
+
+  if ((first>=0xA0 && first<=0xBB) || first==0xBF || (first>=0xF9 && first<=0xFB))
+    return CBOR;
+  if (first>=0x80)
+    return MSGPACK;
+  return JSON;
+}
+
+
+bool PlainDecoder::extract(std::string_view payload, const std::vector<std::string>& path, std::string_view& value,
+                           bool& quoted, std::string& /*scratch*/) const
+{
+  if (!path.empty())
+    return false;
+
+  quoted = false;
+  size_t start = 0;
+  size_t end = payload.length();
+  while (start<end && isWhitespace(payload[start]))
+    start++;
+  while (end>start && isWhitespace(payload[end-1]))
+    end--;
+  value = payload.substr(start, end-start);
+  return true;
+}
+
+
+bool JsonDecoder::extract(std::string_view payload, const std::vector<std::string>& path, std::string_view& value,
+                          bool& quoted, std::string& /*scratch*/) const
+{
+  if (path.empty())
+  {
+    size_t start = 0;
+    size_t end = payload.length();
+    skipWhitespace(payload, start);
+    while (end>start && isWhitespace(payload[end-1]))
+      end--;
+    value = payload.substr(start, end-start);
+    quoted = isString(value);
+    return true;
+  }
+
+  size_t pos = 0;
+  for (const std::string& name : path)
+  {
+    if (!findMember(payload, pos, name))
+      return false;
+  }
+
+  const size_t start = pos;
+  if (!skipValue(payload, pos))
+    return false;
+
+  value = payload.substr(start, pos-start);
+  quoted = value.front() == '"';
+  return true;
+}
+
+void JsonDecoder::skipWhitespace(std::string_view json, size_t& pos)
+{
+  while (pos<json.length() && isWhitespace(json[pos]))
+    pos++;
+}
+
+// A whole JSON string, and nothing after it
+bool JsonDecoder::isString(std::string_view json)
+{
+  size_t pos = 0;
+  return !json.empty() && json.front()=='"' && skipValue(json, pos) && pos==json.length();
+}
+
+// Skips one JSON value starting at pos. Returns false if the value is malformed
+bool JsonDecoder::skipValue(std::string_view json, size_t& pos)
+{
+  skipWhitespace(json, pos);
+  if (pos >= json.length())
+    return false;
+
+  const char c = json[pos];
+  if (c == '"')
+  {
+    for (pos++; pos<json.length(); pos++)
+    {
+      if (json[pos] == '\\')
+        pos++;
+      else if (json[pos] == '"')
+        return ++pos <= json.length();
+      else if (json[pos]=='\n' || json[pos]=='\r') //Not allowed in JSON strings, and would end the line protocol line
+        return false;
+    }
+    return false;
+  }
+
+  if (c=='{' || c=='[')
+  {
+    const char end = c=='{' ? '}' : ']';
+    pos++;
+    skipWhitespace(json, pos);
+    if (pos<json.length() && json[pos]==end)
+      return ++pos <= json.length();
+
+    while (pos < json.length())
+    {
+      if (c == '{')
+      {
+        if (!skipValue(json, pos)) //Member name
+          return false;
+        skipWhitespace(json, pos);
+        if (pos>=json.length() || json[pos]!=':')
+          return false;
+        pos++;
+      }
+      if (!skipValue(json, pos))
+        return false;
+      skipWhitespace(json, pos);
+      if (pos >= json.length())
+        return false;
+      if (json[pos] == end)
+        return ++pos <= json.length();
+      if (json[pos] != ',')
+        return false;
+      pos++;
+    }
+    return false;
+  }
+
+  // Number, true, false or null
+  const size_t start = pos;
+  while (pos<json.length() && json[pos]!=',' && json[pos]!='}' && json[pos]!=']' && !isWhitespace(json[pos]))
+    pos++;
+  return pos > start;
+}
+
+// Finds the value of member name in the object starting at pos
+bool JsonDecoder::findMember(std::string_view json, size_t& pos, std::string_view name)
+{
+  skipWhitespace(json, pos);
+  if (pos>=json.length() || json[pos]!='{')
+    return false;
+  pos++;
+
+  while (true)
+  {
+    skipWhitespace(json, pos);
+    if (pos>=json.length() || json[pos]!='"')
+      return false;
+
+    const size_t name_start = pos+1;
+    if (!skipValue(json, pos))
+      return false;
+    const std::string_view member_name = json.substr(name_start, pos-name_start-1);
+
+    skipWhitespace(json, pos);
+    if (pos>=json.length() || json[pos]!=':')
+      return false;
+    pos++;
+    skipWhitespace(json, pos);
+
+    if (member_name == name)
+      return true;
+
+    if (!skipValue(json, pos))
+      return false;
+    skipWhitespace(json, pos);
+    if (pos>=json.length() || json[pos]!=',')
+      return false;
+    pos++;
+  }
+}
+
+
+bool BinaryDecoder::extract(std::string_view payload, const std::vector<std::string>& path, std::string_view& value,
+                            bool& quoted, std::string& scratch) const
+{
+  size_t pos = 0;
+  for (const std::string& name : path)
+  {
+    if (!findMember(payload, pos, name))
+      return false;
+  }
+
+  Item item;
+  return readItem(payload, pos, item) && render(payload, pos, item, value, quoted, scratch);
+}
+
+bool BinaryDecoder::readBigEndian(std::string_view payload, size_t& pos, size_t bytes, uint64_t& value)
+{
+  if (bytes > payload.length()-pos)
+    return false;
+
+  value = 0;
+  for (size_t i=0; i<bytes; i++)
+  {
+    value = (value<<8) | static_cast<uint8_t>(payload[pos++]);
+  }
+  return true;
+}
+
+// Every item takes at least one byte, so no count can be larger than the rest of the payload
+bool BinaryDecoder::checkLength(std::string_view payload, size_t pos, const Item& item)
+{
+  if (item.indefinite || (item.kind!=Item::STRING && item.kind!=Item::BYTES && item.kind!=Item::ARRAY && item.kind!=Item::MAP))
+    return true;
+  return item.length <= payload.length()-pos;
+}
+
+bool BinaryDecoder::skipContent(std::string_view payload, size_t& pos, const Item& item, size_t depth) const
+{
+  switch (item.kind)
+  {
+    case Item::STRING:
+    case Item::BYTES:
+    {
+      if (!item.indefinite)
+      {
+        pos += item.length;
+        return true;
+      }
+
+      Item chunk;
+      while (readItem(payload, pos, chunk))
+      {
+        if (chunk.kind == Item::BREAK)
+          return true;
+        if (chunk.kind!=item.kind || chunk.indefinite)
+          return false;
+        pos += chunk.length;
+      }
+      return false;
+    }
+
+    case Item::ARRAY:
+    case Item::MAP:
+    {
+      if (depth >= MAX_DEPTH)
+        return false;
+
+      const uint64_t count = item.kind==Item::MAP ? 2*item.length : item.length;
+      Item child;
+      for (uint64_t i=0; item.indefinite || i<count; i++)
+      {
+        if (!readItem(payload, pos, child))
+          return false;
+        if (child.kind == Item::BREAK)
+          return item.indefinite;
+        if (!skipContent(payload, pos, child, depth+1))
+          return false;
+      }
+      return true;
+    }
+
+    case Item::BREAK:
+      return false;
+
+    default:
+      return true;
+  }
+}
+
+// Finds the value of member name in the map starting at pos. Only text keys are compared
+bool BinaryDecoder::findMember(std::string_view payload, size_t& pos, std::string_view name) const
+{
+  Item map;
+  if (!readItem(payload, pos, map) || map.kind!=Item::MAP)
+    return false;
+
+  Item key;
+  for (uint64_t i=0; map.indefinite || i<map.length; i++)
+  {
+    if (!readItem(payload, pos, key) || key.kind==Item::BREAK)
+      return false;
+
+    if (key.kind==Item::STRING && !key.indefinite)
+    {
+      const std::string_view key_name = payload.substr(pos, key.length);
+      pos += key.length;
+      if (key_name == name)
+        return true;
+    }
+    else if (!skipContent(payload, pos, key, 0))
+    {
+      return false;
+    }
+
+    Item value;
+    if (!readItem(payload, pos, value) || value.kind==Item::BREAK || !skipContent(payload, pos, value, 0))
+      return false;
+  }
+  return false;
+}
+
+bool BinaryDecoder::render(std::string_view payload, size_t& pos, const Item& item, std::string_view& value, bool& quoted,
+                           std::string& scratch) const
+{
+  quoted = false;
+  char buffer[32];
+  std::to_chars_result result;
+  switch (item.kind)
+  {
+    case Item::UNSIGNED:
+      result = std::to_chars(buffer, buffer+sizeof(buffer), item.unsigned_value);
+      break;
+
+    case Item::SIGNED:
+      result = std::to_chars(buffer, buffer+sizeof(buffer), item.signed_value);
+      break;
+
+    case Item::FLOAT:
+      if (!std::isfinite(item.float_value))
+        return false;
+      // Shortest representation of the value as sent, so 0.1 in 32 bits is not rendered as 0.100000001490116
+      result = item.single ? std::to_chars(buffer, buffer+sizeof(buffer), static_cast<float>(item.float_value))
+                           : std::to_chars(buffer, buffer+sizeof(buffer), item.float_value);
+      break;
+
+    case Item::BOOLEAN:
+      value = item.boolean_value ? "true" : "false";
+      return true;
+
+    case Item::STRING:
+    {
+      scratch.assign(1, '"');
+      if (!item.indefinite)
+      {
+        if (!Escape::append(scratch, payload.substr(pos, item.length), Escape::STRING_FIELD))
+          return false;
+        pos += item.length;
+      }
+      else
+      {
+        Item chunk;
+        while (true)
+        {
+          if (!readItem(payload, pos, chunk) || (chunk.kind!=Item::BREAK && (chunk.kind!=Item::STRING || chunk.indefinite)))
+            return false;
+          if (chunk.kind == Item::BREAK)
+            break;
+          if (!Escape::append(scratch, payload.substr(pos, chunk.length), Escape::STRING_FIELD))
+            return false;
+          pos += chunk.length;
+        }
+      }
+      scratch += '"';
+      value = scratch;
+      quoted = true;
+      return true;
+    }
+
+    default:
+      return false;
+  }
+
+  scratch.assign(buffer, result.ptr);
+  value = scratch;
+  return true;
+}
+
+
+// RFC 8949 3. An item starts with a byte of 3 bits major type and 5 bits additional information. Tags are skipped, so an
+// epoch time tagged 1 is read as the number
+bool CborDecoder::readItem(std::string_view payload, size_t& pos, Item& item) const
+{
+  while (true)
+  {
+    if (pos >= payload.length())
+      return false;
+
+    const uint8_t initial = static_cast<uint8_t>(payload[pos++]);
+    const uint8_t major = initial>>5;
+    const uint8_t info = initial&0x1F;
+    uint64_t argument = info;
+    item.indefinite = false;
+    item.single = false;
+    item.length = 0;
+    if (info == 31)
+    {
+      if (major==0 || major==1 || major==6)
+        return false;
+      item.kind = Item::BREAK; //Only for major type 7
+      item.indefinite = true;
+      argument = 0;
+    }
+    else if (info >= 28)
+    {
+      return false;
+    }
+    else if (info>=24 && !readBigEndian(payload, pos, size_t(1)<<(info-24), argument))
+    {
+      return false;
+    }
+
+    switch (major)
+    {
+      case 0:
+        item.kind = Item::UNSIGNED;
+        item.unsigned_value = argument;
+        return true;
+
+      case 1:
+        item.kind = argument<=static_cast<uint64_t>(INT64_MAX) ? Item::SIGNED : Item::OTHER;
+        item.signed_value = -1 - static_cast<int64_t>(argument & INT64_MAX);
+        return true;
+
+      case 2:
+      case 3:
+      case 4:
+      case 5:
+        item.kind = major==2 ? Item::BYTES : major==3 ? Item::STRING : major==4 ? Item::ARRAY : Item::MAP;
+        item.length = argument;
+        return checkLength(payload, pos, item);
+
+      case 6:
+        continue;
+
+      default:
+        if (item.indefinite)
+          return true;
+
+        switch (info)
+        {
+          case 20:
+          case 21:
+            item.kind = Item::BOOLEAN;
+            item.boolean_value = info==21;
+            break;
+          case 22:
+            item.kind = Item::NIL;
+            break;
+          case 25:
+            item.kind = Item::FLOAT;
+            item.single = true;
+            item.float_value = halfToDouble(static_cast<uint16_t>(argument));
+            break;
+          case 26:
+            item.kind = Item::FLOAT;
+            item.single = true;
+            item.float_value = std::bit_cast<float>(static_cast<uint32_t>(argument));
+            break;
+          case 27:
+            item.kind = Item::FLOAT;
+            item.float_value = std::bit_cast<double>(argument);
+            break;
+          default:
+            item.kind = Item::OTHER;
+            break;
+        }
+        return true;
+    }
+  }
+}
+
+// RFC 8949 Appendix D
+double CborDecoder::halfToDouble(uint16_t half)
+{
+  const int exponent = (half>>10) & 0x1F;
+  const int mantissa = half & 0x3FF;
+  double value;
+  if (exponent == 0)
+    value = std::ldexp(mantissa, -24);
+  else if (exponent == 31)
+    value = mantissa==0 ? INFINITY : NAN;
+  else
+    value = std::ldexp(mantissa+1024, exponent-25);
+  return (half&0x8000) ? -value : value;
+}
+
+
+// The MessagePack specification. The first byte is the type, holding small values and lengths itself
+bool MessagePackDecoder::readItem(std::string_view payload, size_t& pos, Item& item) const
+{
+  if (pos >= payload.length())
+    return false;
+
+  const uint8_t type = static_cast<uint8_t>(payload[pos++]);
+  item.indefinite = false;
+  item.single = false;
+  item.length = 0;
+  uint64_t argument = 0;
+  if (type <= 0x7F)
+  {
+    item.kind = Item::UNSIGNED;
+    item.unsigned_value = type;
+    return true;
+  }
+  if (type >= 0xE0)
+  {
+    item.kind = Item::SIGNED;
+    item.signed_value = static_cast<int8_t>(type);
+    return true;
+  }
+  if (type <= 0xBF)
+  {
+    item.kind = type<=0x8F ? Item::MAP : type<=0x9F ? Item::ARRAY : Item::STRING;
+    item.length = type<=0x9F ? (type&0x0F) : (type&0x1F);
+    return checkLength(payload, pos, item);
+  }
+
+  switch (type)
+  {
+    case 0xC0:
+      item.kind = Item::NIL;
+      return true;
+
+    case 0xC2:
+    case 0xC3:
+      item.kind = Item::BOOLEAN;
+      item.boolean_value = type==0xC3;
+      return true;
+
+    case 0xC4: case 0xC5: case 0xC6: //bin 8, 16, 32
+      if (!readBigEndian(payload, pos, size_t(1)<<(type-0xC4), argument))
+        return false;
+      item.kind = Item::BYTES;
+      item.length = argument;
+      return checkLength(payload, pos, item);
+
+    case 0xC7: case 0xC8: case 0xC9: //ext 8, 16, 32, followed by the extension type
+      if (!readBigEndian(payload, pos, size_t(1)<<(type-0xC7), argument))
+        return false;
+      item.kind = Item::BYTES;
+      item.length = argument+1;
+      return checkLength(payload, pos, item);
+
+    case 0xCA:
+      if (!readBigEndian(payload, pos, 4, argument))
+        return false;
+      item.kind = Item::FLOAT;
+      item.single = true;
+      item.float_value = std::bit_cast<float>(static_cast<uint32_t>(argument));
+      return true;
+
+    case 0xCB:
+      if (!readBigEndian(payload, pos, 8, argument))
+        return false;
+      item.kind = Item::FLOAT;
+      item.float_value = std::bit_cast<double>(argument);
+      return true;
+
+    case 0xCC: case 0xCD: case 0xCE: case 0xCF: //uint 8, 16, 32, 64
+      if (!readBigEndian(payload, pos, size_t(1)<<(type-0xCC), argument))
+        return false;
+      item.kind = Item::UNSIGNED;
+      item.unsigned_value = argument;
+      return true;
+
+    case 0xD0: case 0xD1: case 0xD2: case 0xD3: //int 8, 16, 32, 64
+    {
+      const size_t bytes = size_t(1)<<(type-0xD0);
+      if (!readBigEndian(payload, pos, bytes, argument))
+        return false;
+      const int shift = 64 - 8*bytes;
+      item.kind = Item::SIGNED;
+      item.signed_value = static_cast<int64_t>(argument<<shift) >> shift;
+      return true;
+    }
+
+    case 0xD4: case 0xD5: case 0xD6: case 0xD7: case 0xD8: //fixext 1, 2, 4, 8, 16
+      item.kind = Item::BYTES;
+      item.length = 1 + (size_t(1)<<(type-0xD4));
+      return checkLength(payload, pos, item);
+
+    case 0xD9: case 0xDA: case 0xDB: //str 8, 16, 32
+      if (!readBigEndian(payload, pos, size_t(1)<<(type-0xD9), argument))
+        return false;
+      item.kind = Item::STRING;
+      item.length = argument;
+      return checkLength(payload, pos, item);
+
+    case 0xDC: case 0xDD: //array 16, 32
+    case 0xDE: case 0xDF: //map 16, 32
+      if (!readBigEndian(payload, pos, (type&1) ? 4 : 2, argument))
+        return false;
+      item.kind = type<=0xDD ? Item::ARRAY : Item::MAP;
+      item.length = argument;
+      return checkLength(payload, pos, item);
+
+    default: //0xC1 is never used
+      return false;
+  }
+}
@@ -0,0 +1,140 @@
+#ifndef _DECODER_H_
+#define _DECODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+/*
+ * Finds the value at a rule's source path in a PUBLISH payload, as text for Field. Numbers and booleans read from binary
+ * formats are rendered the way JSON writes them, and strings quoted and escaped like a string field. Objects, arrays and null
+ * are not values.
+ * A decoder is picked per message from the rule's decoder option, the content type (3.3.2.3.9), or the format last seen on
+ * the topic section. The payload is only looked at if none of them tells.
+ */
+class PayloadDecoder
+{
+public:
+  enum Format : uint8_t {
+    AUTO,    // Not known, detect it
+    PLAIN,   // A bare number or word. Trimmed, not parsed
+    JSON,
+    CBOR,    // RFC 8949
+    MSGPACK,
+    FORMAT_COUNT
+  };
+
+private:
+  static constexpr const char* FORMAT_NAMES[FORMAT_COUNT] = {"auto", "plain", "json", "cbor", "msgpack"};
+
+public:
+  virtual ~PayloadDecoder() = default;
+
+  [[nodiscard]] static const PayloadDecoder& get(Format format);
+  [[nodiscard]] static bool parseFormat(std::string_view name, Format& format);
+  // AUTO for content types that are not one of the formats
+  [[nodiscard]] static Format fromContentType(std::string_view content_type);
+  // From the first byte, and the payload format indicator (3.3.2.3.2). Never AUTO, payloads that can't be placed are JSON
+  [[nodiscard]] static Format detect(std::string_view payload, uint8_t payload_format_indicator);
+
+  // Returns false if path has no value. value points into payload, or into scratch for rendered values. quoted is set for
+  // strings that are validated, quoted and escaped for a line protocol string field already
+  [[nodiscard]] virtual bool extract(std::string_view payload, const std::vector<std::string>& path, std::string_view& value,
+                                     bool& quoted, std::string& scratch) const = 0;
+};
+
+
+class PlainDecoder : public PayloadDecoder
+{
+public:
+  [[nodiscard]] bool extract(std::string_view payload, const std::vector<std::string>& path, std::string_view& value,
+                             bool& quoted, std::string& scratch) const override;
+};
+
+
+class JsonDecoder : public PayloadDecoder
+{
+public:
+  [[nodiscard]] bool extract(std::string_view payload, const std::vector<std::string>& path, std::string_view& value,
+                             bool& quoted, std::string& scratch) const override;
+
+private:
+  static void skipWhitespace(std::string_view json, size_t& pos);
+  [[nodiscard]] static bool isString(std::string_view json);
+  [[nodiscard]] static bool skipValue(std::string_view json, size_t& pos);
+  [[nodiscard]] static bool findMember(std::string_view json, size_t& pos, std::string_view name);
+};
+
+
+/*
+ * Walks CBOR and MessagePack payloads one item at a time. Subclasses only read item headers
+ */
+class BinaryDecoder : public PayloadDecoder
+{
+protected:
+  static constexpr size_t MAX_DEPTH = 64;
+
+  struct Item {
+    enum Kind : uint8_t {
+      UNSIGNED,
+      SIGNED,
+      FLOAT,
+      BOOLEAN,
+      NIL,
+      STRING,  // length bytes of UTF-8 follow the header
+      BYTES,   // Byte strings and extension types
+      ARRAY,   // length items follow
+      MAP,     // length key and value pairs follow
+      BREAK,   // Ends an indefinite length item
+      OTHER    // Values that can't be represented, like CBOR undefined
+    } kind;
+    bool indefinite; // CBOR strings, arrays and maps of chunks or items up to a BREAK
+    bool single;     // FLOAT was encoded in 32 bits or less
+    uint64_t length;
+    union {
+      uint64_t unsigned_value;
+      int64_t signed_value;
+      double float_value;
+      bool boolean_value;
+    };
+  };
+
+public:
+  [[nodiscard]] bool extract(std::string_view payload, const std::vector<std::string>& path, std::string_view& value,
+                             bool& quoted, std::string& scratch) const override;
+
+protected:
+  // Reads the header of the item at pos, leaving pos at its content. Lengths are checked against the payload
+  [[nodiscard]] virtual bool readItem(std::string_view payload, size_t& pos, Item& item) const = 0;
+
+  [[nodiscard]] static bool readBigEndian(std::string_view payload, size_t& pos, size_t bytes, uint64_t& value);
+  [[nodiscard]] static bool checkLength(std::string_view payload, size_t pos, const Item& item);
+
+private:
+  [[nodiscard]] bool skipContent(std::string_view payload, size_t& pos, const Item& item, size_t depth) const;
+  [[nodiscard]] bool findMember(std::string_view payload, size_t& pos, std::string_view name) const;
+  [[nodiscard]] bool render(std::string_view payload, size_t& pos, const Item& item, std::string_view& value, bool& quoted,
+                            std::string& scratch) const;
+};
+
+
+class CborDecoder : public BinaryDecoder
+{
+protected:
+  [[nodiscard]] bool readItem(std::string_view payload, size_t& pos, Item& item) const override;
+
+private:
+  [[nodiscard]] static double halfToDouble(uint16_t half);
+};
+
+
+class MessagePackDecoder : public BinaryDecoder
+{
+protected:
+  [[nodiscard]] bool readItem(std::string_view payload, size_t& pos, Item& item) const override;
+};
+
+#endif // _DECODER_H_
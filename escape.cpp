@@ -0,0 +1,210 @@
+#include "escape.h"
+
+#include <bit>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+
+const Escape::Implementation Escape::s_implementation = Escape::detect();
+const Escape::Find Escape::s_find = Escape::getFind(Escape::s_implementation);
+
+
+bool Escape::append(std::string& line, std::string_view text, Context context)
+{
+  return append(line, text, context, s_find);
+}
+
+bool Escape::append(std::string& line, std::string_view text, Context context, Find find)
+{
+  const size_t line_length = line.length();
+  size_t start = 0;
+  while (true)
+  {
+    const size_t special = start + find(text.data()+start, text.length()-start, SPECIALS[context]);
+    line.append(text.data()+start, special-start);
+    if (special == text.length())
+      return true;
+
+    if (text[special]=='\n' || text[special]=='\r')
+    {
+      line.resize(line_length);
+      return false;
+    }
+
+    line += '\\';
+    line += text[special];
+    start = special+1;
+  }
+}
+
+Escape::Implementation Escape::detect()
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init(); //Called during static initialization
+  if (__builtin_cpu_supports("avx2"))
+    return AVX2;
+  return SSE2; //Part of x86-64
+#else
+  return SCALAR;
+#endif
+}
+
+Escape::Find Escape::getFind(Implementation implementation)
+{
+  switch (implementation)
+  {
+#if defined(__x86_64__)
+    case AVX2: return findAvx2;
+    case SSE2: return findSse2;
+#endif
+    default: return findScalar;
+  }
+}
+
+// Returns the position of the first special character, or length if there is none
+size_t Escape::findScalar(const char* text, size_t length, const char (&specials)[SPECIAL_COUNT])
+{
+  for (size_t i=0; i<length; i++)
+  {
+    const char c = text[i];
+    if (c==specials[0] || c==specials[1] || c==specials[2] || c==specials[3] || c==specials[4])
+      return i;
+  }
+  return length;
+}
+
+#if defined(__x86_64__)
+namespace
+{
+  // The bytes of text[0..16) that are one of specials, as a bit mask
+  inline __attribute__((always_inline)) unsigned int match16(const char* text, const __m128i (&specials)[5])
+  {
+    const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text));
+    const __m128i found = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, specials[0]), _mm_cmpeq_epi8(chunk, specials[1])),
+                                       _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, specials[2]), _mm_cmpeq_epi8(chunk, specials[3])),
+                                                    _mm_cmpeq_epi8(chunk, specials[4])));
+    return static_cast<unsigned int>(_mm_movemask_epi8(found));
+  }
+
+  __attribute__((target("avx2"))) inline __attribute__((always_inline)) unsigned int match32(const char* text, const __m256i (&specials)[5])
+  {
+    const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text));
+    const __m256i found = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, specials[0]), _mm256_cmpeq_epi8(chunk, specials[1])),
+                                          _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, specials[2]), _mm256_cmpeq_epi8(chunk, specials[3])),
+                                                          _mm256_cmpeq_epi8(chunk, specials[4])));
+    return static_cast<unsigned int>(_mm256_movemask_epi8(found));
+  }
+
+  // Texts of 16 bytes or more end with a chunk overlapping the one before, instead of a scalar loop.
+  // Inlined in findAvx2 as well, where it is VEX encoded, avoiding SSE/AVX transitions
+  inline __attribute__((always_inline)) size_t find16(const char* text, size_t length, const char (&chars)[5], size_t (*find_scalar)(const char*, size_t, const char (&)[5]))
+  {
+    if (length < 16)
+      return find_scalar(text, length, chars);
+
+    const __m128i specials[5] = {_mm_set1_epi8(chars[0]), _mm_set1_epi8(chars[1]), _mm_set1_epi8(chars[2]), _mm_set1_epi8(chars[3]), _mm_set1_epi8(chars[4])};
+    size_t i = 0;
+    for (; i+16<=length; i+=16)
+    {
+      const unsigned int mask = match16(text+i, specials);
+      if (mask != 0)
+        return i + std::countr_zero(mask);
+    }
+
+    if (i < length)
+    {
+      const size_t last = length-16;
+      const unsigned int mask = match16(text+last, specials) >> (i-last);
+      if (mask != 0)
+        return i + std::countr_zero(mask);
+    }
+    return length;
+  }
+}
+
+size_t Escape::findSse2(const char* text, size_t length, const char (&specials)[SPECIAL_COUNT])
+{
+  return find16(text, length, specials, findScalar);
+}
+
+__attribute__((target("avx2")))
+size_t Escape::findAvx2(const char* text, size_t length, const char (&specials)[SPECIAL_COUNT])
+{
+  if (length < 32)
+    return find16(text, length, specials, findScalar);
+
+  const __m256i chars[5] = {_mm256_set1_epi8(specials[0]), _mm256_set1_epi8(specials[1]), _mm256_set1_epi8(specials[2]),
+                           _mm256_set1_epi8(specials[3]), _mm256_set1_epi8(specials[4])};
+  size_t i = 0;
+  for (; i+32<=length; i+=32)
+  {
+    const unsigned int mask = match32(text+i, chars);
+    if (mask != 0)
+      return i + std::countr_zero(mask);
+  }
+
+  if (i < length)
+  {
+    const size_t last = length-32;
+    const unsigned int mask = match32(text+last, chars) >> (i-last);
+    if (mask != 0)
+      return i + std::countr_zero(mask);
+  }
+  return length;
+}
+#endif
+
+// Measurements as expanded from topic patterns like "{1}.{2}.{3}", and string values, of which 1 in 20 has something to escape
+void Escape::benchmark(std::ostream& out)
+{
+  static constexpr const char* SITES[] = {"minidrivhus", "factory-oslo-2", "warehouse_bergen", "building/7/floor/3"};
+  static constexpr const char* DEVICES[] = {"sensor", "thermostat", "energy_meter", "heatpump-outdoor-unit", "plc"};
+  static constexpr const char* QUANTITIES[] = {"temp", "humidity", "power_active_import_total", "setpoint", "state"};
+  static constexpr size_t TEXT_COUNT = 4096;
+  static constexpr size_t ROUNDS = 500;
+
+  std::minstd_rand random(1);
+  std::vector<std::string> texts[CONTEXT_COUNT];
+  for (size_t i=0; i<TEXT_COUNT; i++)
+  {
+    std::string name = std::string(SITES[random()%4]) + '.' + DEVICES[random()%5] + std::to_string(random()%1000) + '.' + QUANTITIES[random()%5];
+    if (random()%20 == 0)
+      name[random()%name.length()] = random()%2 ? ' ' : ',';
+    texts[MEASUREMENT].push_back(name);
+    texts[TAG].push_back(name);
+
+    std::string value = "state changed to " + std::string(QUANTITIES[random()%5]) + " by " + DEVICES[random()%5];
+    if (random()%20 == 0)
+      value[random()%value.length()] = random()%2 ? '"' : '\\';
+    texts[STRING_FIELD].push_back(value);
+  }
+
+  out << "implementation\tcontext\tns_per_text\tMB_per_s\n";
+  std::string line;
+  for (int implementation=SCALAR; implementation<=s_implementation; implementation++)
+  {
+    const Find find = getFind(static_cast<Implementation>(implementation));
+    for (int context=0; context<CONTEXT_COUNT; context++)
+    {
+      size_t bytes = 0;
+      const auto start = std::chrono::steady_clock::now();
+      for (size_t round=0; round<ROUNDS; round++)
+      {
+        for (const std::string& text : texts[context])
+        {
+          line.clear();
+          (void)append(line, text, static_cast<Context>(context), find);
+          bytes += text.length();
+        }
+      }
+      const double ns = std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now()-start).count();
+      out << IMPLEMENTATION_NAMES[implementation] << '\t' << CONTEXT_NAMES[context] << '\t' << ns/(ROUNDS*TEXT_COUNT) << '\t' << bytes*1000.0/ns << '\n';
+    }
+  }
+  out.flush();
+}
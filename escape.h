@@ -0,0 +1,69 @@
+#ifndef _ESCAPE_H_
+#define _ESCAPE_H_
+
+#include <ostream>
+#include <stddef.h>
+#include <string>
+#include <string_view>
+
+
+/*
+ * Line protocol escaping. Text is scanned for the characters its context escapes 16 or 32 bytes at a time, with SSE2 or AVX2
+ * as the CPU supports, and copied in bulk up to each of them. Most names and values have none, so they take one scan and one
+ * copy. Other CPUs scan through a lookup table.
+ */
+class Escape
+{
+public:
+  enum Context : uint8_t {
+    MEASUREMENT,  // ',' and ' '
+    TAG,          // ',', '=' and ' '
+    STRING_FIELD, // '"' and '\'. The quotes around the value are not added
+    CONTEXT_COUNT
+  };
+
+  enum Implementation : uint8_t {
+    SCALAR,
+    SSE2,
+    AVX2,
+    IMPLEMENTATION_COUNT
+  };
+
+private:
+  static constexpr size_t SPECIAL_COUNT = 5; // Unused entries repeat the first
+  static constexpr char SPECIALS[CONTEXT_COUNT][SPECIAL_COUNT] = {
+    {',', ' ', '\n', '\r', ','},
+    {',', '=', ' ', '\n', '\r'},
+    {'"', '\\', '\n', '\r', '"'}
+  };
+  static constexpr const char* CONTEXT_NAMES[CONTEXT_COUNT] = {"measurement", "tag", "string_field"};
+  static constexpr const char* IMPLEMENTATION_NAMES[IMPLEMENTATION_COUNT] = {"scalar", "sse2", "avx2"};
+
+  using Find = size_t (*)(const char* text, size_t length, const char (&specials)[SPECIAL_COUNT]);
+
+public:
+  // Appends text escaped for context. Line breaks end a line protocol line wherever they are, so they make this return false
+  // with line left unchanged
+  [[nodiscard]] static bool append(std::string& line, std::string_view text, Context context);
+
+  [[nodiscard]] static Implementation getImplementation() {return s_implementation;}
+  // Escapes generated topic derived names and string values with each implementation the CPU supports
+  static void benchmark(std::ostream& out);
+
+private:
+  [[nodiscard]] static bool append(std::string& line, std::string_view text, Context context, Find find);
+  [[nodiscard]] static Implementation detect();
+  [[nodiscard]] static Find getFind(Implementation implementation);
+
+  [[nodiscard]] static size_t findScalar(const char* text, size_t length, const char (&specials)[SPECIAL_COUNT]);
+#if defined(__x86_64__)
+  [[nodiscard]] static size_t findSse2(const char* text, size_t length, const char (&specials)[SPECIAL_COUNT]);
+  [[nodiscard]] static size_t findAvx2(const char* text, size_t length, const char (&specials)[SPECIAL_COUNT]);
+#endif
+
+private:
+  static const Implementation s_implementation;
+  static const Find s_find;
+};
+
+#endif // _ESCAPE_H_
@@ -0,0 +1,185 @@
+#include "field.h"
+
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <vector>
+
+#include "escape.h"
+
+
+Field::Type Field::detect(std::string_view text)
+{
+  double double_value;
+  bool boolean_value;
+  if (parseDouble(text, double_value))
+    return FLOAT;
+  if (parseBoolean(text, boolean_value))
+    return BOOLEAN;
+  return STRING;
+}
+
+Field::Type Field::parseType(std::string_view name)
+{
+  if (name == "float")   return FLOAT;
+  if (name == "integer") return INTEGER;
+  if (name == "boolean") return BOOLEAN;
+  if (name == "string")  return STRING;
+  return UNKNOWN;
+}
+
+bool Field::append(std::string& line, std::string_view text, Type type, bool quoted)
+{
+  char buffer[32];
+  switch (type)
+  {
+    case FLOAT:
+    {
+      double value;
+      if (!parseDouble(text, value) || !std::isfinite(value))
+        return false;
+
+      // Shortest representation that parses back to the same double
+      const std::to_chars_result result = std::to_chars(buffer, buffer+sizeof(buffer), value);
+      line.append(buffer, result.ptr);
+      return true;
+    }
+
+    case INTEGER:
+    {
+      int64_t value;
+      const std::from_chars_result result = std::from_chars(text.data(), text.data()+text.length(), value);
+      if (result.ec!=std::errc() || result.ptr!=text.data()+text.length())
+      {
+        // Accept 20.0 or 2e3 for integer series
+        double double_value;
+        if (!parseDouble(text, double_value) || double_value!=std::trunc(double_value) ||
+            double_value<static_cast<double>(std::numeric_limits<int64_t>::min()) || double_value>=static_cast<double>(std::numeric_limits<int64_t>::max()))
+          return false;
+        value = static_cast<int64_t>(double_value);
+      }
+
+      const std::to_chars_result to_result = std::to_chars(buffer, buffer+sizeof(buffer), value);
+      line.append(buffer, to_result.ptr);
+      line += 'i';
+      return true;
+    }
+
+    case BOOLEAN:
+    {
+      bool value;
+      if (!parseBoolean(text, value))
+        return false;
+      line += value ? "true" : "false";
+      return true;
+    }
+
+    case STRING:
+      return appendString(line, text, quoted);
+
+    default:
+      return false;
+  }
+}
+
+bool Field::parseDouble(std::string_view text, double& value)
+{
+  if (text.empty() || text.front()=='+') //from_chars doesn't accept a leading '+', neither does JSON
+    return false;
+
+  const std::from_chars_result result = std::from_chars(text.data(), text.data()+text.length(), value);
+  return result.ec==std::errc() && result.ptr==text.data()+text.length();
+}
+
+bool Field::parseBoolean(std::string_view text, bool& value)
+{
+  if (text=="true" || text=="True" || text=="TRUE")
+  {
+    value = true;
+    return true;
+  }
+  if (text=="false" || text=="False" || text=="FALSE")
+  {
+    value = false;
+    return true;
+  }
+  return false;
+}
+
+// JSON strings arrive with quotes and escapes. Other text is quoted, and '"' and '\' escaped
+// Text that only looks quoted, like a plain payload of "x", is escaped as well, so it can't end the field early
+bool Field::appendString(std::string& line, std::string_view text, bool quoted)
+{
+  if (quoted)
+  {
+    line += text;
+    return true;
+  }
+
+  const size_t line_length = line.length();
+  line += '"';
+  if (!Escape::append(line, text, Escape::STRING_FIELD))
+  {
+    line.resize(line_length);
+    return false;
+  }
+  line += '"';
+  return true;
+}
+
+// Sensor readings as they arrive in payloads. The std:: string functions need a std::string, and throw on what they can't
+// parse, so only valid numbers are used. to_string writes floats with six decimals, not the shortest form that parses back
+void Field::benchmark(std::ostream& out)
+{
+  static constexpr size_t TEXT_COUNT = 4096;
+  static constexpr size_t ROUNDS = 500;
+
+  std::minstd_rand random(1);
+  std::vector<std::string> texts[2];
+  for (size_t i=0; i<TEXT_COUNT; i++)
+  {
+    char buffer[32];
+    const double reading = (static_cast<int>(random()%100000)-20000)/100.0;
+    texts[0].emplace_back(buffer, std::to_chars(buffer, buffer+sizeof(buffer), random()%4 ? reading : reading*1e6).ptr);
+    texts[1].push_back(std::to_string(random()%4 ? random()%5000 : random()));
+  }
+
+  out << "implementation\ttype\tns_per_value\tbytes_per_value\n";
+  std::string line;
+  for (int implementation=0; implementation<2; implementation++)
+  {
+    for (int type=0; type<2; type++)
+    {
+      size_t length = 0;
+      const auto start = std::chrono::steady_clock::now();
+      for (size_t round=0; round<ROUNDS; round++)
+      {
+        for (std::string_view text : texts[type])
+        {
+          line.clear();
+          if (implementation == 0)
+          {
+            (void)append(line, text, type==0 ? FLOAT : INTEGER);
+          }
+          else if (type == 0)
+          {
+            line += std::to_string(std::stod(std::string(text)));
+          }
+          else
+          {
+            line += std::to_string(std::stoll(std::string(text)));
+            line += 'i';
+          }
+          length += line.length();
+        }
+      }
+      const double ns = std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now()-start).count();
+      out << (implementation==0 ? "from_chars/to_chars" : "stod,stoll/to_string") << '\t' << (type==0 ? "float" : "integer") << '\t'
+          << ns/(ROUNDS*TEXT_COUNT) << '\t' << static_cast<double>(length)/(ROUNDS*TEXT_COUNT) << '\n';
+    }
+  }
+  out.flush();
+}
@@ -0,0 +1,43 @@
+#ifndef _FIELD_H_
+#define _FIELD_H_
+
+#include <ostream>
+#include <string>
+#include <string_view>
+
+
+/*
+ * Converts extracted payload text to InfluxDB line protocol field values, using std::from_chars/std::to_chars.
+ * Nothing is allocated unless the line buffer has to grow.
+ */
+class Field
+{
+public:
+  enum Type : uint8_t {
+    UNKNOWN,
+    FLOAT,
+    INTEGER,
+    BOOLEAN,
+    STRING
+  };
+
+public:
+  // Numbers are detected as FLOAT, like InfluxDB does for numbers without the i suffix. A series that starts with 20 and later
+  // reports 20.5 would otherwise get a field type conflict. Use type=integer on the rule for integer fields.
+  [[nodiscard]] static Type detect(std::string_view text);
+  [[nodiscard]] static Type parseType(std::string_view name);
+
+  // Returns false if text can't be represented as type. line is left unchanged in that case.
+  // quoted is for strings a decoder has validated as quoted and escaped for a string field already. Other text is escaped
+  [[nodiscard]] static bool append(std::string& line, std::string_view text, Type type, bool quoted = false);
+
+  // ns per value for float and integer fields, against std::stod/std::stoll and std::to_string
+  static void benchmark(std::ostream& out);
+
+private:
+  [[nodiscard]] static bool parseDouble(std::string_view text, double& value);
+  [[nodiscard]] static bool parseBoolean(std::string_view text, bool& value);
+  [[nodiscard]] static bool appendString(std::string& line, std::string_view text, bool quoted);
+};
+
+#endif // _FIELD_H_
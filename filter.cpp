@@ -0,0 +1,51 @@
+#include "filter.h"
+
+#include <charconv>
+#include <cmath>
+#include <functional>
+
+
+SeriesFilter::SeriesFilter(size_t max_series)
+: m_states(max_series, State{0.0, 0, 0, false})
+{
+}
+
+void SeriesFilter::reset(uint32_t series_id)
+{
+  std::lock_guard<std::mutex> lock(m_locks[series_id % LOCK_COUNT]);
+  m_states[series_id].valid = false;
+}
+
+bool SeriesFilter::accept(uint32_t series_id, const Options& options, std::string_view value, int64_t now_ms)
+{
+  double number;
+  const std::from_chars_result result = std::from_chars(value.data(), value.data()+value.length(), number);
+  const bool is_number = result.ec==std::errc() && result.ptr==value.data()+value.length();
+  const uint64_t text_hash = is_number ? 0 : std::hash<std::string_view>()(value);
+
+  std::lock_guard<std::mutex> lock(m_locks[series_id % LOCK_COUNT]);
+  State& state = m_states[series_id];
+  if (state.valid)
+  {
+    const int64_t elapsed_ms = now_ms - state.written_ms;
+    const bool heartbeat_due = options.heartbeat_ms>0 && elapsed_ms>=options.heartbeat_ms;
+    if (!heartbeat_due)
+    {
+      if (elapsed_ms < options.min_interval_ms)
+        return false;
+
+      if (options.deadband >= 0.0)
+      {
+        const bool changed = is_number ? std::fabs(number-state.value)>options.deadband : text_hash!=state.text_hash;
+        if (!changed)
+          return false;
+      }
+    }
+  }
+
+  state.value = is_number ? number : 0.0;
+  state.text_hash = text_hash;
+  state.written_ms = now_ms;
+  state.valid = true;
+  return true;
+}
@@ -0,0 +1,48 @@
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include <mutex>
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+
+
+/*
+ * Drops unchanged or insignificant updates per series before they are encoded for InfluxDB.
+ * The last written value of each series is kept in a flat table indexed by SeriesTable::Series::id.
+ */
+class SeriesFilter
+{
+public:
+  struct Options {
+    double deadband = -1.0;     // Numeric change needed to write a point. 0 writes changed values only. Negative to disable
+    int64_t min_interval_ms = 0; // Minimum time between points
+    int64_t heartbeat_ms = 0;    // Write unchanged values anyway this long after the last point. 0 to disable
+
+    [[nodiscard]] bool isEnabled() const {return deadband>=0.0 || min_interval_ms>0 || heartbeat_ms>0;}
+  };
+
+private:
+  static constexpr size_t LOCK_COUNT = 64;
+
+  struct State {
+    double value;
+    uint64_t text_hash; // For values that aren't numbers
+    int64_t written_ms;
+    bool valid;
+  };
+
+public:
+  SeriesFilter(size_t max_series);
+
+  // Call when a series id is (re)assigned, so state from an evicted series isn't used
+  void reset(uint32_t series_id);
+  // Returns true if the value should be written, and then records it as the last written value
+  [[nodiscard]] bool accept(uint32_t series_id, const Options& options, std::string_view value, int64_t now_ms);
+
+private:
+  std::vector<State> m_states;
+  std::mutex m_locks[LOCK_COUNT]; // Striped by series id. A series is usually published by one client only
+};
+
+#endif // _FILTER_H_
@@ -0,0 +1,391 @@
+#include "http_client.h"
+
+#include <algorithm>
+#include <climits>
+#include <ctime>
+#include <strings.h>
+
+#include "buffer.h"
+
+
+namespace
+{
+  bool headerIs(std::string_view line, std::string_view name, std::string_view& value)
+  {
+    if (line.length()<=name.length() || line[name.length()]!=':' || 0!=::strncasecmp(line.data(), name.data(), name.length()))
+      return false;
+
+    value = line.substr(name.length()+1);
+    while (!value.empty() && (value.front()==' ' || value.front()=='\t'))
+      value.remove_prefix(1);
+    return true;
+  }
+
+  bool parseNumber(std::string_view value, int base, size_t& number)
+  {
+    number = 0;
+    if (value.empty())
+      return false;
+
+    for (const char c : value)
+    {
+      int digit;
+      if (c>='0' && c<='9') digit = c-'0';
+      else if (base==16 && c>='a' && c<='f') digit = c-'a'+10;
+      else if (base==16 && c>='A' && c<='F') digit = c-'A'+10;
+      else if (c==';' || c==' ') break; //Chunk extensions
+      else return false;
+      number = number*base + digit;
+    }
+    return true;
+  }
+}
+
+
+HttpClient::HttpClient(const std::string& host, int port, bool tls, const std::string& tls_ca_file, int max_connections)
+: m_host(host),
+  m_port(std::to_string(port)),
+  m_tls(tls),
+  m_max_connections(std::max(1, max_connections)),
+  m_tls_session(nullptr),
+  m_stop(false)
+{
+  if (m_tls)
+  {
+    m_tls_context = std::make_unique<asio::ssl::context>(asio::ssl::context::tls_client);
+    m_tls_context->set_verify_mode(asio::ssl::verify_peer);
+    if (tls_ca_file.empty())
+      m_tls_context->set_default_verify_paths();
+    else
+      m_tls_context->load_verify_file(tls_ca_file);
+
+    // Remember the most recent session (TLS 1.3 tickets arrive after the handshake), and offer it when a pooled connection reconnects
+    SSL_CTX* ctx = m_tls_context->native_handle();
+    SSL_CTX_set_app_data(ctx, this);
+    ::SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    ::SSL_CTX_sess_set_new_cb(ctx, [](SSL* ssl, SSL_SESSION* session) -> int
+    {
+      HttpClient* client = static_cast<HttpClient*>(SSL_CTX_get_app_data(::SSL_get_SSL_CTX(ssl)));
+      std::lock_guard<std::mutex> lock(client->m_tls_session_lock);
+      if (client->m_tls_session)
+        ::SSL_SESSION_free(client->m_tls_session);
+      client->m_tls_session = session;
+      return 1; //We keep the reference
+    });
+  }
+
+  for (size_t i=0; i<m_max_connections; i++)
+  {
+    m_threads.emplace_back(&HttpClient::run, this);
+  }
+}
+
+HttpClient::~HttpClient()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_queue_lock);
+    m_stop = true;
+  }
+  m_queue_not_empty.notify_all();
+  m_queue_not_full.notify_all();
+
+  for (std::thread& thread : m_threads)
+  {
+    thread.join();
+  }
+
+  if (m_tls_session)
+    ::SSL_SESSION_free(m_tls_session);
+}
+
+void HttpClient::post(const std::string& path, const std::string& content_type, std::vector<BodyPart> body, Callback callback,
+                      const std::string& extra_headers)
+{
+  size_t content_length = 0;
+  for (const BodyPart& part : body)
+  {
+    content_length += part.length;
+  }
+
+  Request request;
+  request.header = "POST " + path + " HTTP/1.1\r\n"
+                   "Host: " + m_host + ":" + m_port + "\r\n"
+                   "Content-Type: " + content_type + "\r\n"
+                   "Content-Length: " + std::to_string(content_length) + "\r\n" +
+                   extra_headers +
+                   "\r\n";
+  request.body = std::move(body);
+  request.callback = std::move(callback);
+
+  {
+    std::unique_lock<std::mutex> lock(m_queue_lock);
+    m_queue_not_full.wait(lock, [this] {return m_stop || m_queue.size()<m_max_connections;});
+    m_queue.push_back(std::move(request));
+  }
+  m_queue_not_empty.notify_one();
+}
+
+void HttpClient::run()
+{
+  asio::io_context io_context;
+  PooledConnection connection(io_context);
+  while (true)
+  {
+    Request request;
+    {
+      std::unique_lock<std::mutex> lock(m_queue_lock);
+      m_queue_not_empty.wait(lock, [this] {return m_stop || !m_queue.empty();});
+      if (m_queue.empty())
+        break;
+
+      request = std::move(m_queue.front());
+      m_queue.pop_front();
+    }
+    m_queue_not_full.notify_one();
+
+    Response response;
+    bool keep_alive = true;
+    std::error_code error_code = send(connection, request, response, keep_alive);
+    if (IS_ERROR(error_code) || !keep_alive)
+      disconnect(connection);
+
+    request.callback(error_code, response);
+  }
+
+  disconnect(connection);
+}
+
+std::error_code HttpClient::connect(PooledConnection& connection)
+{
+  std::error_code error_code;
+  asio::ip::tcp::resolver::results_type endpoints;
+  connection.resolver.async_resolve(m_host, m_port, [&](const std::error_code& result, asio::ip::tcp::resolver::results_type results)
+  {
+    error_code = result;
+    endpoints = std::move(results);
+  });
+  if (IS_ERROR(error_code=await(connection, CONNECT_TIMEOUT, error_code)))
+    return error_code;
+
+  asio::async_connect(connection.socket, endpoints, [&](const std::error_code& result, const asio::ip::tcp::endpoint&) {error_code = result;});
+  if (IS_ERROR(error_code=await(connection, CONNECT_TIMEOUT, error_code)))
+    return error_code;
+
+  connection.socket.set_option(asio::ip::tcp::no_delay(true), error_code);
+
+  if (m_tls)
+  {
+    connection.tls_stream = std::make_unique<asio::ssl::stream<asio::ip::tcp::socket&>>(connection.socket, *m_tls_context);
+    SSL* ssl = connection.tls_stream->native_handle();
+    ::SSL_set_tlsext_host_name(ssl, m_host.c_str());
+    ::SSL_set1_host(ssl, m_host.c_str());
+    {
+      std::lock_guard<std::mutex> lock(m_tls_session_lock);
+      if (m_tls_session)
+        ::SSL_set_session(ssl, m_tls_session);
+    }
+
+    connection.tls_stream->async_handshake(asio::ssl::stream_base::client, [&](const std::error_code& result) {error_code = result;});
+    if (IS_ERROR(error_code=await(connection, CONNECT_TIMEOUT, error_code)))
+      return error_code;
+  }
+
+  connection.connected = true;
+  return error_code;
+}
+
+void HttpClient::disconnect(PooledConnection& connection)
+{
+  std::error_code error_code;
+  connection.tls_stream.reset();
+  connection.socket.close(error_code);
+  connection.read_buffer.clear();
+  connection.connected = false;
+}
+
+// A keep-alive connection may have been closed by the server while idle. In that case the request is retried once on a new
+// connection. InfluxDB writes are idempotent, so a retried batch that was in fact written does no harm.
+std::error_code HttpClient::send(PooledConnection& connection, const Request& request, Response& response, bool& keep_alive)
+{
+  std::error_code error_code;
+  for (int attempt=0; attempt<2; attempt++)
+  {
+    const bool reused = connection.connected;
+    if (!reused && IS_ERROR(error_code=connect(connection)))
+    {
+      disconnect(connection);
+      return error_code;
+    }
+
+    if (connection.tls_stream)
+      error_code = exchange(*connection.tls_stream, connection, request, response, keep_alive);
+    else
+      error_code = exchange(connection.socket, connection, request, response, keep_alive);
+
+    if (IS_OK(error_code) || !reused || error_code==std::errc::timed_out) //A server too slow to answer is not retried
+      return error_code;
+
+    disconnect(connection);
+  }
+  return error_code;
+}
+
+template<typename Stream>
+std::error_code HttpClient::exchange(Stream& stream, PooledConnection& connection, const Request& request, Response& response, bool& keep_alive)
+{
+  std::error_code error_code;
+  size_t transferred = 0;
+  auto handler = [&error_code, &transferred](const std::error_code& result, size_t length)
+  {
+    error_code = result;
+    transferred = length;
+  };
+
+  // A plain socket gathers the parts in one writev per IOV_MAX parts. TLS would encrypt every part in a record of its own, so
+  // there they are joined first, as encrypting copies them anyway
+  std::vector<asio::const_buffer> buffers;
+  std::string joined;
+  buffers.push_back(asio::buffer(request.header));
+  if (connection.tls_stream && request.body.size()>1)
+  {
+    for (const BodyPart& part : request.body)
+    {
+      joined.append(*part.data, part.offset, part.length);
+    }
+    buffers.push_back(asio::buffer(joined));
+  }
+  else
+  {
+    for (const BodyPart& part : request.body)
+    {
+      buffers.push_back(asio::buffer(part.data->data()+part.offset, part.length));
+    }
+  }
+  asio::async_write(stream, buffers, handler);
+  if (IS_ERROR(error_code=await(connection, WRITE_TIMEOUT, error_code)))
+    return error_code;
+
+  std::string& read_buffer = connection.read_buffer;
+  asio::async_read_until(stream, asio::dynamic_buffer(read_buffer, MAX_HEADER_LENGTH), "\r\n\r\n", handler);
+  if (IS_ERROR(error_code=await(connection, READ_TIMEOUT, error_code)))
+    return error_code;
+  const size_t header_length = transferred;
+
+  // Status-Line = HTTP-Version SP Status-Code SP Reason-Phrase CRLF
+  const std::string_view header(read_buffer.data(), header_length);
+  if (header.length()<12 || 0!=header.compare(0, 5, "HTTP/"))
+    return std::make_error_code(std::errc::protocol_error);
+
+  size_t status;
+  if (!parseNumber(header.substr(9, 3), 10, status))
+    return std::make_error_code(std::errc::protocol_error);
+  response.status = static_cast<int>(status);
+  keep_alive = 0==header.compare(0, 8, "HTTP/1.1");
+
+  bool has_content_length = false, chunked = false;
+  size_t content_length = 0;
+  size_t line_start = header.find("\r\n")+2;
+  while (line_start < header.length())
+  {
+    const size_t line_end = header.find("\r\n", line_start);
+    const std::string_view line = header.substr(line_start, line_end-line_start);
+    std::string_view value;
+    if (headerIs(line, "Content-Length", value))
+      has_content_length = parseNumber(value, 10, content_length);
+    else if (headerIs(line, "Transfer-Encoding", value))
+      chunked = std::string_view::npos != value.find("chunked");
+    else if (headerIs(line, "Connection", value))
+      keep_alive = keep_alive && 0!=::strncasecmp(value.data(), "close", 5);
+    else if (headerIs(line, "Retry-After", value))
+      response.retry_after = parseRetryAfter(value);
+    line_start = line_end+2;
+  }
+  read_buffer.erase(0, header_length);
+
+  if (chunked)
+  {
+    while (true)
+    {
+      asio::async_read_until(stream, asio::dynamic_buffer(read_buffer, MAX_HEADER_LENGTH), "\r\n", handler);
+      if (IS_ERROR(error_code=await(connection, READ_TIMEOUT, error_code)))
+        return error_code;
+      const size_t size_length = transferred;
+
+      size_t chunk_length;
+      if (!parseNumber(std::string_view(read_buffer.data(), size_length-2), 16, chunk_length))
+        return std::make_error_code(std::errc::protocol_error);
+      read_buffer.erase(0, size_length);
+
+      if (read_buffer.length() < chunk_length+2)
+      {
+        asio::async_read(stream, asio::dynamic_buffer(read_buffer), asio::transfer_exactly(chunk_length+2-read_buffer.length()), handler);
+        if (IS_ERROR(error_code=await(connection, READ_TIMEOUT, error_code)))
+          return error_code;
+      }
+      response.body.append(read_buffer, 0, chunk_length);
+      read_buffer.erase(0, chunk_length+2);
+
+      if (chunk_length == 0) //Trailers are not used by InfluxDB
+        return error_code;
+    }
+  }
+
+  if (!has_content_length)
+  {
+    if (response.status==204 || response.status==304 || response.status<200)
+      return error_code;
+
+    // Body is delimited by the server closing the connection
+    keep_alive = false;
+    asio::async_read(stream, asio::dynamic_buffer(read_buffer), handler);
+    error_code = await(connection, READ_TIMEOUT, error_code);
+    if (error_code == asio::error::eof || error_code == asio::ssl::error::stream_truncated)
+      error_code.clear();
+    response.body.swap(read_buffer);
+    read_buffer.clear();
+    return error_code;
+  }
+
+  if (read_buffer.length() < content_length)
+  {
+    asio::async_read(stream, asio::dynamic_buffer(read_buffer), asio::transfer_exactly(content_length-read_buffer.length()), handler);
+    if (IS_ERROR(error_code=await(connection, READ_TIMEOUT, error_code)))
+      return error_code;
+  }
+  response.body.assign(read_buffer, 0, content_length);
+  read_buffer.erase(0, content_length);
+  return error_code;
+}
+
+std::error_code HttpClient::await(PooledConnection& connection, std::chrono::steady_clock::duration timeout, const std::error_code& error_code)
+{
+  connection.io_context.restart();
+  connection.io_context.run_for(timeout);
+  if (connection.io_context.stopped()) //Out of work, so the handler has run
+    return error_code;
+
+  // Closing the socket completes the operation with operation_aborted
+  std::error_code ignored;
+  connection.resolver.cancel();
+  connection.socket.close(ignored);
+  connection.io_context.run();
+  return std::make_error_code(std::errc::timed_out);
+}
+
+int HttpClient::parseRetryAfter(std::string_view value)
+{
+  size_t seconds;
+  if (parseNumber(value, 10, seconds))
+    return static_cast<int>(std::min<size_t>(seconds, INT_MAX));
+
+  // IMF-fixdate, as in "Sun, 06 Nov 1994 08:49:37 GMT". The obsolete RFC 850 and asctime formats are not accepted
+  while (!value.empty() && (value.back()==' ' || value.back()=='\t'))
+    value.remove_suffix(1);
+  const std::string date(value);
+  std::tm tm = {};
+  const char* end = ::strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (!end || *end!='\0')
+    return -1;
+
+  return static_cast<int>(std::clamp<int64_t>(::timegm(&tm) - std::time(nullptr), 0, INT_MAX));
+}
@@ -0,0 +1,106 @@
+#ifndef _HTTP_CLIENT_H_
+#define _HTTP_CLIENT_H_
+
+#include <asio.hpp>
+#include <asio/ssl.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+
+/*
+ * HTTP/1.1 client with a pool of keep-alive connections to one host. Each connection is owned by one pool thread, so up to
+ * max_connections requests are in flight at the same time. TLS sessions are resumed when a pooled connection is re-established.
+ * Every step runs asynchronously on the thread's own io_context against a deadline. One that misses it closes the connection,
+ * and the request fails with timed_out.
+ */
+class HttpClient
+{
+public:
+  struct Response {
+    int status = 0;
+    int retry_after = -1; // Seconds, -1 if there was no Retry-After header. An HTTP-date must be in the preferred IMF-fixdate format
+    std::string body;
+  };
+
+  // A range of a buffer that may be shared with other requests. A body is sent as a list of these, without joining them
+  struct BodyPart {
+    std::shared_ptr<const std::string> data;
+    size_t offset;
+    size_t length;
+  };
+
+  using Callback = std::function<void(std::error_code error_code, const Response& response)>;
+
+private:
+  static constexpr size_t MAX_HEADER_LENGTH = 16*1024L;
+  static constexpr std::chrono::seconds CONNECT_TIMEOUT{10}; // Each of resolving, connecting and the TLS handshake
+  static constexpr std::chrono::seconds WRITE_TIMEOUT{30};   // The whole request
+  static constexpr std::chrono::seconds READ_TIMEOUT{30};    // The response header, and then the body
+
+  struct Request {
+    std::string header;
+    std::vector<BodyPart> body;
+    Callback callback;
+  };
+
+  struct PooledConnection {
+    PooledConnection(asio::io_context& io_context) : io_context(io_context), resolver(io_context), socket(io_context) {}
+    asio::io_context& io_context;
+    asio::ip::tcp::resolver resolver;
+    asio::ip::tcp::socket socket;
+    std::unique_ptr<asio::ssl::stream<asio::ip::tcp::socket&>> tls_stream;
+    std::string read_buffer;
+    bool connected = false;
+  };
+
+public:
+  HttpClient(const std::string& host, int port, bool tls, const std::string& tls_ca_file, int max_connections);
+  ~HttpClient();
+
+  // Returns when the request is queued. Blocks while max_connections requests are already waiting for a connection
+  void post(const std::string& path, const std::string& content_type, std::vector<BodyPart> body, Callback callback,
+            const std::string& extra_headers = "");
+
+private:
+  void run();
+
+  [[nodiscard]] std::error_code connect(PooledConnection& connection);
+  void disconnect(PooledConnection& connection);
+  [[nodiscard]] std::error_code send(PooledConnection& connection, const Request& request, Response& response, bool& keep_alive);
+
+  template<typename Stream>
+  [[nodiscard]] std::error_code exchange(Stream& stream, PooledConnection& connection, const Request& request, Response& response, bool& keep_alive);
+  // Runs the operation started on connection until its handler has set error_code, or cancels it after timeout
+  [[nodiscard]] static std::error_code await(PooledConnection& connection, std::chrono::steady_clock::duration timeout, const std::error_code& error_code);
+  // Delay-seconds, or an IMF-fixdate (RFC 9110, 10.2.3). -1 for anything else
+  [[nodiscard]] static int parseRetryAfter(std::string_view value);
+
+private:
+  std::string m_host;
+  std::string m_port;
+  bool m_tls;
+  size_t m_max_connections;
+
+  std::unique_ptr<asio::ssl::context> m_tls_context;
+  std::mutex m_tls_session_lock;
+  SSL_SESSION* m_tls_session;
+
+  std::mutex m_queue_lock;
+  std::condition_variable m_queue_not_empty;
+  std::condition_variable m_queue_not_full;
+  std::deque<Request> m_queue;
+  bool m_stop;
+
+  std::vector<std::thread> m_threads;
+};
+
+#endif // _HTTP_CLIENT_H_
@@ -0,0 +1,309 @@
+#include "influxdb.h"
+
+#include "buffer.h"
+#include "log.h"
+#include "memory_account.h"
+#include "metrics.h"
+#include "session.h"
+#include "trace.h"
+
+
+namespace
+{
+  std::string urlEncode(const std::string& value)
+  {
+    static constexpr char HEX[] = "0123456789ABCDEF";
+    std::string encoded;
+    for (const unsigned char c : value)
+    {
+      if (isalnum(c) || c=='-' || c=='_' || c=='.' || c=='~')
+      {
+        encoded += static_cast<char>(c);
+      }
+      else
+      {
+        encoded += '%';
+        encoded += HEX[c >> 4];
+        encoded += HEX[c & 0x0F];
+      }
+    }
+    return encoded;
+  }
+}
+
+
+InfluxDBWriter::InfluxDBWriter(const std::shared_ptr<Properties::Server>& server)
+: m_server(server),
+  m_controller(server->name, server->influxdb_connections, server->influxdb_target_latency_ms),
+  m_stop(false)
+{
+  std::string credentials;
+  if (!m_server->influxdb_username.empty())
+  {
+    credentials = "&u=" + urlEncode(m_server->influxdb_username) + "&p=" + urlEncode(m_server->influxdb_password);
+  }
+
+  for (int precision=0; precision<Clock::PRECISION_COUNT; precision++)
+  {
+    m_paths[precision] = "/write?db=" + urlEncode(m_server->influxdb_database) +
+                         "&precision=" + Clock::getPrecisionName(static_cast<Clock::Precision>(precision)) + credentials;
+    m_batches[precision].gzip = m_server->influxdb_gzip;
+  }
+
+  m_http_client = std::make_unique<HttpClient>(m_server->influxdb_host, m_server->influxdb_port, m_server->influxdb_tls,
+                                               m_server->influxdb_tls_ca, m_server->influxdb_connections);
+
+  m_thread = std::thread(&InfluxDBWriter::run, this);
+}
+
+InfluxDBWriter::~InfluxDBWriter()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_batch_lock);
+    m_stop = true;
+  }
+  m_batch_ready.notify_all();
+  m_controller.stop();
+  m_thread.join();
+  m_http_client.reset(); //Completes queued batches
+
+  for (Batch& batch : m_batches)
+  {
+    if (batch.deflate_initialized)
+      ::deflateEnd(&batch.deflate_stream);
+  }
+}
+
+void InfluxDBWriter::write(std::string_view line, const std::shared_ptr<const std::string>& segment, const std::shared_ptr<PendingAck>& ack,
+                           Clock::Precision precision, const std::shared_ptr<Trace>& trace, const std::shared_ptr<MemoryAccount>& account)
+{
+  if (trace)
+    trace->stamp(Trace::ENQUEUED);
+
+  bool batch_full;
+  {
+    std::lock_guard<std::mutex> lock(m_batch_lock);
+    Batch& batch = m_batches[precision];
+    appendToBatch(batch, line, segment);
+
+    if (trace)
+    {
+      trace->stamp(Trace::BATCHED);
+      if (batch.traces.empty() || batch.traces.back()!=trace)
+        batch.traces.push_back(trace);
+    }
+
+    if (account)
+    {
+      account->charge(MemoryAccount::INFLUXDB_BATCH, line.length());
+      if (!batch.charges.empty() && batch.charges.back().first==account)
+        batch.charges.back().second += line.length();
+      else
+        batch.charges.emplace_back(account, line.length());
+    }
+
+    // A message routed to this server by several rules is held once per batch
+    if (ack && m_server->puback_when_stored && (batch.acks.empty() || batch.acks.back()!=ack))
+    {
+      ack->retain();
+      batch.acks.push_back(ack);
+    }
+
+    batch_full = batch.uncompressed_length >= m_controller.getBatchLength();
+  }
+
+  if (batch_full)
+    m_batch_ready.notify_one();
+}
+
+void InfluxDBWriter::appendToBatch(Batch& batch, std::string_view line, const std::shared_ptr<const std::string>& segment)
+{
+  // windowBits 15+16 writes a gzip header and trailer. Level 1, as the link to InfluxDB, not CPU, is the bottleneck
+  if (batch.gzip && !batch.deflate_initialized &&
+      !(batch.deflate_initialized = Z_OK==::deflateInit2(&batch.deflate_stream, Z_BEST_SPEED, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY)))
+  {
+    Log::write(Log::INFLUXDB_GZIP_FAILED, m_server->name);
+    batch.gzip = false;
+  }
+
+  batch.uncompressed_length += line.length();
+  if (!batch.gzip)
+  {
+    batch.length = batch.uncompressed_length;
+    if (segment)
+    {
+      batch.parts.push_back(HttpClient::BodyPart{segment, 0, segment->length()});
+      return;
+    }
+
+    // Consecutive copied lines are one part
+    if (batch.parts.empty() || batch.parts.back().data)
+      batch.parts.push_back(HttpClient::BodyPart{nullptr, batch.data.length(), 0});
+    batch.parts.back().length += line.length();
+    batch.data += line;
+    return;
+  }
+
+  deflateToBatch(batch, line.data(), line.length(), Z_NO_FLUSH);
+}
+
+void InfluxDBWriter::deflateToBatch(Batch& batch, const char* data, size_t length, int flush)
+{
+  const auto start = std::chrono::steady_clock::now();
+
+  z_stream& stream = batch.deflate_stream;
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  stream.avail_in = static_cast<uInt>(length);
+  int result;
+  do
+  {
+    if (batch.data.length()-batch.length < COMPRESS_CHUNK_LENGTH/2)
+      batch.data.resize(batch.data.length() + COMPRESS_CHUNK_LENGTH);
+
+    stream.next_out = reinterpret_cast<Bytef*>(batch.data.data() + batch.length);
+    stream.avail_out = static_cast<uInt>(batch.data.length() - batch.length);
+    result = ::deflate(&stream, flush);
+    batch.length = batch.data.length() - stream.avail_out;
+  }
+  while (stream.avail_in>0 || (flush==Z_FINISH && result!=Z_STREAM_END) || stream.avail_out==0);
+
+  Metrics::add(Metrics::INFLUXDB_COMPRESS_NANOSECONDS, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start).count());
+}
+
+// Called with m_batch_lock held, before the batch is handed over to the HTTP client
+void InfluxDBWriter::finishBatch(Batch& batch, std::vector<HttpClient::BodyPart>& body)
+{
+  if (batch.gzip)
+  {
+    deflateToBatch(batch, nullptr, 0, Z_FINISH);
+    ::deflateReset(&batch.deflate_stream);
+    batch.data.resize(batch.length);
+  }
+
+  std::shared_ptr<std::string> data = std::make_shared<std::string>();
+  data->swap(batch.data);
+  if (batch.gzip)
+  {
+    body.push_back(HttpClient::BodyPart{data, 0, data->length()});
+  }
+  else
+  {
+    body.swap(batch.parts);
+    for (HttpClient::BodyPart& part : body)
+    {
+      if (!part.data)
+        part.data = data;
+    }
+  }
+
+  Metrics::add(Metrics::INFLUXDB_BATCHES, 1);
+  Metrics::add(Metrics::INFLUXDB_BYTES_UNCOMPRESSED, batch.uncompressed_length);
+  Metrics::add(Metrics::INFLUXDB_BYTES_SENT, batch.length);
+  batch.length = 0;
+  batch.uncompressed_length = 0;
+}
+
+// Called with m_batch_lock held
+bool InfluxDBWriter::isAnyBatchFull() const
+{
+  const size_t batch_length = m_controller.getBatchLength();
+  for (const Batch& batch : m_batches)
+  {
+    if (batch.uncompressed_length >= batch_length)
+      return true;
+  }
+  return false;
+}
+
+void InfluxDBWriter::run()
+{
+  while (true)
+  {
+    struct Finished {
+      Clock::Precision precision;
+      bool gzip;
+      std::vector<HttpClient::BodyPart> body;
+      std::vector<std::shared_ptr<PendingAck>> acks;
+      std::vector<std::shared_ptr<Trace>> traces;
+      std::vector<std::pair<std::shared_ptr<MemoryAccount>,size_t>> charges;
+    };
+    std::vector<Finished> finished;
+    bool stop;
+    {
+      std::unique_lock<std::mutex> lock(m_batch_lock);
+      m_batch_ready.wait_for(lock, FLUSH_INTERVAL, [this] {return m_stop || isAnyBatchFull();});
+      stop = m_stop;
+
+      for (int precision=0; precision<Clock::PRECISION_COUNT; precision++)
+      {
+        Batch& batch = m_batches[precision];
+        if (batch.uncompressed_length == 0)
+          continue;
+
+        finished.push_back(Finished{static_cast<Clock::Precision>(precision), batch.gzip, {}, {}, {}, {}});
+        finishBatch(batch, finished.back().body);
+        finished.back().acks.swap(batch.acks);
+        finished.back().traces.swap(batch.traces);
+        finished.back().charges.swap(batch.charges);
+      }
+    }
+
+    for (Finished& batch : finished)
+    {
+      post(batch.precision, batch.gzip, std::move(batch.body), std::move(batch.acks), std::move(batch.traces), std::move(batch.charges));
+    }
+
+    if (stop && finished.empty())
+      break;
+  }
+}
+
+// Returns as soon as the batch is queued. Blocks while the controller holds back writes, so the next batch keeps growing meanwhile
+void InfluxDBWriter::post(Clock::Precision precision, bool gzip, std::vector<HttpClient::BodyPart> body, std::vector<std::shared_ptr<PendingAck>> batch_acks,
+                          std::vector<std::shared_ptr<Trace>> batch_traces, std::vector<std::pair<std::shared_ptr<MemoryAccount>,size_t>> batch_charges)
+{
+  for (const std::shared_ptr<Trace>& trace : batch_traces)
+  {
+    trace->stamp(Trace::FLUSHED);
+  }
+
+  size_t batch_length = 0;
+  for (const HttpClient::BodyPart& part : body)
+  {
+    batch_length += part.length;
+  }
+
+  const int64_t begin_ms = m_controller.begin();
+  m_http_client->post(m_paths[precision], "text/plain; charset=utf-8", std::move(body),
+                      [this, batch_length, begin_ms, batch_acks=std::move(batch_acks), batch_traces=std::move(batch_traces),
+                       batch_charges=std::move(batch_charges)](std::error_code error_code, const HttpClient::Response& response)
+  {
+    for (const std::shared_ptr<Trace>& trace : batch_traces)
+    {
+      trace->stamp(Trace::ACKED);
+    }
+
+    for (const auto& [account, bytes] : batch_charges)
+    {
+      account->release(MemoryAccount::INFLUXDB_BATCH, bytes);
+    }
+
+    m_controller.end(begin_ms, !IS_OK(error_code), response.status, response.retry_after);
+
+    if (IS_OK(error_code) && (response.status<200 || response.status>299))
+    {
+      Log::write(Log::INFLUXDB_REJECTED, m_server->name, batch_length, response.status, response.body);
+      error_code = std::make_error_code(std::errc::io_error);
+    }
+    else if (IS_ERROR(error_code))
+    {
+      Log::write(Log::INFLUXDB_WRITE_FAILED, batch_length, m_server->name, error_code);
+    }
+
+    for (const std::shared_ptr<PendingAck>& ack : batch_acks)
+    {
+      ack->release(IS_OK(error_code));
+    }
+  },
+  gzip ? "Content-Encoding: gzip\r\n" : "");
+}
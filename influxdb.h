@@ -0,0 +1,97 @@
+#ifndef _INFLUXDB_H_
+#define _INFLUXDB_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <zlib.h>
+
+#include "clock.h"
+#include "http_client.h"
+#include "properties.h"
+#include "write_controller.h"
+
+
+class MemoryAccount;
+class PendingAck;
+class Trace;
+
+
+/*
+ * Batches line protocol for one [server] section, and writes it to InfluxDB from a background thread.
+ * Batches are sent when they reach the batch length of the WriteController, or after FLUSH_INTERVAL. Up to
+ * influxdb_connections batches are in flight at the same time, each on its own keep-alive connection, as the controller allows.
+ * With influxdb_compression=gzip, lines are compressed into the batch as they are appended, by a deflate stream that is
+ * reset and reused for every batch.
+ * The timestamp precision is a parameter of the write request, so there is one batch per precision in use.
+ */
+class InfluxDBWriter
+{
+private:
+  static constexpr std::chrono::milliseconds FLUSH_INTERVAL{100};
+  static constexpr size_t COMPRESS_CHUNK_LENGTH = 16*1024L;
+
+  struct Batch {
+    std::string data; // Lines written by copy. When compressing, every line, of which only the first length bytes are used
+    std::vector<HttpClient::BodyPart> parts; // When not compressing. Parts without data are ranges of the data above
+    size_t length = 0;
+    size_t uncompressed_length = 0;
+    std::vector<std::shared_ptr<PendingAck>> acks;
+    std::vector<std::shared_ptr<Trace>> traces;
+    std::vector<std::pair<std::shared_ptr<MemoryAccount>,size_t>> charges; // Released when InfluxDB has answered
+    bool gzip = false;
+    z_stream deflate_stream = z_stream(); // Initialized on first use, as most servers only use one precision
+    bool deflate_initialized = false;
+  };
+
+public:
+  InfluxDBWriter(const std::shared_ptr<Properties::Server>& server);
+  ~InfluxDBWriter();
+
+  // ack may be nullptr. If the server defers PUBACKs, the ack is held until the batch holding line is acknowledged.
+  // line is charged to account, if any, until then as well
+  void write(const std::string& line, const std::shared_ptr<PendingAck>& ack, Clock::Precision precision = Clock::NANOSECONDS,
+             const std::shared_ptr<Trace>& trace = nullptr, const std::shared_ptr<MemoryAccount>& account = nullptr)
+  {
+    write(line, nullptr, ack, precision, trace, account);
+  }
+  // For lines written to several servers. An uncompressed batch references segment instead of copying it
+  void write(const std::shared_ptr<const std::string>& segment, const std::shared_ptr<PendingAck>& ack, Clock::Precision precision,
+             const std::shared_ptr<Trace>& trace, const std::shared_ptr<MemoryAccount>& account)
+  {
+    write(*segment, segment, ack, precision, trace, account);
+  }
+
+private:
+  void write(std::string_view line, const std::shared_ptr<const std::string>& segment, const std::shared_ptr<PendingAck>& ack,
+             Clock::Precision precision, const std::shared_ptr<Trace>& trace, const std::shared_ptr<MemoryAccount>& account);
+  void appendToBatch(Batch& batch, std::string_view line, const std::shared_ptr<const std::string>& segment);
+  void deflateToBatch(Batch& batch, const char* data, size_t length, int flush);
+  void finishBatch(Batch& batch, std::vector<HttpClient::BodyPart>& body);
+  [[nodiscard]] bool isAnyBatchFull() const;
+  void run();
+  void post(Clock::Precision precision, bool gzip, std::vector<HttpClient::BodyPart> body, std::vector<std::shared_ptr<PendingAck>> batch_acks,
+            std::vector<std::shared_ptr<Trace>> batch_traces, std::vector<std::pair<std::shared_ptr<MemoryAccount>,size_t>> batch_charges);
+
+private:
+  std::shared_ptr<Properties::Server> m_server;
+  std::string m_paths[Clock::PRECISION_COUNT];
+  std::unique_ptr<HttpClient> m_http_client;
+  WriteController m_controller;
+
+  std::mutex m_batch_lock;
+  std::condition_variable m_batch_ready;
+  Batch m_batches[Clock::PRECISION_COUNT];
+  bool m_stop;
+
+  std::thread m_thread;
+};
+
+#endif // _INFLUXDB_H_
@@ -0,0 +1,249 @@
+#include "log.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <thread>
+
+#include "clock.h"
+#include "metrics.h"
+
+
+Log::Limit Log::s_limits[Log::MESSAGE_COUNT];
+std::mutex Log::s_rings_lock;
+std::vector<std::shared_ptr<Log::Ring>> Log::s_rings;
+std::mutex Log::s_drain_lock;
+
+
+void Log::start()
+{
+  std::thread([]()
+  {
+    while (true)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(DRAIN_INTERVAL_MS));
+      drain();
+    }
+  }).detach();
+}
+
+void Log::flush()
+{
+  drain();
+}
+
+// At most MAX_PER_SECOND of each message type. The counter is reset by the first message in a new second, so a burst
+// right at the boundary may let a few more through
+bool Log::admit(Message message)
+{
+  Limit& limit = s_limits[message];
+  const int64_t second = Clock::monotonicMs() / 1000;
+  int64_t current = limit.second.load(std::memory_order_relaxed);
+  if (current!=second && limit.second.compare_exchange_strong(current, second, std::memory_order_relaxed))
+    limit.count.store(0, std::memory_order_relaxed);
+
+  if (limit.count.fetch_add(1, std::memory_order_relaxed) < MAX_PER_SECOND)
+    return true;
+
+  drop(message);
+  return false;
+}
+
+void Log::drop(Message message)
+{
+  s_limits[message].dropped.fetch_add(1, std::memory_order_relaxed);
+  Metrics::add(Metrics::LOG_DROPPED, 1);
+}
+
+Log::Ring& Log::getRing()
+{
+  // The ring outlives its thread until drain has written what is left in it
+  struct Owner {
+    std::shared_ptr<Ring> ring;
+    ~Owner() {if (ring) ring->retired.store(true, std::memory_order_release);}
+  };
+  thread_local Owner owner;
+
+  if (!owner.ring)
+  {
+    owner.ring = std::make_shared<Ring>();
+    std::lock_guard<std::mutex> lock(s_rings_lock);
+    s_rings.push_back(owner.ring);
+  }
+  return *owner.ring;
+}
+
+void Log::begin(Record& record, Message message)
+{
+  record.timestamp = Clock::realtimeNs();
+  record.message = static_cast<uint16_t>(message);
+  record.length = 0;
+}
+
+void Log::encodeInteger(Record& record, int64_t value)
+{
+  if (record.length+1+sizeof(value) > sizeof(record.arguments))
+    return;
+  record.arguments[record.length++] = INT64;
+  std::memcpy(record.arguments+record.length, &value, sizeof(value));
+  record.length += sizeof(value);
+}
+
+void Log::encodeUnsigned(Record& record, uint64_t value)
+{
+  if (record.length+1+sizeof(value) > sizeof(record.arguments))
+    return;
+  record.arguments[record.length++] = UINT64;
+  std::memcpy(record.arguments+record.length, &value, sizeof(value));
+  record.length += sizeof(value);
+}
+
+void Log::encodeDouble(Record& record, double value)
+{
+  if (record.length+1+sizeof(value) > sizeof(record.arguments))
+    return;
+  record.arguments[record.length++] = DOUBLE;
+  std::memcpy(record.arguments+record.length, &value, sizeof(value));
+  record.length += sizeof(value);
+}
+
+void Log::encodeString(Record& record, std::string_view value)
+{
+  if (record.length+1+sizeof(uint16_t) > sizeof(record.arguments))
+    return;
+  const uint16_t length = static_cast<uint16_t>(std::min(value.length(), sizeof(record.arguments)-record.length-1-sizeof(uint16_t)));
+  record.arguments[record.length++] = STRING;
+  std::memcpy(record.arguments+record.length, &length, sizeof(length));
+  record.length += sizeof(length);
+  std::memcpy(record.arguments+record.length, value.data(), length);
+  record.length += length;
+}
+
+void Log::encodeErrorCode(Record& record, const std::error_code& value)
+{
+  const int code = value.value();
+  const std::error_category* category = &value.category();
+  if (record.length+1+sizeof(code)+sizeof(category) > sizeof(record.arguments))
+    return;
+  record.arguments[record.length++] = ERROR_CODE;
+  std::memcpy(record.arguments+record.length, &code, sizeof(code));
+  record.length += sizeof(code);
+  std::memcpy(record.arguments+record.length, &category, sizeof(category));
+  record.length += sizeof(category);
+}
+
+void Log::drain()
+{
+  std::lock_guard<std::mutex> drain_lock(s_drain_lock);
+  std::vector<std::shared_ptr<Ring>> rings;
+  {
+    std::lock_guard<std::mutex> lock(s_rings_lock);
+    rings = s_rings;
+  }
+
+  std::string out;
+  for (const std::shared_ptr<Ring>& ring : rings)
+  {
+    // retired is read before head, so a ring is only removed once its last message has been seen
+    const bool retired = ring->retired.load(std::memory_order_acquire);
+    const uint32_t head = ring->head.load(std::memory_order_acquire);
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    for (; tail!=head; tail++)
+    {
+      format(ring->records[tail%RING_RECORDS], out);
+    }
+    ring->tail.store(tail, std::memory_order_release);
+
+    if (retired)
+    {
+      std::lock_guard<std::mutex> lock(s_rings_lock);
+      std::erase(s_rings, ring);
+    }
+  }
+
+  for (int message=0; message<MESSAGE_COUNT; message++)
+  {
+    const uint64_t dropped = s_limits[message].dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0)
+      out.append(std::to_string(dropped)).append(" log messages dropped: ").append(FORMATS[message]).append("\n");
+  }
+
+  if (!out.empty())
+  {
+    std::fwrite(out.data(), 1, out.length(), stderr);
+    std::fflush(stderr);
+  }
+}
+
+void Log::format(const Record& record, std::string& out)
+{
+  const std::time_t seconds = record.timestamp / 1000000000LL;
+  std::tm utc;
+  ::gmtime_r(&seconds, &utc);
+  char timestamp[32];
+  const size_t timestamp_length = std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &utc);
+  out.append(timestamp, timestamp_length);
+  std::snprintf(timestamp, sizeof(timestamp), ".%03dZ ", static_cast<int>(record.timestamp/1000000 % 1000));
+  out.append(timestamp);
+
+  size_t position = 0;
+  for (const char* c=FORMATS[record.message]; *c; c++)
+  {
+    if (c[0]!='{' || c[1]!='}')
+    {
+      out.push_back(*c);
+      continue;
+    }
+    c++;
+
+    if (position >= record.length)
+      continue;
+
+    const uint8_t type = record.arguments[position++];
+    if (STRING == type)
+    {
+      uint16_t length;
+      std::memcpy(&length, record.arguments+position, sizeof(length));
+      position += sizeof(length);
+      out.append(reinterpret_cast<const char*>(record.arguments+position), length);
+      position += length;
+      continue;
+    }
+
+    if (ERROR_CODE == type)
+    {
+      int code;
+      const std::error_category* category;
+      std::memcpy(&code, record.arguments+position, sizeof(code));
+      position += sizeof(code);
+      std::memcpy(&category, record.arguments+position, sizeof(category));
+      position += sizeof(category);
+      out.append(category->message(code));
+      continue;
+    }
+
+    uint8_t value[8];
+    std::memcpy(value, record.arguments+position, sizeof(value));
+    position += sizeof(value);
+    if (INT64 == type)
+    {
+      int64_t number;
+      std::memcpy(&number, value, sizeof(number));
+      out.append(std::to_string(number));
+    }
+    else if (UINT64 == type)
+    {
+      uint64_t number;
+      std::memcpy(&number, value, sizeof(number));
+      out.append(std::to_string(number));
+    }
+    else
+    {
+      double number;
+      std::memcpy(&number, value, sizeof(number));
+      out.append(std::to_string(number));
+    }
+  }
+  out.push_back('\n');
+}
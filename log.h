@@ -0,0 +1,150 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+
+/*
+ * Asynchronous log for the session and writer threads. A thread only copies the message id and the raw arguments into its
+ * own ring, without locking or formatting. A background thread drains the rings, formats the messages and writes them to
+ * stderr. Each message type is limited to MAX_PER_SECOND, and messages over the limit or not fitting a full ring are
+ * dropped and counted, so a flood of bad input costs the threads serving it next to nothing.
+ */
+class Log
+{
+public:
+  enum Message {
+    SESSION_EXCEPTION,
+    PACKET_REJECTED,
+    CPU_PIN_FAILED,
+    INFLUXDB_GZIP_FAILED,
+    INFLUXDB_REJECTED,
+    INFLUXDB_WRITE_FAILED,
+    INFLUXDB_BACKING_OFF,
+    REPLAY_EXCEPTION,
+    IO_URING_UNAVAILABLE,
+    ACCEPT_FAILED,
+    MESSAGE_COUNT
+  };
+
+private:
+  // "{}" is replaced by the next argument
+  static constexpr const char* FORMATS[MESSAGE_COUNT] = {
+    "Exception in thread: {}",
+    "Closing connection {} (client \"{}\"): {}",
+    "Could not pin listener shard {} to CPU {}",
+    "Could not initialize gzip compression for InfluxDB server \"{}\"",
+    "InfluxDB server \"{}\" rejected {} bytes with status {}: {}",
+    "Writing {} bytes to InfluxDB server \"{}\" failed: {}",
+    "Write to InfluxDB server \"{}\" got status {} after {} ms (0 if it failed), backing off to {} byte batches and {} concurrent writes",
+    "Exception replaying frame: {}",
+    "io_uring could not be set up, serving connections with poll: {}",
+    "Accepting on listener shard {} failed: {}"
+  };
+
+  static constexpr uint32_t MAX_PER_SECOND = 20;
+  static constexpr size_t RECORD_LENGTH = 256;
+  static constexpr size_t RING_RECORDS = 16; // Per thread that has logged
+  static constexpr int DRAIN_INTERVAL_MS = 50;
+
+  enum ArgumentType : uint8_t {
+    INT64,
+    UINT64,
+    DOUBLE,
+    STRING, // uint16 length, then the characters. Truncated to what is left of the record
+    ERROR_CODE // int value, then the category pointer. Its message is looked up when formatted
+  };
+
+  struct Record {
+    int64_t timestamp;
+    uint16_t message;
+    uint16_t length; // Of arguments
+    uint8_t arguments[RECORD_LENGTH-12];
+  };
+
+  // Single producer, the owning thread. Single consumer, drain
+  struct Ring {
+    Record records[RING_RECORDS];
+    std::atomic<uint32_t> head{0}; // Next record to write
+    std::atomic<uint32_t> tail{0}; // Next record to read
+    std::atomic<bool> retired{false}; // The owning thread has exited. Removed once drained
+  };
+
+  struct Limit {
+    std::atomic<int64_t> second{0};
+    std::atomic<uint32_t> count{0};
+    std::atomic<uint64_t> dropped{0}; // Since last drain
+  };
+
+public:
+  // Starts the background thread. Messages written before are kept until the first drain, as far as the rings hold them
+  static void start();
+  // Drains all rings now, as before exiting
+  static void flush();
+
+  template<typename... Args>
+  static void write(Message message, const Args&... args)
+  {
+    if (!admit(message))
+      return;
+
+    Ring& ring = getRing();
+    const uint32_t head = ring.head.load(std::memory_order_relaxed);
+    if (head-ring.tail.load(std::memory_order_acquire) == RING_RECORDS)
+    {
+      drop(message);
+      return;
+    }
+
+    Record& record = ring.records[head%RING_RECORDS];
+    begin(record, message);
+    (encode(record, args), ...);
+    ring.head.store(head+1, std::memory_order_release);
+  }
+
+private:
+  [[nodiscard]] static bool admit(Message message);
+  static void drop(Message message);
+  [[nodiscard]] static Ring& getRing();
+
+  static void begin(Record& record, Message message);
+  static void encodeInteger(Record& record, int64_t value);
+  static void encodeUnsigned(Record& record, uint64_t value);
+  static void encodeDouble(Record& record, double value);
+  static void encodeString(Record& record, std::string_view value);
+  static void encodeErrorCode(Record& record, const std::error_code& value);
+
+  template<typename T>
+  static void encode(Record& record, const T& value)
+  {
+    if constexpr (std::is_integral_v<T> && std::is_signed_v<T>)
+      encodeInteger(record, value);
+    else if constexpr (std::is_integral_v<T>)
+      encodeUnsigned(record, value);
+    else if constexpr (std::is_floating_point_v<T>)
+      encodeDouble(record, value);
+    else if constexpr (std::is_same_v<T,std::error_code>)
+      encodeErrorCode(record, value);
+    else
+      encodeString(record, std::string_view(value));
+  }
+
+  static void drain();
+  static void format(const Record& record, std::string& out);
+
+private:
+  static Limit s_limits[MESSAGE_COUNT];
+  static std::mutex s_rings_lock; // Taken once per thread, on its first message, and by drain
+  static std::vector<std::shared_ptr<Ring>> s_rings;
+  static std::mutex s_drain_lock; // Rings have a single consumer
+};
+
+#endif // _LOG_H_
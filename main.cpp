@@ -1,23 +1,110 @@
+#include <cstring>
 #include <iostream>
+#include <thread>
 
+#include "capture.h"
+#include "clock.h"
+#include "escape.h"
+#include "field.h"
+#include "log.h"
+#include "memory_account.h"
+#include "metrics.h"
 #include "properties.h"
+#include "retained.h"
+#include "router.h"
 #include "server.h"
 #include "session.h"
+#include "subscriptions.h"
+#include "trace.h"
 
 
+std::shared_ptr<Properties> g_properties;
+std::shared_ptr<Properties> getProperties() {return g_properties;}
+
 std::shared_ptr<SessionManager> g_session_manager;
 std::shared_ptr<SessionManager> getSessionManager() {return g_session_manager;}
 
+std::shared_ptr<Router> g_router;
+std::shared_ptr<Router> getRouter() {return g_router;}
+
+std::shared_ptr<RetainedStore> g_retained_store;
+std::shared_ptr<RetainedStore> getRetainedStore() {return g_retained_store;}
+
+std::shared_ptr<Subscriptions> g_subscriptions;
+std::shared_ptr<Subscriptions> getSubscriptions() {return g_subscriptions;}
+
 
-int main(int /*argc*/, char */*argv*/[])
+int main(int argc, char *argv[])
 {
+  // MQTTtoInfluxDB [--replay <capture file> [--threads <n>] [--recorded-speed]] | [--bench-escape] | [--bench-fields] | [--bench-io]
+  std::string replay_file;
+  unsigned int replay_threads = std::thread::hardware_concurrency();
+  bool replay_recorded_speed = false;
+  for (int i=1; i<argc; i++)
+  {
+    if (0==std::strcmp(argv[i], "--replay") && i+1<argc)
+      replay_file = argv[++i];
+    else if (0==std::strcmp(argv[i], "--threads") && i+1<argc)
+      replay_threads = static_cast<unsigned int>(std::stoul(argv[++i]));
+    else if (0==std::strcmp(argv[i], "--recorded-speed"))
+      replay_recorded_speed = true;
+    else if (0==std::strcmp(argv[i], "--bench-escape"))
+    {
+      Escape::benchmark(std::cout);
+      return EXIT_SUCCESS;
+    }
+    else if (0==std::strcmp(argv[i], "--bench-fields"))
+    {
+      Field::benchmark(std::cout);
+      return EXIT_SUCCESS;
+    }
+    else if (0==std::strcmp(argv[i], "--bench-io"))
+    {
+      Clock::start();
+      Log::start();
+      Server::benchmark(std::cout);
+      Log::flush();
+      return EXIT_SUCCESS;
+    }
+    else
+    {
+      std::cerr << "Usage: " << argv[0] << " [--replay <capture file> [--threads <n>] [--recorded-speed]] | [--bench-escape] | [--bench-fields] | [--bench-io]" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  Clock::start();
+  Log::start();
   g_session_manager = std::make_shared<SessionManager>();
+  g_subscriptions = std::make_shared<Subscriptions>();
 
-  Properties properties;
+  g_properties = std::make_shared<Properties>();
+  Properties& properties = *g_properties;
   if (!properties.loadFile())
   {
     return EXIT_FAILURE;
   }
+  Tracing::start(properties.getSettings().trace_sample_rate);
+  MemoryAccount::setBudget(properties.getSettings().memory_budget);
+  g_router = std::make_shared<Router>(properties);
+  g_retained_store = std::make_shared<RetainedStore>(properties.getSettings().retained_max_bytes);
+
+  if (!replay_file.empty())
+  {
+    const bool replayed = Capture::replay(replay_file, replay_threads, replay_recorded_speed);
+    g_router.reset(); //Flushes aggregates and InfluxDB batches
+    Log::flush();
+    Metrics::dump(std::cout);
+    return replayed ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  Metrics::startReporting(std::chrono::seconds(properties.getSettings().metrics_interval));
+  if (!properties.getSettings().capture_file.empty() && !Capture::start(properties.getSettings().capture_file))
+  {
+    return EXIT_FAILURE;
+  }
+
+  g_session_manager->startSweeping();
   Server server(properties);
   server.run();
 
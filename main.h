@@ -2,7 +2,19 @@
 #define _MAIN_H_
 
 
+class Properties;
+[[nodiscard]] std::shared_ptr<Properties> getProperties();
+
 class SessionManager;
 [[nodiscard]] std::shared_ptr<SessionManager> getSessionManager();
 
+class Router;
+[[nodiscard]] std::shared_ptr<Router> getRouter();
+
+class RetainedStore;
+[[nodiscard]] std::shared_ptr<RetainedStore> getRetainedStore();
+
+class Subscriptions;
+[[nodiscard]] std::shared_ptr<Subscriptions> getSubscriptions();
+
 #endif // _MAIN_H_
@@ -0,0 +1,66 @@
+#include "memory_account.h"
+
+#include <algorithm>
+
+#include "metrics.h"
+
+
+int64_t MemoryAccount::s_budget = 0;
+std::atomic<int64_t> MemoryAccount::s_used(0);
+std::atomic<int64_t> MemoryAccount::s_accounts(0);
+std::mutex MemoryAccount::s_wait_lock;
+std::condition_variable MemoryAccount::s_below_low_watermark;
+
+
+MemoryAccount::MemoryAccount()
+: m_bytes(0)
+{
+  s_accounts.fetch_add(1, std::memory_order_relaxed);
+}
+
+MemoryAccount::~MemoryAccount()
+{
+  s_accounts.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void MemoryAccount::charge(Class memory_class, size_t bytes)
+{
+  m_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  const int64_t used = s_used.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  Metrics::add(static_cast<Metrics::Metric>(static_cast<int>(Metrics::MEMORY_PACKET_BUFFERS)+memory_class), bytes);
+  Metrics::set(Metrics::MEMORY_USED, used);
+}
+
+void MemoryAccount::release(Class memory_class, size_t bytes)
+{
+  m_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+  const int64_t used = s_used.fetch_sub(bytes, std::memory_order_relaxed) - bytes;
+  Metrics::add(static_cast<Metrics::Metric>(static_cast<int>(Metrics::MEMORY_PACKET_BUFFERS)+memory_class), -static_cast<uint64_t>(bytes));
+  Metrics::set(Metrics::MEMORY_USED, used);
+
+  const int64_t low_watermark = s_budget * LOW_WATERMARK_PERCENT / 100;
+  if (s_budget>0 && used<low_watermark && used+static_cast<int64_t>(bytes)>=low_watermark)
+  {
+    std::lock_guard<std::mutex> lock(s_wait_lock);
+    s_below_low_watermark.notify_all();
+  }
+}
+
+void MemoryAccount::waitForBudget() const
+{
+  if (s_budget==0 || s_used.load(std::memory_order_relaxed) < s_budget*HIGH_WATERMARK_PERCENT/100 || !isHeavy())
+    return;
+
+  Metrics::add(Metrics::MEMORY_PAUSES, 1);
+  std::unique_lock<std::mutex> lock(s_wait_lock);
+  while (s_used.load(std::memory_order_relaxed) >= s_budget*LOW_WATERMARK_PERCENT/100 && isHeavy())
+  {
+    s_below_low_watermark.wait_for(lock, RECHECK_INTERVAL);
+  }
+}
+
+// Holding more than an even share of what is in use
+bool MemoryAccount::isHeavy() const
+{
+  return getBytes() > s_used.load(std::memory_order_relaxed) / std::max<int64_t>(1, s_accounts.load(std::memory_order_relaxed));
+}
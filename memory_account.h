@@ -0,0 +1,67 @@
+#ifndef _MEMORY_ACCOUNT_H_
+#define _MEMORY_ACCOUNT_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Memory held on behalf of one connection, charged both to it and to the global memory_budget. Only allocations a client
+ * controls the size of are charged: packet buffers, output queued for a slow client, and lines waiting in InfluxDB batches
+ * until InfluxDB has answered.
+ * Near the budget, a session holding more than its share waits before reading its next packet. The heaviest clients are
+ * then held back by TCP flow control, while the rest keep being served, instead of the server allocating until it is killed.
+ */
+class MemoryAccount
+{
+public:
+  enum Class {
+    PACKET_BUFFER,
+    INFLUXDB_BATCH,
+    WRITE_QUEUE,
+    CLASS_COUNT
+  };
+
+private:
+  static constexpr int HIGH_WATERMARK_PERCENT = 90; // Heavy sessions are paused from here
+  static constexpr int LOW_WATERMARK_PERCENT = 80;  // ...until memory use is down to here
+  static constexpr std::chrono::milliseconds RECHECK_INTERVAL{100}; // A paused session also resumes once it is no longer heavy
+
+public:
+  MemoryAccount();
+  ~MemoryAccount();
+
+  MemoryAccount(const MemoryAccount&) = delete;
+  MemoryAccount& operator=(const MemoryAccount&) = delete;
+
+  // 0 for no budget. Set before serving
+  static void setBudget(size_t budget) {s_budget = static_cast<int64_t>(budget);}
+  [[nodiscard]] static int64_t getUsed() {return s_used.load(std::memory_order_relaxed);}
+  // Whether charging bytes more would exceed the budget
+  [[nodiscard]] static bool isOverBudget(size_t bytes) {return s_budget>0 && getUsed()+static_cast<int64_t>(bytes)>s_budget;}
+
+  void charge(Class memory_class, size_t bytes);
+  void release(Class memory_class, size_t bytes);
+  [[nodiscard]] int64_t getBytes() const {return m_bytes.load(std::memory_order_relaxed);}
+
+  // Called by the session thread before it reads the next packet
+  void waitForBudget() const;
+
+private:
+  [[nodiscard]] bool isHeavy() const;
+
+private:
+  std::atomic<int64_t> m_bytes;
+
+  static int64_t s_budget;
+  static std::atomic<int64_t> s_used;
+  static std::atomic<int64_t> s_accounts;
+  static std::mutex s_wait_lock;
+  static std::condition_variable s_below_low_watermark;
+};
+
+#endif // _MEMORY_ACCOUNT_H_
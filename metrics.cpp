@@ -0,0 +1,32 @@
+#include "metrics.h"
+
+#include <iostream>
+#include <thread>
+
+
+std::atomic<uint64_t> Metrics::s_metrics[Metrics::METRIC_COUNT];
+
+
+void Metrics::dump(std::ostream& out)
+{
+  for (int metric=0; metric<METRIC_COUNT; metric++)
+  {
+    out << NAMES[metric] << '=' << get(static_cast<Metric>(metric)) << '\n';
+  }
+  out.flush();
+}
+
+void Metrics::startReporting(std::chrono::seconds interval)
+{
+  if (interval.count() <= 0)
+    return;
+
+  std::thread([interval]()
+  {
+    while (true)
+    {
+      std::this_thread::sleep_for(interval);
+      dump(std::cout);
+    }
+  }).detach();
+}
@@ -0,0 +1,97 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <stdint.h>
+
+
+/*
+ * Process wide counters and gauges. Updates are relaxed atomic operations, so they are cheap enough for the message path.
+ */
+class Metrics
+{
+public:
+  enum Metric {
+    POINTS_WRITTEN,
+    POINTS_FILTERED,
+    POINTS_AGGREGATED,
+    MESSAGES_DELIVERED,          // PUBLISH packets sent to subscribers
+    MESSAGES_STREAMED,           // PUBLISH packets too large to buffer, only forwarded to subscribers
+    MESSAGES_DROPPED,            // PUBLISH packets not sent to a subscriber, for its full queue or its Maximum Packet Size
+    PACKETS_TOO_LARGE,           // Connections closed for exceeding max_packet_size
+    INFLUXDB_BATCHES,
+    INFLUXDB_BYTES_UNCOMPRESSED, // Line protocol bytes, before compression
+    INFLUXDB_BYTES_SENT,         // Request body bytes, after compression
+    INFLUXDB_COMPRESS_NANOSECONDS,
+    INFLUXDB_BACKOFFS,           // Batch length and concurrent writes halved, after errors or slow writes
+    SERIES_COUNT,
+    SERIES_HITS,
+    SERIES_MISSES,
+    SERIES_EVICTIONS,
+    RETAINED_COUNT,
+    RETAINED_BYTES,              // Counted against retained_max_bytes: slabs, including free items, tree and entries
+    RETAINED_REJECTED,
+    LOG_DROPPED,                 // Log messages over the rate limit, or not fitting the ring of their thread
+    MEMORY_USED,                 // Bytes charged to MemoryAccounts
+    MEMORY_PACKET_BUFFERS,       // One per MemoryAccount::Class, in that order
+    MEMORY_INFLUXDB_BATCHES,
+    MEMORY_WRITE_QUEUES,
+    MEMORY_PAUSES,               // Session reads held back for memory_budget
+    SESSIONS,                    // Connected, or disconnected and not yet expired. Updated by the session sweep
+    SESSIONS_CONNECTED,
+    PUBACKS_IN_FLIGHT,
+    KEEP_ALIVE_TIMEOUTS,
+    SESSIONS_TAKEN_OVER,
+    METRIC_COUNT
+  };
+
+private:
+  static constexpr const char* NAMES[METRIC_COUNT] = {
+    "points_written",
+    "points_filtered",
+    "points_aggregated",
+    "messages_delivered",
+    "messages_streamed",
+    "messages_dropped",
+    "packets_too_large",
+    "influxdb_batches",
+    "influxdb_bytes_uncompressed",
+    "influxdb_bytes_sent",
+    "influxdb_compress_ns",
+    "influxdb_backoffs",
+    "series_count",
+    "series_hits",
+    "series_misses",
+    "series_evictions",
+    "retained_count",
+    "retained_bytes",
+    "retained_rejected",
+    "log_dropped",
+    "memory_used",
+    "memory_packet_buffers",
+    "memory_influxdb_batches",
+    "memory_write_queues",
+    "memory_pauses",
+    "sessions",
+    "sessions_connected",
+    "pubacks_in_flight",
+    "keep_alive_timeouts",
+    "sessions_taken_over"
+  };
+
+public:
+  static void add(Metric metric, uint64_t value) {s_metrics[metric].fetch_add(value, std::memory_order_relaxed);}
+  static void set(Metric metric, uint64_t value) {s_metrics[metric].store(value, std::memory_order_relaxed);}
+  [[nodiscard]] static uint64_t get(Metric metric) {return s_metrics[metric].load(std::memory_order_relaxed);}
+
+  static void dump(std::ostream& out);
+  // Dumps all metrics to stdout every interval, from a background thread
+  static void startReporting(std::chrono::seconds interval);
+
+private:
+  static std::atomic<uint64_t> s_metrics[METRIC_COUNT];
+};
+
+#endif // _METRICS_H_
@@ -1,12 +1,20 @@
 #include "packet.h"
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 
 #include "packet_connect.h"
+#include "packet_publish.h"
+#include "packet_subscribe.h"
+#include "packet_unsubscribe.h"
 
+#include "../capture.h"
 #include "../main.h"
+#include "../metrics.h"
+#include "../properties.h"
 #include "../session.h"
+#include "../trace.h"
 
 
 /*
@@ -18,18 +26,18 @@ BasePacket::BasePacket(std::unique_ptr<Buffer> buffer)
 {
 }
 
-std::error_code BasePacket::createPacket(asio::ip::tcp::socket& socket, std::shared_ptr<BasePacket>& packet, size_t& fixed_header_length, size_t& total_length)
+std::error_code BasePacket::createPacket(Connection& connection, std::shared_ptr<BasePacket>& packet, size_t& fixed_header_length, size_t& total_length)
 {
   packet.reset();
   fixed_header_length = total_length = 0;
-  ::getSessionManager()->expireOldSessions();
 
-  std::unique_ptr<Buffer> buffer = std::make_unique<Buffer>(socket);
+  std::unique_ptr<Buffer> buffer = std::make_unique<Buffer>(connection);
   if (!buffer)
     return std::make_error_code(std::errc::not_enough_memory);
 
   std::error_code error_code;
-  if (IS_ERROR(error_code=buffer->read()))
+  // 2.1.1, Fixed Header. Read the first byte and the first Remaining Length byte, then one byte at a time while the continuation bit is set
+  if (IS_ERROR(error_code=buffer->read(2)))
     return error_code;
 
   if (buffer->getReadLength() == 0)
@@ -38,21 +46,41 @@ std::error_code BasePacket::createPacket(asio::ip::tcp::socket& socket, std::sha
     return packet->setHasError(std::make_error_code(std::errc::message_size));
   }
 
+  while ((buffer->getByte(buffer->getReadLength()-1) & 0x80) != 0 && buffer->getReadLength() < 5)
+  {
+    if (IS_ERROR(error_code=buffer->append(1)))
+      return error_code;
+  }
+
   // 2.1.2, MQTT Control Packet type
   uint8_t fixed_header_control_packet_type;
   uint32_t fixed_header_remaining_length;
   if (IS_ERROR(error_code=buffer->parseUint8(fixed_header_control_packet_type)) ||
       IS_ERROR(error_code=buffer->parseVariableByteInteger(fixed_header_remaining_length)))
   {
-    return packet->setHasError(error_code);
+    return error_code;
   }
 
   fixed_header_length = buffer->getParsePos();
   total_length = fixed_header_length + fixed_header_remaining_length;
 
-  if (IS_ERROR(error_code=buffer->append(total_length - buffer->getReadLength())))
+  // 3.2.2.3.6, Maximum Packet Size. Checked before the buffer grows, so a Remaining Length from the wire never decides an allocation
+  if (total_length > ::getProperties()->getSettings().max_packet_size)
+  {
+    Metrics::add(Metrics::PACKETS_TOO_LARGE, 1);
+    return std::make_error_code(std::errc::value_too_large);
+  }
+
+  // A PUBLISH is read up to MAX_BUFFERED_LENGTH. PublishPacket streams the rest of the payload from the connection
+  const bool is_publish = (fixed_header_control_packet_type & 0xF0) == 0x30;
+  const size_t buffered_length = is_publish ? std::min(total_length, PublishPacket::MAX_BUFFERED_LENGTH) : total_length;
+  if (buffered_length > buffer->getReadLength() &&
+      IS_ERROR(error_code=buffer->append(buffered_length - buffer->getReadLength())))
     return error_code;
 
+  if (buffered_length == total_length) // A streamed frame is never held in full, so it can't be captured
+    Capture::record(connection, buffer->getData(), total_length);
+
   uint8_t control_packet_type_flags = fixed_header_control_packet_type & 0x0F;
   switch((fixed_header_control_packet_type & 0xF0) >> 4)
   {
@@ -65,7 +93,7 @@ std::error_code BasePacket::createPacket(asio::ip::tcp::socket& socket, std::sha
     case  2: packet=std::make_shared<ConnAckPacket>(std::move(buffer));
              if (control_packet_type_flags != 0) return packet->setHasError(std::make_error_code(std::errc::illegal_byte_sequence));
              break; //0x20
-    case  3: packet=std::make_shared<PublishPacket>(std::move(buffer));
+    case  3: packet=std::make_shared<PublishPacket>(std::move(buffer), control_packet_type_flags, total_length-buffered_length, Tracing::sample());
              break; //0x3X
     case  4: packet=std::make_shared<PubAckPacket>(std::move(buffer));
              if (control_packet_type_flags != 0) return packet->setHasError(std::make_error_code(std::errc::illegal_byte_sequence));
@@ -107,3 +135,180 @@ std::error_code BasePacket::createPacket(asio::ip::tcp::socket& socket, std::sha
 
   return error_code;
 }
+
+void BasePacket::encodeUint8(std::vector<uint8_t>& out, uint8_t value)
+{
+  out.push_back(value);
+}
+
+void BasePacket::encodeUint16(std::vector<uint8_t>& out, uint16_t value)
+{
+  out.push_back(static_cast<uint8_t>(value >> 8));
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+void BasePacket::encodeUint32(std::vector<uint8_t>& out, uint32_t value)
+{
+  out.push_back(static_cast<uint8_t>(value >> 24));
+  out.push_back(static_cast<uint8_t>(value >> 16));
+  out.push_back(static_cast<uint8_t>(value >> 8));
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+void BasePacket::encodeVariableByteInteger(std::vector<uint8_t>& out, uint32_t value)
+{
+  // Algorithm from 1.5.5, Variable Byte Integer
+  do
+  {
+    uint8_t encoded_byte = value % 128;
+    value /= 128;
+    if (value > 0)
+      encoded_byte |= 0x80;
+    out.push_back(encoded_byte);
+  }
+  while (value > 0);
+}
+
+void BasePacket::encodeString(std::vector<uint8_t>& out, const std::string& value)
+{
+  encodeUint16(out, static_cast<uint16_t>(value.length()));
+  out.insert(out.end(), value.begin(), value.end());
+}
+
+void BasePacket::encodeFixedHeader(std::vector<uint8_t>& out, uint8_t control_packet_type, const std::vector<uint8_t>& variable_header)
+{
+  out.clear();
+  out.reserve(variable_header.size() + 5);
+  encodeUint8(out, control_packet_type);
+  encodeVariableByteInteger(out, static_cast<uint32_t>(variable_header.size()));
+  out.insert(out.end(), variable_header.begin(), variable_header.end());
+}
+
+
+void ConnAckPacket::encode(std::vector<uint8_t>& out, uint8_t protocol_version, bool session_present, uint8_t reason_code,
+                           uint16_t receive_maximum, uint32_t maximum_packet_size, const std::string& assigned_client_identifier)
+{
+  std::vector<uint8_t> variable_header;
+
+  // 3.2.2.1, Connect Acknowledge Flags
+  encodeUint8(variable_header, session_present ? 0x01 : 0x00);
+  // 3.2.2.2, Connect Reason Code
+  encodeUint8(variable_header, reason_code);
+
+  if (protocol_version >= 5)
+  {
+    // 3.2.2.3, CONNACK Properties
+    std::vector<uint8_t> properties;
+    encodeUint8(properties, PropertyIdentifier::RECEIVE_MAXIMUM);
+    encodeUint16(properties, receive_maximum);
+    encodeUint8(properties, PropertyIdentifier::MAXIMUM_QOS);
+    encodeUint8(properties, 1);
+    encodeUint8(properties, PropertyIdentifier::RETAIN_AVAILABLE);
+    encodeUint8(properties, 1);
+    encodeUint8(properties, PropertyIdentifier::SUBSCRIPTION_IDENTIFIER_AVAILABLE);
+    encodeUint8(properties, 0);
+    encodeUint8(properties, PropertyIdentifier::MAXIMUM_PACKET_SIZE);
+    encodeUint32(properties, maximum_packet_size);
+    if (!assigned_client_identifier.empty())
+    {
+      encodeUint8(properties, PropertyIdentifier::ASSIGNED_CLIENT_IDENTIFIER);
+      encodeString(properties, assigned_client_identifier);
+    }
+
+    encodeVariableByteInteger(variable_header, static_cast<uint32_t>(properties.size()));
+    variable_header.insert(variable_header.end(), properties.begin(), properties.end());
+  }
+
+  encodeFixedHeader(out, 0x20, variable_header);
+}
+
+
+void PubAckPacket::encode(std::vector<uint8_t>& out, uint8_t protocol_version, uint16_t packet_identifier, uint8_t reason_code)
+{
+  std::vector<uint8_t> variable_header;
+
+  // 3.4.2, PUBACK Variable Header
+  encodeUint16(variable_header, packet_identifier);
+  // 3.4.2.1, "The Reason Code and Property Length can be omitted if the Reason Code is 0x00 (Success) and there are no Properties"
+  if (protocol_version >= 5 && reason_code != 0x00)
+  {
+    encodeUint8(variable_header, reason_code);
+  }
+
+  encodeFixedHeader(out, 0x40, variable_header);
+}
+
+
+void SubAckPacket::encode(std::vector<uint8_t>& out, uint8_t protocol_version, uint16_t packet_identifier, const std::vector<uint8_t>& reason_codes)
+{
+  std::vector<uint8_t> variable_header;
+
+  // 3.9.2, SUBACK Variable Header
+  encodeUint16(variable_header, packet_identifier);
+  if (protocol_version >= 5)
+  {
+    encodeVariableByteInteger(variable_header, 0); //3.9.2.1, Property Length
+  }
+
+  // 3.9.3, SUBACK Payload
+  variable_header.insert(variable_header.end(), reason_codes.begin(), reason_codes.end());
+
+  encodeFixedHeader(out, 0x90, variable_header);
+}
+
+
+void UnsubAckPacket::encode(std::vector<uint8_t>& out, uint8_t protocol_version, uint16_t packet_identifier, const std::vector<uint8_t>& reason_codes)
+{
+  std::vector<uint8_t> variable_header;
+
+  // 3.11.2, UNSUBACK Variable Header
+  encodeUint16(variable_header, packet_identifier);
+  if (protocol_version >= 5)
+  {
+    encodeVariableByteInteger(variable_header, 0); //3.11.2.1, Property Length
+
+    // 3.11.3, UNSUBACK Payload. MQTT 3.1.1 has no payload
+    variable_header.insert(variable_header.end(), reason_codes.begin(), reason_codes.end());
+  }
+
+  encodeFixedHeader(out, 0xB0, variable_header);
+}
+
+
+std::error_code PingReqPacket::parse()
+{
+  //3.12.1, PINGREQ Fixed Header
+  //already taken care of in BasePacket::createPacket
+
+  if (!m_session) // 3.1, "After a Network Connection is established by a Client to a Server, the first packet sent from the Client to the Server MUST be a CONNECT packet"
+    RETURN_ERROR(protocol_error);
+
+  // 3.12.2, 3.12.3, "The PINGREQ packet has no Variable Header" and "no Payload"
+  if (m_buffer->getUnparsedLength() > 0)
+    RETURN_ERROR(illegal_byte_sequence);
+
+  // 3.12.4, "The Server MUST send a PINGRESP packet in response to a PINGREQ packet"
+  // The keep-alive timer was reset when the packet was read
+  std::vector<uint8_t> pingresp;
+  PingRespPacket::encode(pingresp);
+  return m_session->write(pingresp);
+}
+
+
+void PingRespPacket::encode(std::vector<uint8_t>& out)
+{
+  // 3.13, PINGRESP has no Variable Header and no Payload
+  encodeFixedHeader(out, 0xD0, {});
+}
+
+
+void DisconnectPacket::encode(std::vector<uint8_t>& out, uint8_t reason_code)
+{
+  std::vector<uint8_t> variable_header;
+
+  // 3.14.2, DISCONNECT Variable Header
+  encodeUint8(variable_header, reason_code);
+  encodeVariableByteInteger(variable_header, 0); //3.14.2.2, Property Length
+
+  encodeFixedHeader(out, 0xE0, variable_header);
+}
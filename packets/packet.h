@@ -5,9 +5,12 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #include "../buffer.h"
 
+class Session;
+
 #define RETURN_IF_ERROR(x) if(IS_ERROR(error_code=x)){return setHasError(error_code);}
 #define RETURN_ERROR(x)    return setHasError(std::make_error_code(std::errc::x));
 
@@ -49,16 +52,29 @@ protected:
   virtual ~BasePacket() = default;
 
 public:
-  [[nodiscard]] static std::error_code createPacket(asio::ip::tcp::socket& socket, std::shared_ptr<BasePacket>& packet, size_t& fixed_header_length, size_t& total_length);
+  [[nodiscard]] static std::error_code createPacket(Connection& connection, std::shared_ptr<BasePacket>& packet, size_t& fixed_header_length, size_t& total_length);
   [[nodiscard]] virtual std::error_code parse() {return setHasError(std::make_error_code(std::errc::operation_not_permitted));}
 
 public:
   std::error_code setHasError(std::error_code error_code) {m_error_code=error_code; return m_error_code;}
   [[nodiscard]] std::error_code getError() const {return m_error_code;}
 
+  void setSession(const std::shared_ptr<Session>& session) {m_session=session;}
+  [[nodiscard]] const std::shared_ptr<Session>& getSession() const {return m_session;}
+
+public:
+  static void encodeUint8(std::vector<uint8_t>& out, uint8_t value);
+  static void encodeUint16(std::vector<uint8_t>& out, uint16_t value);
+  static void encodeUint32(std::vector<uint8_t>& out, uint32_t value);
+  static void encodeVariableByteInteger(std::vector<uint8_t>& out, uint32_t value);
+  static void encodeString(std::vector<uint8_t>& out, const std::string& value);
+  // Prepends the Fixed Header to an already encoded Variable Header and Payload
+  static void encodeFixedHeader(std::vector<uint8_t>& out, uint8_t control_packet_type, const std::vector<uint8_t>& variable_header);
+
 protected:
   std::unique_ptr<Buffer> m_buffer;
   std::error_code m_error_code;
+  std::shared_ptr<Session> m_session;
 };
 
 
@@ -79,16 +95,9 @@ public:
   virtual ~ConnAckPacket() = default;
 
   [[nodiscard]] virtual std::error_code parse() {return setHasError(std::make_error_code(std::errc::function_not_supported));}
-};
-
-
-class PublishPacket : public BasePacket
-{
-public:
-  PublishPacket(std::unique_ptr<Buffer> buffer) : BasePacket(std::move(buffer)) {}
-  virtual ~PublishPacket() = default;
 
-  [[nodiscard]] virtual std::error_code parse() {return setHasError(std::make_error_code(std::errc::function_not_supported));}
+  static void encode(std::vector<uint8_t>& out, uint8_t protocol_version, bool session_present, uint8_t reason_code,
+                     uint16_t receive_maximum, uint32_t maximum_packet_size, const std::string& assigned_client_identifier);
 };
 
 
@@ -99,6 +108,8 @@ public:
   virtual ~PubAckPacket() = default;
 
   [[nodiscard]] virtual std::error_code parse() {return setHasError(std::make_error_code(std::errc::function_not_supported));}
+
+  static void encode(std::vector<uint8_t>& out, uint8_t protocol_version, uint16_t packet_identifier, uint8_t reason_code);
 };
 
 
@@ -132,16 +143,6 @@ public:
 };
 
 
-class SubscribePacket : public BasePacket
-{
-public:
-  SubscribePacket(std::unique_ptr<Buffer> buffer) : BasePacket(std::move(buffer)) {}
-  virtual ~SubscribePacket() = default;
-
-  [[nodiscard]] virtual std::error_code parse() {return setHasError(std::make_error_code(std::errc::function_not_supported));}
-};
-
-
 class SubAckPacket : public BasePacket
 {
 public:
@@ -149,16 +150,8 @@ public:
   virtual ~SubAckPacket() = default;
 
   [[nodiscard]] virtual std::error_code parse() {return setHasError(std::make_error_code(std::errc::function_not_supported));}
-};
-
-
-class UnsubscribePacket : public BasePacket
-{
-public:
-  UnsubscribePacket(std::unique_ptr<Buffer> buffer) : BasePacket(std::move(buffer)) {}
-  virtual ~UnsubscribePacket() = default;
 
-  [[nodiscard]] virtual std::error_code parse() {return setHasError(std::make_error_code(std::errc::function_not_supported));}
+  static void encode(std::vector<uint8_t>& out, uint8_t protocol_version, uint16_t packet_identifier, const std::vector<uint8_t>& reason_codes);
 };
 
 
@@ -169,6 +162,8 @@ public:
   virtual ~UnsubAckPacket() = default;
 
   [[nodiscard]] virtual std::error_code parse() {return setHasError(std::make_error_code(std::errc::function_not_supported));}
+
+  static void encode(std::vector<uint8_t>& out, uint8_t protocol_version, uint16_t packet_identifier, const std::vector<uint8_t>& reason_codes);
 };
 
 
@@ -178,7 +173,7 @@ public:
   PingReqPacket(std::unique_ptr<Buffer> buffer) : BasePacket(std::move(buffer)) {}
   virtual ~PingReqPacket() = default;
 
-  [[nodiscard]] virtual std::error_code parse() {return setHasError(std::make_error_code(std::errc::function_not_supported));}
+  [[nodiscard]] virtual std::error_code parse();
 };
 
 
@@ -189,6 +184,8 @@ public:
   virtual ~PingRespPacket() = default;
 
   [[nodiscard]] virtual std::error_code parse() {return setHasError(std::make_error_code(std::errc::function_not_supported));}
+
+  static void encode(std::vector<uint8_t>& out);
 };
 
 
@@ -199,6 +196,9 @@ public:
   virtual ~DisconnectPacket() = default;
 
   [[nodiscard]] virtual std::error_code parse() {return setHasError(std::make_error_code(std::errc::function_not_supported));}
+
+  // DISCONNECT from the Server. MQTT 5 only
+  static void encode(std::vector<uint8_t>& out, uint8_t reason_code);
 };
 
 
@@ -1,6 +1,7 @@
 #include "packet_connect.h"
 
 #include "../main.h"
+#include "../properties.h"
 #include "../session.h"
 
 
@@ -15,11 +16,22 @@ std::error_code ConnectPacket::parse()
   //3.1.1, CONNECT Fixed Header
   //already taken care of in BasePacket::createPacket
 
+  if (m_session) // 3.1.0-2, "The Server MUST process a second CONNECT packet sent from a Client as a Protocol Error and close the Network Connection"
+  {
+    if (m_session->getProtocolVersion() >= 5)
+    {
+      std::vector<uint8_t> disconnect;
+      DisconnectPacket::encode(disconnect, 0x82); //Protocol Error
+      (void)m_session->write(disconnect);
+    }
+    RETURN_ERROR(protocol_error);
+  }
+
   // 3.1.2.1, Protocol Name
-  std::string protocol_name;
+  std::string_view protocol_name;
   RETURN_IF_ERROR(m_buffer->parseString(protocol_name));
 
-  if (protocol_name.compare("MQTT")!=0)
+  if (protocol_name != "MQTT")
     RETURN_ERROR(protocol_not_supported);
 
   // 3.1.2.2, Protocol Version
@@ -57,8 +69,9 @@ std::error_code ConnectPacket::parse()
     RETURN_IF_ERROR(m_buffer->parseVariableByteInteger(property_length));
 
     uint32_t property_end = m_buffer->getParsePos() + property_length;
+    m_properties = m_buffer->getUnparsedData();
+    m_properties_length = property_length;
 
-    m_user_properties.clear();
     while (m_buffer->getParsePos() < property_end)
     {
       uint8_t property_identifier;
@@ -89,10 +102,9 @@ std::error_code ConnectPacket::parse()
           break;
         case PropertyIdentifier::USER_PROPERTY:
         {
-          std::string key, value;
+          std::string_view key, value;
           RETURN_IF_ERROR(m_buffer->parseString(key));
           RETURN_IF_ERROR(m_buffer->parseString(value));
-          m_user_properties.emplace(key, value);
           break;
         }
         case PropertyIdentifier::AUTHENTICATION_METHOD:
@@ -116,8 +128,9 @@ std::error_code ConnectPacket::parse()
     RETURN_IF_ERROR(m_buffer->parseVariableByteInteger(will_property_length));
 
     uint32_t will_property_end = m_buffer->getParsePos() + will_property_length;
+    m_will_properties = m_buffer->getUnparsedData();
+    m_will_properties_length = will_property_length;
 
-    m_will_user_properties.clear();
     while (m_buffer->getParsePos() < will_property_end)
     {
       uint8_t property_identifier;
@@ -146,10 +159,9 @@ std::error_code ConnectPacket::parse()
           break;
         case PropertyIdentifier::USER_PROPERTY:
         {
-          std::string key, value;
+          std::string_view key, value;
           RETURN_IF_ERROR(m_buffer->parseString(key));
           RETURN_IF_ERROR(m_buffer->parseString(value));
-          m_will_user_properties.emplace_back(std::pair<std::string,std::string>(key, value));
           break;
         }
 
@@ -176,7 +188,27 @@ std::error_code ConnectPacket::parse()
 
 std::error_code ConnectPacket::actions() // 3.1.4 CONNECT Actions
 {
-  //TODO
+  std::error_code error_code;
+  std::vector<uint8_t> connack;
+
+  std::string client_id(m_client_id);
+  std::shared_ptr<Session> session;
+  if (!::getSessionManager()->createSession(client_id, m_keep_alive, m_session_expiry_interval, session))
+  {
+    ConnAckPacket::encode(connack, m_protocol_version, false, m_protocol_version>=5 ? 0x97 : 0x03, 0, ::getProperties()->getSettings().max_packet_size, ""); //Quota exceeded, Server unavailable
+    (void)m_buffer->getConnection()->write(connack.data(), connack.size());
+    RETURN_ERROR(too_many_files_open);
+  }
+
+  const Properties::Settings& settings = ::getProperties()->getSettings();
+  const uint16_t receive_maximum = settings.receive_maximum;
+  session->attach(m_buffer->getConnection(), m_protocol_version, receive_maximum, m_maximum_packet_size);
+  m_buffer->getConnection()->setClientId(client_id);
+  m_session = session;
+
+  // 3.2.2.3.7, Assigned Client Identifier
+  ConnAckPacket::encode(connack, m_protocol_version, false, 0x00, receive_maximum, settings.max_packet_size, m_client_id.empty() ? client_id : "");
+  RETURN_IF_ERROR(session->write(connack));
 
   return std::error_code();
 }
@@ -3,8 +3,8 @@
 
 #include "packet.h"
 
-#include <map>
-#include <vector>
+#include <span>
+#include <string_view>
 
 
 class ConnectPacket : public BasePacket
@@ -22,10 +22,14 @@ public:
     m_keep_alive(0),
     m_session_expiry_interval(0),
     m_receive_maximum(65535),
-    m_maximum_packet_size(64*1024), //"It is the responsibility of the application to select a suitable Maximum Packet Size value if it chooses to restrict the Maximum Packet Size"
+    m_maximum_packet_size(UINT32_MAX), //3.1.2.11.4, "If the Maximum Packet Size is not present, no limit on the packet size is imposed beyond the limitations in the protocol"
     m_topic_alias_maximum(0),
     m_request_response_information(0),
     m_request_problem_information(1),
+    m_properties(nullptr),
+    m_properties_length(0),
+    m_will_properties(nullptr),
+    m_will_properties_length(0),
     m_will_delay_interval(0),
     m_payload_format_indicator(0),
     m_message_expiry_interval(0)
@@ -57,25 +61,27 @@ private:
   uint16_t m_topic_alias_maximum;
   uint8_t m_request_response_information;
   uint8_t m_request_problem_information;
-  std::multimap<std::string,std::string> m_user_properties;
-  std::string m_authentication_method;
-  std::shared_ptr<uint8_t[]> m_authentication_data;
+  const uint8_t* m_properties; // Points into m_buffer, as does every field below. User Properties are left encoded here
+  size_t m_properties_length;
+  std::string_view m_authentication_method;
+  std::span<const uint8_t> m_authentication_data;
 
-  std::string m_client_id;
+  std::string_view m_client_id;
 
+  const uint8_t* m_will_properties; // 3.1.3.2.8. "The Server MUST maintain the order of User Properties when publishing the Will Message"
+  size_t m_will_properties_length;
   uint32_t m_will_delay_interval;
   uint8_t m_payload_format_indicator;
   uint32_t m_message_expiry_interval;
-  std::string m_content_type;
-  std::string m_response_topic;
-  std::shared_ptr<uint8_t[]> m_correlation_data;
-  std::vector<std::pair<std::string,std::string>> m_will_user_properties; // 3.1.3.2.8. "The Server MUST maintain the order of User Properties when publishing the Will Message"
+  std::string_view m_content_type;
+  std::string_view m_response_topic;
+  std::span<const uint8_t> m_correlation_data;
 
-  std::string m_will_topic;
-  std::shared_ptr<uint8_t[]> m_will_payload;
+  std::string_view m_will_topic;
+  std::span<const uint8_t> m_will_payload;
 
-  std::string m_username;
-  std::shared_ptr<uint8_t[]> m_password;
+  std::string_view m_username;
+  std::span<const uint8_t> m_password;
 };
 
 #endif // _PACKET_CONNECT_H_
@@ -0,0 +1,256 @@
+#include "packet_publish.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "../main.h"
+#include "../metrics.h"
+#include "../retained.h"
+#include "../router.h"
+#include "../session.h"
+#include "../subscriptions.h"
+
+
+/*
+ * Any documentation references below, references the document https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html
+ */
+
+std::error_code PublishPacket::parse()
+{
+  std::error_code error_code;
+
+  //3.3.1, PUBLISH Fixed Header
+  //already taken care of in BasePacket::createPacket
+
+  if (!m_session) // 3.1, "After a Network Connection is established by a Client to a Server, the first packet sent from the Client to the Server MUST be a CONNECT packet"
+    RETURN_ERROR(protocol_error);
+
+  // 3.3.1.2, "A PUBLISH Packet MUST NOT have both QoS bits set to 1"
+  if (m_qos > 2)
+    RETURN_ERROR(illegal_byte_sequence);
+
+  // 3.3.2.1, Topic Name
+  RETURN_IF_ERROR(bufferHead(2));
+  if (m_buffer->getUnparsedLength() >= 2)
+    RETURN_IF_ERROR(bufferHead(2 + (m_buffer->getUnparsedData()[0]<<8 | m_buffer->getUnparsedData()[1])));
+  RETURN_IF_ERROR(m_buffer->parseString(m_topic_name));
+
+  if (m_topic_name.empty() || std::string_view::npos!=m_topic_name.find_first_of("+#"))
+    RETURN_ERROR(illegal_byte_sequence);
+  // The buffer may still grow below, so m_topic_name is pointed into it again once the head is read
+  const size_t topic_pos = reinterpret_cast<const uint8_t*>(m_topic_name.data()) - m_buffer->getData();
+
+  // 3.3.2.2, Packet Identifier
+  if (m_qos > 0)
+  {
+    RETURN_IF_ERROR(bufferHead(2));
+    RETURN_IF_ERROR(m_buffer->parseUint16(m_packet_identifier));
+  }
+
+  if (m_session->getProtocolVersion() >= 5)
+  {
+    // 3.3.2.3.1, Property Length
+    uint32_t property_length;
+    RETURN_IF_ERROR(bufferHead(4));
+    RETURN_IF_ERROR(m_buffer->parseVariableByteInteger(property_length));
+    RETURN_IF_ERROR(bufferHead(property_length));
+
+    uint32_t property_end = m_buffer->getParsePos() + property_length;
+    m_properties = m_buffer->getUnparsedData();
+    m_properties_length = property_length;
+
+    while (m_buffer->getParsePos() < property_end)
+    {
+      uint8_t property_identifier;
+      RETURN_IF_ERROR(m_buffer->parseUint8(property_identifier));
+
+      switch(property_identifier)
+      {
+        case PropertyIdentifier::PAYLOAD_FORMAT_INDICATOR:
+          RETURN_IF_ERROR(m_buffer->parseUint8(m_payload_format_indicator));
+          if (m_payload_format_indicator>1) RETURN_ERROR(illegal_byte_sequence);
+          break;
+        case PropertyIdentifier::MESSAGE_EXPIRY_INTERVAL:
+        {
+          uint32_t message_expiry_interval;
+          m_message_expiry = m_buffer->getUnparsedData();
+          RETURN_IF_ERROR(m_buffer->parseUint32(message_expiry_interval));
+          break;
+        }
+        case PropertyIdentifier::CONTENT_TYPE:
+          RETURN_IF_ERROR(m_buffer->parseString(m_content_type));
+          break;
+        // Only validated. They are forwarded with the rest of the properties, as received
+        case PropertyIdentifier::RESPONSE_TOPIC:
+        {
+          std::string_view response_topic;
+          RETURN_IF_ERROR(m_buffer->parseString(response_topic));
+          break;
+        }
+        case PropertyIdentifier::CORRELATION_DATA:
+        {
+          std::span<const uint8_t> correlation_data;
+          RETURN_IF_ERROR(m_buffer->parseBinaryData(correlation_data));
+          break;
+        }
+        case PropertyIdentifier::USER_PROPERTY:
+        {
+          std::string_view key, value;
+          RETURN_IF_ERROR(m_buffer->parseString(key));
+          RETURN_IF_ERROR(m_buffer->parseString(value));
+          break;
+        }
+        case PropertyIdentifier::TPOIC_ALIAS: //Topic Alias Maximum is not sent in CONNACK, so 0 is in effect (3.2.2.3.8)
+        case PropertyIdentifier::SUBSCRIPTION_IDENTIFIER: //Only sent from Server to Client
+
+        default: RETURN_ERROR(illegal_byte_sequence);
+      }
+    }
+  }
+
+  m_topic_name = std::string_view(reinterpret_cast<const char*>(m_buffer->getData())+topic_pos, m_topic_name.length());
+
+  // 3.3.3, PUBLISH Payload
+  m_payload = m_buffer->getUnparsedData();
+  m_payload_length = m_buffer->getUnparsedLength() + m_unread_length;
+
+  if (m_trace)
+  {
+    m_trace->setTopic(m_topic_name);
+    m_trace->stamp(Trace::PARSED);
+  }
+
+  return m_unread_length>0 ? streamedActions() : actions();
+}
+
+std::error_code PublishPacket::actions() // 3.3.4 PUBLISH Actions
+{
+  const Subscriptions::Message message{m_topic_name, m_retain_flag, m_properties, m_properties_length, m_payload, m_payload_length, m_payload_length, nullptr};
+  if (m_retain_flag)
+  {
+    ::getRetainedStore()->store(m_topic_name, m_properties, m_properties_length, m_payload, m_payload_length, m_message_expiry);
+  }
+
+  if (m_qos == 0)
+  {
+    ::getRouter()->route(m_topic_name, m_payload, m_payload_length, m_content_type, m_payload_format_indicator, nullptr, m_trace,
+                         m_buffer->getConnection()->getMemoryAccount());
+    ::getSubscriptions()->publish(message, m_session.get());
+  }
+  else if (m_qos == 1)
+  {
+    std::shared_ptr<PendingAck> ack = m_session->beginPubAck(m_packet_identifier);
+    ::getRouter()->route(m_topic_name, m_payload, m_payload_length, m_content_type, m_payload_format_indicator, ack, m_trace,
+                         m_buffer->getConnection()->getMemoryAccount());
+    ::getSubscriptions()->publish(message, m_session.get());
+    ack->release(true); //PUBACK is sent as soon as no InfluxDB batch holds this message any more
+  }
+  else
+  {
+    //Maximum QoS 1 is sent in CONNACK (3.2.2.3.4)
+    RETURN_ERROR(function_not_supported);
+  }
+
+  return std::error_code();
+}
+
+// A payload too large to buffer is no sensor value, and too large for the retained store, so it is only forwarded to subscribers.
+// It is spooled in full, charged to this connection, only if some subscriber gets it
+std::error_code PublishPacket::streamedActions()
+{
+  std::error_code error_code;
+  if (m_qos > 1)
+    RETURN_ERROR(function_not_supported);
+
+  std::shared_ptr<PendingAck> ack = m_qos==1 ? m_session->beginPubAck(m_packet_identifier) : nullptr;
+  if (m_retain_flag)
+  {
+    ::getRetainedStore()->store(m_topic_name, nullptr, 0, nullptr, 0); //The retained message it replaces must not be delivered any more
+  }
+
+  Connection* connection = m_buffer->getConnection();
+  const size_t buffered_length = m_payload_length - m_unread_length;
+  std::unique_ptr<uint8_t[]> spool;
+  const Subscriptions::Message message{m_topic_name, m_retain_flag, m_properties, m_properties_length, m_payload, m_payload_length,
+                                       buffered_length,
+                                       [this, connection, buffered_length, &spool, &error_code](const uint8_t*& payload)
+                                       {
+                                         connection->getMemoryAccount()->charge(MemoryAccount::PACKET_BUFFER, m_payload_length);
+                                         spool = std::make_unique_for_overwrite<uint8_t[]>(m_payload_length);
+                                         std::memcpy(spool.get(), m_payload, buffered_length);
+                                         error_code = connection->read(spool.get()+buffered_length, m_unread_length);
+                                         m_unread_length = 0;
+                                         payload = spool.get();
+                                         return error_code;
+                                       }};
+  ::getSubscriptions()->publish(message, m_session.get());
+  if (spool)
+  {
+    spool.reset();
+    connection->getMemoryAccount()->release(MemoryAccount::PACKET_BUFFER, m_payload_length);
+  }
+
+  // Unless a subscriber took it, the payload is still on the connection
+  uint8_t discard[4096];
+  while (m_unread_length>0 && IS_OK(error_code))
+  {
+    const size_t length = std::min(m_unread_length, sizeof(discard));
+    error_code = connection->read(discard, length);
+    m_unread_length -= length;
+  }
+
+  Metrics::add(Metrics::MESSAGES_STREAMED, 1);
+  if (ack)
+    ack->release(IS_OK(error_code));
+  return setHasError(error_code);
+}
+
+// The head of a PUBLISH can reach past MAX_BUFFERED_LENGTH, with a long Topic Name or many properties. Whatever parsing needs
+// of it is read from the unread part
+std::error_code PublishPacket::bufferHead(size_t length)
+{
+  std::error_code error_code;
+  if (m_buffer->getUnparsedLength()>=length || m_unread_length==0)
+    return error_code;
+
+  const size_t append_length = std::min(length-m_buffer->getUnparsedLength(), m_unread_length);
+  RETURN_IF_ERROR(m_buffer->append(append_length));
+  m_unread_length -= append_length;
+  return error_code;
+}
+
+void PublishPacket::encode(std::vector<uint8_t>& out, uint8_t protocol_version, std::string_view topic, bool retain,
+                           const uint8_t* properties, size_t properties_length, const uint8_t* payload, size_t payload_length)
+{
+  out.clear();
+  out.reserve(topic.length() + properties_length + payload_length + 12);
+  encodeHeader(out, protocol_version, topic, retain, properties, properties_length, payload_length);
+
+  // 3.3.3, PUBLISH Payload
+  out.insert(out.end(), payload, payload+payload_length);
+}
+
+void PublishPacket::encodeHeader(std::vector<uint8_t>& out, uint8_t protocol_version, std::string_view topic, bool retain,
+                                 const uint8_t* properties, size_t properties_length, size_t payload_length)
+{
+  std::vector<uint8_t> variable_header;
+  variable_header.reserve(topic.length() + properties_length + 8);
+
+  // 3.3.2.1, Topic Name. No Packet Identifier, as QoS is 0
+  encodeUint16(variable_header, static_cast<uint16_t>(topic.length()));
+  variable_header.insert(variable_header.end(), topic.begin(), topic.end());
+
+  if (protocol_version >= 5)
+  {
+    // 3.3.2.3, PUBLISH Properties
+    encodeVariableByteInteger(variable_header, static_cast<uint32_t>(properties_length));
+    variable_header.insert(variable_header.end(), properties, properties+properties_length);
+  }
+
+  // 2.1.1, Fixed Header. Remaining Length includes the payload
+  out.clear();
+  out.reserve(variable_header.size() + 5);
+  encodeUint8(out, retain ? 0x31 : 0x30);
+  encodeVariableByteInteger(out, static_cast<uint32_t>(variable_header.size() + payload_length));
+  out.insert(out.end(), variable_header.begin(), variable_header.end());
+}
@@ -0,0 +1,76 @@
+#ifndef _PACKET_PUBLISH_H_
+#define _PACKET_PUBLISH_H_
+
+#include "packet.h"
+#include "../trace.h"
+
+#include <span>
+#include <string_view>
+#include <vector>
+
+
+class PublishPacket : public BasePacket
+{
+public:
+  // A PUBLISH is read this far before it is parsed. A larger payload is only spooled in full if a subscriber gets it
+  static constexpr size_t MAX_BUFFERED_LENGTH = 64*1024L;
+
+public:
+  // unread_length is the part of the payload createPacket left on the connection. trace is nullptr unless sampled
+  PublishPacket(std::unique_ptr<Buffer> buffer, uint8_t flags, size_t unread_length, std::shared_ptr<Trace> trace)
+  : BasePacket(std::move(buffer)),
+    m_dup_flag((flags & 0b00001000) >> 3),
+    m_qos((flags & 0b00000110) >> 1),
+    m_retain_flag(flags & 0b00000001),
+    m_packet_identifier(0),
+    m_payload_format_indicator(0),
+    m_message_expiry(nullptr),
+    m_properties(nullptr),
+    m_properties_length(0),
+    m_payload(nullptr),
+    m_payload_length(0),
+    m_unread_length(unread_length),
+    m_trace(std::move(trace))
+  {
+  }
+
+  virtual ~PublishPacket() = default;
+
+  [[nodiscard]] virtual std::error_code parse() override;
+
+  // QoS 0 PUBLISH from the Server. properties are MQTT 5 PUBLISH Properties, already encoded
+  static void encode(std::vector<uint8_t>& out, uint8_t protocol_version, std::string_view topic, bool retain,
+                     const uint8_t* properties, size_t properties_length, const uint8_t* payload, size_t payload_length);
+  // As encode, without the payload. payload_length bytes of payload must be written after it
+  static void encodeHeader(std::vector<uint8_t>& out, uint8_t protocol_version, std::string_view topic, bool retain,
+                           const uint8_t* properties, size_t properties_length, size_t payload_length);
+
+private:
+  [[nodiscard]] std::error_code actions();
+  [[nodiscard]] std::error_code streamedActions();
+  [[nodiscard]] std::error_code bufferHead(size_t length);
+
+private:
+  bool m_dup_flag;
+  uint8_t m_qos;
+  bool m_retain_flag;
+
+  std::string_view m_topic_name; // Points into m_buffer
+  uint16_t m_packet_identifier;
+
+  uint8_t m_payload_format_indicator;
+  const uint8_t* m_message_expiry; // Points into m_buffer, at the Message Expiry Interval. nullptr if there is none
+  std::string_view m_content_type; // Points into m_buffer
+  // Points into m_buffer. Forwarded to subscribers as is, as Topic Alias and Subscription Identifier are rejected. This also keeps
+  // the order of User Properties (3.3.2.3.7)
+  const uint8_t* m_properties;
+  size_t m_properties_length;
+
+  const uint8_t* m_payload; // Points into m_buffer
+  size_t m_payload_length; // Including the unread part
+  size_t m_unread_length;
+
+  std::shared_ptr<Trace> m_trace;
+};
+
+#endif // _PACKET_PUBLISH_H_
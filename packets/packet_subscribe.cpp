@@ -0,0 +1,162 @@
+#include "packet_subscribe.h"
+
+#include "packet_publish.h"
+
+#include "../main.h"
+#include "../metrics.h"
+#include "../retained.h"
+#include "../session.h"
+#include "../subscriptions.h"
+
+
+/*
+ * Any documentation references below, references the document https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html
+ */
+
+std::error_code SubscribePacket::parse()
+{
+  std::error_code error_code;
+
+  //3.8.1, SUBSCRIBE Fixed Header
+  //already taken care of in BasePacket::createPacket
+
+  if (!m_session) // 3.1, "After a Network Connection is established by a Client to a Server, the first packet sent from the Client to the Server MUST be a CONNECT packet"
+    RETURN_ERROR(protocol_error);
+
+  // 3.8.2, SUBSCRIBE Variable Header
+  RETURN_IF_ERROR(m_buffer->parseUint16(m_packet_identifier));
+
+  if (m_session->getProtocolVersion() >= 5)
+  {
+    // 3.8.2.1.1, Property Length
+    uint32_t property_length;
+    RETURN_IF_ERROR(m_buffer->parseVariableByteInteger(property_length));
+
+    uint32_t property_end = m_buffer->getParsePos() + property_length;
+
+    m_user_properties.clear();
+    while (m_buffer->getParsePos() < property_end)
+    {
+      uint8_t property_identifier;
+      RETURN_IF_ERROR(m_buffer->parseUint8(property_identifier));
+
+      switch(property_identifier)
+      {
+        case PropertyIdentifier::USER_PROPERTY:
+        {
+          std::string key, value;
+          RETURN_IF_ERROR(m_buffer->parseString(key));
+          RETURN_IF_ERROR(m_buffer->parseString(value));
+          m_user_properties.emplace_back(std::pair<std::string,std::string>(key, value));
+          break;
+        }
+        case PropertyIdentifier::SUBSCRIPTION_IDENTIFIER: //Subscription Identifier Available is 0 in CONNACK (3.2.2.3.12)
+          RETURN_ERROR(protocol_error);
+
+        default: RETURN_ERROR(illegal_byte_sequence);
+      }
+    }
+  }
+
+  // 3.8.3, SUBSCRIBE Payload
+  m_subscriptions.clear();
+  while (m_buffer->getUnparsedLength() > 0)
+  {
+    std::string topic_filter;
+    uint8_t subscription_options;
+    RETURN_IF_ERROR(m_buffer->parseString(topic_filter));
+    RETURN_IF_ERROR(m_buffer->parseUint8(subscription_options));
+
+    // 3.8.3.1, "The Server MUST treat a SUBSCRIBE packet as malformed if any of Reserved bits in the Payload are non-zero". MQTT 3.1.1 only has the QoS bits
+    if ((subscription_options & 0xC0)!=0 || (subscription_options & Subscriptions::MAXIMUM_QOS_MASK)==3 ||
+        (m_session->getProtocolVersion()<5 && (subscription_options & ~Subscriptions::MAXIMUM_QOS_MASK)!=0))
+      RETURN_ERROR(illegal_byte_sequence);
+
+    m_subscriptions.emplace_back(std::pair<std::string,uint8_t>(topic_filter, subscription_options));
+  }
+
+  // 3.8.3, "The Payload MUST contain at least one Topic Filter and Subscription Options pair"
+  if (m_subscriptions.empty())
+    RETURN_ERROR(protocol_error);
+
+  return actions();
+}
+
+std::error_code SubscribePacket::actions() // 3.8.4 SUBSCRIBE Actions
+{
+  const uint8_t protocol_version = m_session->getProtocolVersion();
+  std::vector<uint8_t> reason_codes;
+  std::vector<std::string> retained_filters;
+  for (const auto& subscription : m_subscriptions)
+  {
+    // 3.8.3.1, "It is a Protocol Error to set the No Local bit to 1 on a Shared Subscription"
+    if (!Subscriptions::isValidFilter(subscription.first) ||
+        (Subscriptions::isShared(subscription.first) && (subscription.second & Subscriptions::NO_LOCAL)))
+    {
+      reason_codes.push_back(protocol_version>=5 ? 0x8F : 0x80); //Topic Filter invalid
+      continue;
+    }
+
+    // Messages are forwarded at QoS 0 only, so that one encoded PUBLISH can be shared by every subscriber
+    const bool added = ::getSubscriptions()->subscribe(m_session, subscription.first, subscription.second);
+    reason_codes.push_back(0x00); //Granted QoS 0
+
+    // 3.3.1.3, Retain Handling. 4.8.2, "Retained messages are not sent to the Session when it establishes a new Shared Subscription"
+    const uint8_t retain_handling = (subscription.second & Subscriptions::RETAIN_HANDLING_MASK) >> 4;
+    if (!Subscriptions::isShared(subscription.first) && (retain_handling==0 || (retain_handling==1 && added)))
+      retained_filters.push_back(subscription.first);
+  }
+
+  std::error_code error_code;
+  std::vector<uint8_t> suback;
+  SubAckPacket::encode(suback, protocol_version, m_packet_identifier, reason_codes);
+  RETURN_IF_ERROR(m_session->write(suback));
+
+  // Matching retained messages are written with the RETAIN flag set (3.3.1.3). Only their topics are collected at once. The
+  // messages are encoded and written a chunk at a time, so neither the store's lock nor the memory is held for all of them
+  std::vector<std::string> topics;
+  size_t topics_length = 0;
+  for (const std::string& filter : retained_filters)
+  {
+    ::getRetainedStore()->match(filter, [&](std::string_view topic, const uint8_t*, size_t, const uint8_t*, size_t)
+    {
+      topics.emplace_back(topic);
+      topics_length += topic.length();
+    });
+  }
+
+  const std::shared_ptr<MemoryAccount>& memory_account = m_buffer->getConnection()->getMemoryAccount();
+  memory_account->charge(MemoryAccount::PACKET_BUFFER, topics_length);
+  std::vector<uint8_t> retained;
+  std::vector<uint8_t> publish;
+  size_t next = 0;
+  while (IS_OK(error_code) && next<topics.size())
+  {
+    retained.clear();
+    ::getRetainedStore()->get(topics, next, RETAINED_CHUNK_LENGTH, [&](std::string_view topic, const uint8_t* properties, size_t properties_length,
+                                                                      const uint8_t* payload, size_t payload_length)
+    {
+      PublishPacket::encode(publish, protocol_version, topic, true, properties, properties_length, payload, payload_length);
+      // 3.1.2.11.4, a packet too large for the client is discarded, as on live delivery
+      if (publish.size() > m_session->getMaximumPacketSize())
+      {
+        Metrics::add(Metrics::MESSAGES_DROPPED, 1);
+        return;
+      }
+      retained.insert(retained.end(), publish.begin(), publish.end());
+    });
+
+    if (!retained.empty())
+    {
+      const size_t charged = retained.capacity();
+      memory_account->charge(MemoryAccount::PACKET_BUFFER, charged);
+      error_code = m_session->write(retained);
+      memory_account->release(MemoryAccount::PACKET_BUFFER, charged);
+    }
+  }
+  memory_account->release(MemoryAccount::PACKET_BUFFER, topics_length);
+  if (IS_ERROR(error_code))
+    return setHasError(error_code);
+
+  return error_code;
+}
@@ -0,0 +1,34 @@
+#ifndef _PACKET_SUBSCRIBE_H_
+#define _PACKET_SUBSCRIBE_H_
+
+#include "packet.h"
+
+#include <vector>
+
+
+class SubscribePacket : public BasePacket
+{
+private:
+  static constexpr size_t RETAINED_CHUNK_LENGTH = 64*1024L; // Retained messages encoded and written at a time
+
+public:
+  SubscribePacket(std::unique_ptr<Buffer> buffer)
+  : BasePacket(std::move(buffer)),
+    m_packet_identifier(0)
+  {
+  }
+
+  virtual ~SubscribePacket() = default;
+
+  [[nodiscard]] virtual std::error_code parse() override;
+
+private:
+  [[nodiscard]] std::error_code actions();
+
+private:
+  uint16_t m_packet_identifier;
+  std::vector<std::pair<std::string,std::string>> m_user_properties;
+  std::vector<std::pair<std::string,uint8_t>> m_subscriptions; // Topic Filter and Subscription Options
+};
+
+#endif // _PACKET_SUBSCRIBE_H_
@@ -0,0 +1,82 @@
+#include "packet_unsubscribe.h"
+
+#include "../main.h"
+#include "../session.h"
+#include "../subscriptions.h"
+
+
+/*
+ * Any documentation references below, references the document https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html
+ */
+
+std::error_code UnsubscribePacket::parse()
+{
+  std::error_code error_code;
+
+  //3.10.1, UNSUBSCRIBE Fixed Header
+  //already taken care of in BasePacket::createPacket
+
+  if (!m_session) // 3.1, "After a Network Connection is established by a Client to a Server, the first packet sent from the Client to the Server MUST be a CONNECT packet"
+    RETURN_ERROR(protocol_error);
+
+  // 3.10.2, UNSUBSCRIBE Variable Header
+  RETURN_IF_ERROR(m_buffer->parseUint16(m_packet_identifier));
+
+  if (m_session->getProtocolVersion() >= 5)
+  {
+    // 3.10.2.1.1, Property Length
+    uint32_t property_length;
+    RETURN_IF_ERROR(m_buffer->parseVariableByteInteger(property_length));
+
+    uint32_t property_end = m_buffer->getParsePos() + property_length;
+
+    m_user_properties.clear();
+    while (m_buffer->getParsePos() < property_end)
+    {
+      uint8_t property_identifier;
+      RETURN_IF_ERROR(m_buffer->parseUint8(property_identifier));
+
+      switch(property_identifier)
+      {
+        case PropertyIdentifier::USER_PROPERTY:
+        {
+          std::string key, value;
+          RETURN_IF_ERROR(m_buffer->parseString(key));
+          RETURN_IF_ERROR(m_buffer->parseString(value));
+          m_user_properties.emplace_back(std::pair<std::string,std::string>(key, value));
+          break;
+        }
+
+        default: RETURN_ERROR(illegal_byte_sequence);
+      }
+    }
+  }
+
+  // 3.10.3, UNSUBSCRIBE Payload
+  m_topic_filters.clear();
+  while (m_buffer->getUnparsedLength() > 0)
+  {
+    std::string topic_filter;
+    RETURN_IF_ERROR(m_buffer->parseString(topic_filter));
+    m_topic_filters.push_back(topic_filter);
+  }
+
+  // 3.10.3, "The Payload of an UNSUBSCRIBE packet MUST contain at least one Topic Filter"
+  if (m_topic_filters.empty())
+    RETURN_ERROR(protocol_error);
+
+  return actions();
+}
+
+std::error_code UnsubscribePacket::actions() // 3.10.4 UNSUBSCRIBE Actions
+{
+  std::vector<uint8_t> reason_codes;
+  for (const std::string& topic_filter : m_topic_filters)
+  {
+    reason_codes.push_back(::getSubscriptions()->unsubscribe(m_session.get(), topic_filter) ? 0x00 : 0x11); //Success or No subscription existed
+  }
+
+  std::vector<uint8_t> unsuback;
+  UnsubAckPacket::encode(unsuback, m_session->getProtocolVersion(), m_packet_identifier, reason_codes);
+  return m_session->write(unsuback);
+}
@@ -0,0 +1,31 @@
+#ifndef _PACKET_UNSUBSCRIBE_H_
+#define _PACKET_UNSUBSCRIBE_H_
+
+#include "packet.h"
+
+#include <vector>
+
+
+class UnsubscribePacket : public BasePacket
+{
+public:
+  UnsubscribePacket(std::unique_ptr<Buffer> buffer)
+  : BasePacket(std::move(buffer)),
+    m_packet_identifier(0)
+  {
+  }
+
+  virtual ~UnsubscribePacket() = default;
+
+  [[nodiscard]] virtual std::error_code parse() override;
+
+private:
+  [[nodiscard]] std::error_code actions();
+
+private:
+  uint16_t m_packet_identifier;
+  std::vector<std::pair<std::string,std::string>> m_user_properties;
+  std::vector<std::string> m_topic_filters;
+};
+
+#endif // _PACKET_UNSUBSCRIBE_H_
@@ -1,154 +1,454 @@
 #include "properties.h"
 
-#include <fstream>
+#include <algorithm>
+#include <charconv>
+#include <fcntl.h>
 #include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace
+{
+  // Read-only mapping of a whole file. An empty file is open, with no data
+  class MappedFile
+  {
+  public:
+    MappedFile(const char* filename)
+    : m_open(false)
+    {
+      const int fd = ::open(filename, O_RDONLY);
+      if (fd < 0)
+        return;
+
+      struct stat status;
+      if (0 == ::fstat(fd, &status))
+      {
+        m_open = true;
+        if (status.st_size > 0)
+        {
+          void* data = ::mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+          if (MAP_FAILED == data)
+          {
+            m_open = false;
+          }
+          else
+          {
+            ::madvise(data, status.st_size, MADV_SEQUENTIAL);
+            m_data = std::string_view(static_cast<const char*>(data), status.st_size);
+          }
+        }
+      }
+      ::close(fd);
+    }
+
+    ~MappedFile()
+    {
+      if (!m_data.empty())
+        ::munmap(const_cast<char*>(m_data.data()), m_data.length());
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    [[nodiscard]] bool isOpen() const {return m_open;}
+    [[nodiscard]] std::string_view getData() const {return m_data;}
+
+  private:
+    bool m_open;
+    std::string_view m_data;
+  };
+
+  template<typename T>
+  [[nodiscard]] bool parseNumber(std::string_view text, T& number)
+  {
+    const std::from_chars_result result = std::from_chars(text.data(), text.data()+text.length(), number);
+    return result.ec==std::errc() && result.ptr==text.data()+text.length();
+  }
+
+  // Splits "key=value". Returns false if there is no '='
+  [[nodiscard]] bool splitKeyValue(std::string_view line, std::string_view& key, std::string_view& value)
+  {
+    const size_t equals = line.find('=');
+    if (std::string_view::npos == equals)
+      return false;
+
+    key = line.substr(0, equals);
+    value = line.substr(equals+1);
+    return true;
+  }
+}
 
 
 Properties::Properties()
 {
 }
 
+// One pass over the mapped file. Lines and values are views into the mapping, only copied when stored in m_settings
 bool Properties::loadFile()
 {
-  std::ifstream input_file(Properties::FILENAME.data());
-  std::string line;
-  if (!input_file.is_open())
+  const MappedFile file(Properties::FILENAME.data());
+  if (!file.isOpen())
   {
     std::cerr << "Could not open the file " << Properties::FILENAME << "'" << std::endl;
     return false;
   }
 
   Type current_type = SETTINGS;
-  std::string current_server;
-  while (std::getline(input_file, line))
+  Server* current_server = nullptr;
+  Topic* current_topic = nullptr;
+
+  std::string_view text = file.getData();
+  while (!text.empty())
   {
-    if (line.length()>2 && '['==line.at(0) && ']'==line.at(line.length()-1))
+    const size_t newline = text.find('\n');
+    std::string_view line = text.substr(0, newline);
+    text.remove_prefix(std::string_view::npos==newline ? text.length() : newline+1);
+    if (!line.empty() && '\r'==line.back())
+      line.remove_suffix(1);
+
+    if (line.length()>2 && '['==line.front() && ']'==line.back())
     {
-      const std::string id = line.substr(1, line.length()-2);
-      if (0 == id.compare("settings"))
+      const std::string_view id = line.substr(1, line.length()-2);
+      auto server_iter = m_settings.servers.find(id);
+      if (id == "settings")
       {
         current_type = SETTINGS;
       }
-      else if (0 != m_settings.servers.count(id))
+      else if (m_settings.servers.end() != server_iter)
       {
         current_type = SERVER;
-        current_server = id;
+        current_server = server_iter->second.get();
       }
       else
       {
         current_type = RULE;
-        m_settings.topics.push_back(Topic());
-        m_settings.topics.back().match = id;
+        current_topic = &m_settings.topics.emplace_back();
+        current_topic->match = id;
       }
+      continue;
     }
-    else
+
+    std::string_view key, value;
+    if (SETTINGS == current_type)
     {
-      if (SETTINGS == current_type)
+      if (line.empty())
+        continue;
+
+      if (!splitKeyValue(line, key, value))
       {
-        if (0 == line.compare(0, 8, "version="))
+        std::cerr << "Unexpected settings line \"" << line << "\"" << std::endl;
+      }
+      else if (key == "version")
+      {
+        int version = 0;
+        if (!parseNumber(value, version) || 1 != version)
         {
-          if (1 != std::stoi(line.substr(8)))
+          std::cerr << "Unexpected settings version \"" << line << "\"" << std::endl;
+        }
+      }
+      else if (key == "mqtt_port")
+      {
+        if (!parseNumber(value, m_settings.mqtt_port))
+          return invalidLine(line);
+      }
+      else if (key == "mqtt_port_tls")
+      {
+        if (!parseNumber(value, m_settings.mqtt_port_tls))
+          return invalidLine(line);
+      }
+      else if (key == "listener_shards")
+      {
+        if (!parseNumber(value, m_settings.listener_shards))
+          return invalidLine(line);
+        m_settings.listener_shards = std::max(1, m_settings.listener_shards);
+      }
+      else if (key == "cpu_affinity")
+      {
+        size_t start=0, end;
+        do //Parse ','-separated CPUs and CPU ranges, as in "0,2,4-7"
+        {
+          end = value.find(',', start);
+          const std::string_view cpus = value.substr(start, end-start);
+          const size_t dash = cpus.find('-');
+          int first, last;
+          if (!parseNumber(cpus.substr(0, dash), first) ||
+              !parseNumber(std::string_view::npos==dash ? cpus : cpus.substr(dash+1), last))
+            return invalidLine(line);
+
+          for (int cpu=first; cpu<=last; cpu++)
           {
-            std::cerr << "Unexpected settings version \"" << line << "\"" << std::endl;
+            m_settings.cpu_affinity.push_back(cpu);
           }
+
+          start = end+1;
+        } while (end != std::string_view::npos);
+      }
+      else if (key == "receive_maximum")
+      {
+        int receive_maximum = 0;
+        if (!parseNumber(value, receive_maximum) || receive_maximum<1 || receive_maximum>65535)
+        {
+          std::cerr << "Illegal receive_maximum \"" << line << "\"" << std::endl;
+          return false;
         }
-        else if (0 == line.compare(0, 10, "mqtt_port="))
+        m_settings.receive_maximum = static_cast<uint16_t>(receive_maximum);
+      }
+      else if (key == "max_packet_size")
+      {
+        long max_packet_size = 0;
+        if (!parseNumber(value, max_packet_size) || max_packet_size<128 || max_packet_size>268435460L) // 2.1.4, Remaining Length is at most 268,435,455
         {
-          m_settings.mqtt_port = std::stoi(line.substr(10));
+          std::cerr << "Illegal max_packet_size \"" << line << "\"" << std::endl;
+          return false;
         }
-        else if (0 == line.compare(0, 14, "mqtt_port_tls="))
+        m_settings.max_packet_size = static_cast<uint32_t>(max_packet_size);
+      }
+      else if (key == "max_queued_length")
+      {
+        if (!parseNumber(value, m_settings.max_queued_length))
+          return invalidLine(line);
+      }
+      else if (key == "queue_overflow")
+      {
+        if (value!="drop" && value!="disconnect")
         {
-          m_settings.mqtt_port_tls = std::stoi(line.substr(14));
+          std::cerr << "Illegal queue_overflow \"" << line << "\", expected drop or disconnect" << std::endl;
+          return false;
         }
-        else if (0 == line.compare(0, 8, "servers="))
+        m_settings.queue_overflow_disconnects = value == "disconnect";
+      }
+      else if (key == "tls_certificate")
+      {
+        m_settings.tls_certificate = value;
+      }
+      else if (key == "tls_private_key")
+      {
+        m_settings.tls_private_key = value;
+      }
+      else if (key == "tls_handshake_threads")
+      {
+        if (!parseNumber(value, m_settings.tls_handshake_threads))
+          return invalidLine(line);
+        m_settings.tls_handshake_threads = std::max(1, m_settings.tls_handshake_threads);
+      }
+      else if (key == "tls_session_cache_size")
+      {
+        if (!parseNumber(value, m_settings.tls_session_cache_size))
+          return invalidLine(line);
+      }
+      else if (key == "metrics_interval")
+      {
+        if (!parseNumber(value, m_settings.metrics_interval))
+          return invalidLine(line);
+      }
+      else if (key == "trace_sample_rate")
+      {
+        if (!parseNumber(value, m_settings.trace_sample_rate))
+          return invalidLine(line);
+      }
+      else if (key == "series_cache_size")
+      {
+        if (!parseNumber(value, m_settings.series_cache_size))
+          return invalidLine(line);
+      }
+      else if (key == "retained_max_bytes")
+      {
+        if (!parseNumber(value, m_settings.retained_max_bytes))
+          return invalidLine(line);
+      }
+      else if (key == "memory_budget")
+      {
+        if (!parseNumber(value, m_settings.memory_budget))
+          return invalidLine(line);
+      }
+      else if (key == "capture_file")
+      {
+        m_settings.capture_file = value;
+      }
+      else if (key == "servers")
+      {
+        size_t start=0, end;
+        do //Parse ':'-separated string
         {
-          const std::string server_list = line.substr(8);
-          size_t start=0, end;
-          do //Parse ':'-separated string
+          end = value.find(':', start);
+          const std::string server(value.substr(start, end-start));
+
+          if (0 != m_settings.servers.count(server))
           {
-            end = server_list.find_first_of(':', start);
-            const std::string server = server_list.substr(start, end);
+              std::cerr << "Server \"" << server << "\" appears multiple times" << std::endl;
+          }
 
-            if (0 != m_settings.servers.count(server))
-            {
-                std::cerr << "Server \"" << server << "\" appears multiple times" << std::endl;
-            }
+          m_settings.servers.emplace(server, std::make_shared<Server>());
+          m_settings.servers[server]->name = server;
 
-            m_settings.servers.emplace(server, std::make_shared<Server>());
+          start = end+1;
+        } while (end != std::string_view::npos);
+      }
+      else
+      {
+        std::cerr << "Unexpected settings line \"" << line << "\"" << std::endl;
+      }
+    }
+    else if (SERVER == current_type)
+    {
+      if (line.empty())
+        continue;
 
-            start = end+1;
-          } while (end != std::string::npos);
+      if (!splitKeyValue(line, key, value))
+      {
+        std::cerr << "Unexpected server settings line \"" << line << "\"" << std::endl;
+      }
+      else if (key == "influxdb_host")
+      {
+        current_server->influxdb_host = value;
+      }
+      else if (key == "influxdb_port")
+      {
+        if (!parseNumber(value, current_server->influxdb_port))
+          return invalidLine(line);
+      }
+      else if (key == "influxdb_database")
+      {
+        current_server->influxdb_database = value;
+      }
+      else if (key == "influxdb_username")
+      {
+        current_server->influxdb_username = value;
+      }
+      else if (key == "influxdb_password")
+      {
+        current_server->influxdb_password = value;
+      }
+      else if (key == "influxdb_tls")
+      {
+        current_server->influxdb_tls = value != "disabled";
+      }
+      else if (key == "influxdb_tls_ca")
+      {
+        current_server->influxdb_tls_ca = value;
+      }
+      else if (key == "influxdb_connections")
+      {
+        if (!parseNumber(value, current_server->influxdb_connections))
+          return invalidLine(line);
+        current_server->influxdb_connections = std::max(1, current_server->influxdb_connections);
+      }
+      else if (key == "influxdb_target_latency_ms")
+      {
+        if (!parseNumber(value, current_server->influxdb_target_latency_ms) || current_server->influxdb_target_latency_ms<=0)
+          return invalidLine(line);
+      }
+      else if (key == "influxdb_compression")
+      {
+        if (value == "gzip")
+        {
+          current_server->influxdb_gzip = true;
         }
-        else if (line.length() > 0)
+        else if (value == "none")
         {
-          std::cerr << "Unexpected settings line \"" << line << "\"" << std::endl;
+          current_server->influxdb_gzip = false;
+        }
+        else
+        {
+          std::cerr << "Unexpected influxdb_compression \"" << line << "\"" << std::endl;
         }
       }
-      else if (SERVER == current_type)
+      else if (key == "puback")
       {
-        auto iter = m_settings.servers.find(current_server);
-        if (m_settings.servers.end() != iter)
+        if (value == "stored")
         {
-          if (0 == line.compare(0, 14, "influxdb_host="))
-          {
-            iter->second->influxdb_host = line.substr(14);
-          }
-          else if (0 == line.compare(0, 14, "influxdb_port="))
-          {
-            iter->second->influxdb_port = std::stoi(line.substr(14));
-          }
-          else if (0 == line.compare(0, 18, "influxdb_database="))
-          {
-            iter->second->influxdb_database = line.substr(18);
-          }
-          else if (0 == line.compare(0, 18, "influxdb_username="))
-          {
-            iter->second->influxdb_username = line.substr(18);
-          }
-          else if (0 == line.compare(0, 18, "influxdb_password="))
-          {
-            iter->second->influxdb_password = line.substr(18);
-          }
-          else if (0 == line.compare(0, 13, "influxdb_tls="))
-          {
-            iter->second->influxdb_tls = (0 != std::string("disabled").compare(line.substr(13)));
-          }
-          else if (line.length() > 0)
-          {
-            std::cerr << "Unexpected server settings line \"" << line << "\"" << std::endl;
-          }
+          current_server->puback_when_stored = true;
+        }
+        else if (value == "received")
+        {
+          current_server->puback_when_stored = false;
         }
+        else
+        {
+          std::cerr << "Unexpected puback mode \"" << line << "\"" << std::endl;
+        }
+      }
+      else
+      {
+        std::cerr << "Unexpected server settings line \"" << line << "\"" << std::endl;
       }
-      else if (RULE == current_type)
+    }
+    else if (RULE == current_type)
+    {
+      if (line.empty())
+        continue;
+
+      const size_t arrow = line.find(" => ");
+      if (std::string_view::npos!=arrow && 0<arrow)
       {
-        auto topic = m_settings.topics.back();
-        auto index = line.find(" => ");
-        if (std::string::npos!=index && 0<index)
+        const std::string_view rest = line.substr(arrow+4);
+        const size_t colon = rest.find(':');
+        if (std::string_view::npos!=colon && 0<colon)
         {
-          std::string source = line.substr(0, index);
-          std::string rest = line.substr(index+4);
-          auto server_index = rest.find(":");
-          if (std::string::npos!=server_index && 0<server_index)
+          auto server_iter = m_settings.servers.find(rest.substr(0, colon));
+          if (m_settings.servers.end() == server_iter)
           {
-            std::string server = rest.substr(0, server_index);
-            auto server_iter = m_settings.servers.find(server);
-            if (m_settings.servers.end() == server_iter)
-            {
-              std::cerr << "Rule \"" << topic.match << "\" references unknown server \"" << server << "\"" << std::endl;
-              return false;
-            }
-
-            std::string destination = rest.substr(server_index+1);
-            m_settings.topics.back().rules.push_back(Rule());
-            m_settings.topics.back().rules.back().source = source;
-            m_settings.topics.back().rules.back().server = server_iter->second;
-            m_settings.topics.back().rules.back().destination = destination;
+            std::cerr << "Rule \"" << current_topic->match << "\" references unknown server \"" << rest.substr(0, colon) << "\"" << std::endl;
+            return false;
           }
+
+          Rule& rule = current_topic->rules.emplace_back();
+          rule.source = line.substr(0, arrow);
+          rule.server = server_iter->second;
+          rule.destination = rest.substr(colon+1);
         }
       }
+      else if (current_topic->rules.empty() || !splitKeyValue(line, key, value) || !parseRuleOption(key, value, current_topic->rules.back()))
+      {
+        std::cerr << "Unexpected rule line \"" << line << "\"" << std::endl;
+      }
     }
   }
 
-  input_file.close();
+  return true;
+}
+
+bool Properties::invalidLine(std::string_view line)
+{
+  std::cerr << "Illegal value \"" << line << "\"" << std::endl;
+  return false;
+}
+
+bool Properties::parseRuleOption(std::string_view key, std::string_view value, Rule& rule)
+{
+  if (key == "type")
+  {
+    rule.type = value;
+  }
+  else if (key == "deadband")
+  {
+    return parseNumber(value, rule.deadband);
+  }
+  else if (key == "min_interval_ms")
+  {
+    return parseNumber(value, rule.min_interval_ms);
+  }
+  else if (key == "heartbeat_ms")
+  {
+    return parseNumber(value, rule.heartbeat_ms);
+  }
+  else if (key == "aggregate")
+  {
+    rule.aggregate = value;
+  }
+  else if (key == "precision")
+  {
+    rule.precision = value;
+  }
+  else if (key == "decoder")
+  {
+    rule.decoder = value;
+  }
+  else
+  {
+    return false;
+  }
   return true;
 }
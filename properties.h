@@ -3,6 +3,7 @@
 
 #include <map>
 #include <memory>
+#include <stdint.h>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -10,19 +11,33 @@
 
 class Properties
 {
+public:
   struct Server {
+    std::string name;
     std::string influxdb_host;
     int influxdb_port = 8086;
     std::string influxdb_database;
     std::string influxdb_username;
     std::string influxdb_password;
-    bool influxdb_tls;
+    bool influxdb_tls = false;
+    std::string influxdb_tls_ca; // CA file for verifying the InfluxDB certificate. Default verify paths if empty
+    int influxdb_connections = 2; // Concurrent keep-alive connections, and so the most concurrent writes
+    int64_t influxdb_target_latency_ms = 250; // Batches and concurrent writes grow while writes are answered within this
+    bool influxdb_gzip = false;
+    bool puback_when_stored = false; // QoS 1 PUBACK is deferred until InfluxDB has accepted every batch holding the message
   };
 
   struct Rule {
     std::string source;
     std::shared_ptr<Server> server;
     std::string destination;
+    std::string type; // float, integer, boolean or string. Empty to detect it from the first value
+    double deadband = -1.0;
+    int64_t min_interval_ms = 0;
+    int64_t heartbeat_ms = 0;
+    std::string aggregate; // "10s:mean,max"
+    std::string precision; // s, ms, us or ns. Empty for ns
+    std::string decoder; // plain, json, cbor or msgpack. Empty to follow the content type, or detect it
   };
 
   struct Topic {
@@ -33,10 +48,27 @@ class Properties
   struct Settings {
     int mqtt_port = 1883;
     int mqtt_port_tls = 8883;
-    std::map<std::string,std::shared_ptr<Server>> servers;
+    int listener_shards = 1; // SO_REUSEPORT acceptors per port, each on its own thread
+    std::vector<int> cpu_affinity; // CPUs the acceptor threads are pinned to, round robin. Sessions inherit the CPU of their acceptor
+    uint16_t receive_maximum = 1024;
+    uint32_t max_packet_size = 16*1024*1024L; // Sent to MQTT 5 clients in CONNACK. Larger packets close the connection
+    size_t max_queued_length = 1024*1024L; // Bytes waiting to be sent to one client. More PUBACKs disconnect it
+    bool queue_overflow_disconnects = false; // A subscriber with no room for a message is disconnected, instead of missing it
+    std::string tls_certificate;
+    std::string tls_private_key;
+    int tls_handshake_threads = 2;
+    long tls_session_cache_size = 100000L;
+    int metrics_interval = 0; // Seconds between dumping metrics to stdout. 0 to disable
+    uint32_t trace_sample_rate = 0; // Trace 1 in this many PUBLISH packets through the pipeline. 0 to disable
+    size_t series_cache_size = 100000L;
+    size_t retained_max_bytes = 64*1024*1024L;
+    size_t memory_budget = 1024*1024*1024L; // Packet buffers, write queues and InfluxDB batches. 0 for no limit
+    std::string capture_file; // Inbound frames are appended to this file, for --replay. Empty to disable
+    std::map<std::string,std::shared_ptr<Server>,std::less<>> servers;
     std::vector<Topic> topics;
   };
 
+private:
   enum Type {
     SETTINGS,
     SERVER,
@@ -54,6 +86,10 @@ public:
 public:
   [[nodiscard]] bool loadFile();
 
+private:
+  [[nodiscard]] static bool invalidLine(std::string_view line);
+  [[nodiscard]] static bool parseRuleOption(std::string_view key, std::string_view value, Rule& rule);
+
 private:
   Settings m_settings;
 };
@@ -0,0 +1,370 @@
+#include "retained.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <mutex>
+
+#include "clock.h"
+#include "metrics.h"
+
+
+/*
+ * Any documentation references below, references the document https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html
+ */
+
+namespace
+{
+  uint8_t getSizeClass(size_t length, size_t min_item_length)
+  {
+    return static_cast<uint8_t>(std::bit_width((std::max<size_t>(length, 1)-1) / min_item_length));
+  }
+
+  uint32_t readUint32(const uint8_t* data)
+  {
+    return static_cast<uint32_t>(data[0])<<24 | static_cast<uint32_t>(data[1])<<16 | static_cast<uint32_t>(data[2])<<8 | data[3];
+  }
+
+  void writeUint32(uint8_t* data, uint32_t value)
+  {
+    data[0] = static_cast<uint8_t>(value >> 24);
+    data[1] = static_cast<uint8_t>(value >> 16);
+    data[2] = static_cast<uint8_t>(value >> 8);
+    data[3] = static_cast<uint8_t>(value);
+  }
+}
+
+
+RetainedStore::RetainedStore(size_t max_bytes)
+: m_max_bytes(max_bytes),
+  m_slab_bytes(0),
+  m_tree_bytes(0)
+{
+}
+
+bool RetainedStore::store(std::string_view topic, const uint8_t* properties, size_t properties_length, const uint8_t* payload, size_t payload_length,
+                          const uint8_t* message_expiry)
+{
+  std::unique_lock<std::shared_mutex> lock(m_lock);
+
+  const size_t length = properties_length + payload_length;
+  // A new topic adds at most a leaf, a node split off above it, and an entry
+  const size_t new_topic_bytes = 2*getNodeBytes() + topic.length() + (m_free_entries.empty() ? sizeof(Entry)+sizeof(uint32_t) : 0);
+  const bool fits = find(topic)!=NONE || getUsedBytes()+new_topic_bytes<=m_max_bytes;
+  uint32_t* slot = payload_length==0 || length>SLAB_LENGTH || !fits ? nullptr : insert(m_root, topic);
+  bool stored = slot != nullptr;
+  if (slot)
+  {
+    if (*slot == NONE)
+    {
+      if (m_free_entries.empty())
+      {
+        *slot = static_cast<uint32_t>(m_entries.size());
+        m_entries.push_back(Entry{0, 0, 0, 0});
+      }
+      else
+      {
+        *slot = m_free_entries.back();
+        m_free_entries.pop_back();
+        m_entries[*slot] = Entry{0, 0, 0, 0};
+      }
+    }
+    else if (getSizeClass(length, MIN_ITEM_LENGTH) != m_entries[*slot].size_class)
+    {
+      release(m_entries[*slot]);
+      m_entries[*slot].properties_length = m_entries[*slot].payload_length = 0;
+    }
+
+    Entry& entry = m_entries[*slot];
+    if (entry.properties_length+entry.payload_length==0 && !allocate(length, entry.size_class, entry.item))
+    {
+      stored = false;
+    }
+    else
+    {
+      uint8_t* item = getItem(entry.size_class, entry.item);
+      if (properties_length > 0)
+        std::memcpy(item, properties, properties_length);
+      std::memcpy(item+properties_length, payload, payload_length);
+      entry.properties_length = static_cast<uint32_t>(properties_length);
+      entry.payload_length = static_cast<uint32_t>(payload_length);
+      entry.expiry_offset = message_expiry ? static_cast<uint32_t>(message_expiry-properties) : 0;
+      entry.expires_ms = message_expiry ? Clock::monotonicMs() + 1000L*readUint32(message_expiry) : 0;
+    }
+  }
+
+  // 3.3.1.3, "a PUBLISH packet with a RETAIN flag set to 1 and a payload containing zero bytes ... any existing retained message with the same topic name MUST be removed"
+  // A message that cannot be stored removes the one it replaces as well, so a subscriber never gets an outdated retained message
+  if (!stored)
+  {
+    uint32_t entry = NONE;
+    remove(m_root, topic, entry);
+    if (entry != NONE)
+    {
+      if (m_entries[entry].properties_length+m_entries[entry].payload_length > 0)
+        release(m_entries[entry]);
+      m_entries[entry] = Entry{0, 0, 0, 0}; //Lengths of 0 mark an entry without an item
+      m_free_entries.push_back(entry);
+    }
+  }
+
+  Metrics::set(Metrics::RETAINED_COUNT, m_entries.size()-m_free_entries.size());
+  Metrics::set(Metrics::RETAINED_BYTES, getUsedBytes());
+  if (!stored && payload_length>0)
+    Metrics::add(Metrics::RETAINED_REJECTED, 1);
+
+  return stored || payload_length==0;
+}
+
+void RetainedStore::match(std::string_view filter, const Visitor& visitor) const
+{
+  std::shared_lock<std::shared_mutex> lock(m_lock);
+  std::string topic;
+  match(m_root, 0, filter, false, topic, visitor);
+}
+
+void RetainedStore::get(const std::vector<std::string>& topics, size_t& next, size_t max_bytes, const Visitor& visitor) const
+{
+  std::shared_lock<std::shared_mutex> lock(m_lock);
+  size_t bytes = 0;
+  while (next<topics.size() && bytes<max_bytes)
+  {
+    const std::string& topic = topics[next++];
+    const uint32_t entry = find(topic);
+    if (entry!=NONE && visit(topic, entry, visitor))
+      bytes += m_entries[entry].properties_length + m_entries[entry].payload_length;
+  }
+}
+
+uint8_t* RetainedStore::getItem(uint8_t size_class, uint32_t item) const
+{
+  const size_t item_length = getItemLength(size_class);
+  const size_t items_per_slab = SLAB_LENGTH / item_length;
+  return m_size_classes[size_class].slabs[item/items_per_slab].get() + (item%items_per_slab)*item_length;
+}
+
+bool RetainedStore::allocate(size_t length, uint8_t& size_class, uint32_t& item)
+{
+  size_class = getSizeClass(length, MIN_ITEM_LENGTH);
+  SizeClass& slabs = m_size_classes[size_class];
+  if (!slabs.free_items.empty())
+  {
+    item = slabs.free_items.back();
+    slabs.free_items.pop_back();
+    return true;
+  }
+
+  if (slabs.item_count == slabs.slabs.size() * (SLAB_LENGTH/getItemLength(size_class)))
+  {
+    if (getUsedBytes()+SLAB_LENGTH > m_max_bytes)
+      return false;
+
+    slabs.slabs.push_back(std::make_unique_for_overwrite<uint8_t[]>(SLAB_LENGTH));
+    m_slab_bytes += SLAB_LENGTH;
+  }
+
+  item = slabs.item_count++;
+  return true;
+}
+
+void RetainedStore::release(const Entry& entry)
+{
+  m_size_classes[entry.size_class].free_items.push_back(entry.item);
+}
+
+// Returns the entry of the node for topic, or NONE
+uint32_t RetainedStore::find(std::string_view topic) const
+{
+  const Node* node = &m_root;
+  while (!topic.empty())
+  {
+    auto child = std::lower_bound(node->children.begin(), node->children.end(), topic[0],
+                                  [](const std::unique_ptr<Node>& n, char c) {return n->label[0] < c;});
+    if (child==node->children.end() || 0!=topic.compare(0, (*child)->label.length(), (*child)->label))
+      return NONE;
+    topic.remove_prefix((*child)->label.length());
+    node = child->get();
+  }
+  return node->entry;
+}
+
+// Returns the entry slot of the node for topic, adding and splitting nodes as needed
+uint32_t* RetainedStore::insert(Node& node, std::string_view topic)
+{
+  if (topic.empty())
+    return &node.entry;
+
+  auto child = std::lower_bound(node.children.begin(), node.children.end(), topic[0],
+                                [](const std::unique_ptr<Node>& n, char c) {return n->label[0] < c;});
+  if (child==node.children.end() || (*child)->label[0]!=topic[0])
+  {
+    std::unique_ptr<Node> leaf = std::make_unique<Node>();
+    leaf->label = topic;
+    m_tree_bytes += getNodeBytes() + topic.length();
+    uint32_t* entry = &leaf->entry;
+    node.children.insert(child, std::move(leaf));
+    return entry;
+  }
+
+  const std::string& label = (*child)->label;
+  const size_t common = std::mismatch(label.begin(), label.end(), topic.begin(), topic.end()).first - label.begin();
+  if (common < label.length())
+  {
+    std::unique_ptr<Node> split = std::make_unique<Node>();
+    split->label = label.substr(0, common);
+    (*child)->label.erase(0, common);
+    split->children.push_back(std::move(*child));
+    *child = std::move(split);
+    m_tree_bytes += getNodeBytes(); //The labels only moved
+  }
+
+  return insert(**child, topic.substr(common));
+}
+
+// Clears the entry slot of the node for topic, and removes or merges nodes left without an entry
+void RetainedStore::remove(Node& node, std::string_view topic, uint32_t& entry)
+{
+  if (topic.empty())
+  {
+    entry = node.entry;
+    node.entry = NONE;
+    return;
+  }
+
+  auto child = std::find_if(node.children.begin(), node.children.end(), [topic](const std::unique_ptr<Node>& n) {return n->label[0] == topic[0];});
+  if (child==node.children.end() || 0!=topic.compare(0, (*child)->label.length(), (*child)->label))
+    return;
+
+  remove(**child, topic.substr((*child)->label.length()), entry);
+  if ((*child)->entry != NONE)
+    return;
+
+  if ((*child)->children.empty())
+  {
+    m_tree_bytes -= getNodeBytes() + (*child)->label.length();
+    node.children.erase(child);
+  }
+  else if ((*child)->children.size() == 1)
+  {
+    std::unique_ptr<Node> grandchild = std::move((*child)->children.front());
+    grandchild->label.insert(0, (*child)->label);
+    *child = std::move(grandchild);
+    m_tree_bytes -= getNodeBytes();
+  }
+}
+
+// Matches filter one character at a time from the position offset into the label of node. topic holds the characters matched so far
+void RetainedStore::match(const Node& node, size_t offset, std::string_view filter, bool in_single_level, std::string& topic, const Visitor& visitor) const
+{
+  const bool at_entry = offset==node.label.length() && node.entry!=NONE;
+  if (in_single_level)
+  {
+    // The level matched by '+' ends here, or takes one more character
+    if (filter.empty())
+    {
+      if (at_entry)
+        visit(topic, node.entry, visitor);
+    }
+    else
+    {
+      match(node, offset, filter, false, topic, visitor);
+    }
+
+    forEachNext(node, offset, [&](char c, const Node& next, size_t next_offset)
+    {
+      // 4.7.2, "The Server MUST NOT match Topic Filters starting with a wildcard character (# or +) with Topic Names beginning with a $ character"
+      if (c=='/' || (topic.empty() && c=='$'))
+        return;
+      topic.push_back(c);
+      match(next, next_offset, filter, true, topic, visitor);
+      topic.pop_back();
+    });
+    return;
+  }
+
+  if (filter.empty())
+  {
+    if (at_entry)
+      visit(topic, node.entry, visitor);
+    return;
+  }
+
+  if (filter[0] == '#')
+  {
+    visitAll(node, offset, topic, visitor);
+    return;
+  }
+
+  if (filter[0] == '+')
+  {
+    match(node, offset, filter.substr(1), true, topic, visitor);
+    return;
+  }
+
+  // 4.7.1.2, "sport/#" also matches "sport"
+  if (filter=="/#" && at_entry)
+    visit(topic, node.entry, visitor);
+
+  forEachNext(node, offset, [&](char c, const Node& next, size_t next_offset)
+  {
+    if (c != filter[0])
+      return;
+    topic.push_back(c);
+    match(next, next_offset, filter.substr(1), false, topic, visitor);
+    topic.pop_back();
+  });
+}
+
+void RetainedStore::visitAll(const Node& node, size_t offset, std::string& topic, const Visitor& visitor) const
+{
+  if (topic.empty() && offset<node.label.length() && node.label[offset]=='$')
+    return;
+
+  const size_t topic_length = topic.length();
+  topic.append(node.label, offset);
+  if (node.entry != NONE)
+    visit(topic, node.entry, visitor);
+
+  for (const std::unique_ptr<Node>& child : node.children)
+  {
+    visitAll(*child, 0, topic, visitor);
+  }
+  topic.resize(topic_length);
+}
+
+bool RetainedStore::visit(const std::string& topic, uint32_t entry, const Visitor& visitor) const
+{
+  const Entry& e = m_entries[entry];
+  const uint8_t* item = getItem(e.size_class, e.item);
+  if (e.expires_ms == 0)
+  {
+    visitor(topic, item, e.properties_length, item+e.properties_length, e.payload_length);
+    return true;
+  }
+
+  const int64_t remaining_ms = e.expires_ms - Clock::monotonicMs();
+  if (remaining_ms <= 0)
+    return false;
+
+  // 3.3.2.3.3, "The PUBLISH packet sent to a Client by the Server MUST contain a Message Expiry Interval set to the received value minus the time that the message has been waiting in the Server"
+  // Rounded up, so a message about to expire is not sent with an interval of 0
+  std::vector<uint8_t> properties(item, item+e.properties_length);
+  writeUint32(properties.data()+e.expiry_offset, static_cast<uint32_t>((remaining_ms+999)/1000));
+  visitor(topic, properties.data(), e.properties_length, item+e.properties_length, e.payload_length);
+  return true;
+}
+
+template<typename F>
+void RetainedStore::forEachNext(const Node& node, size_t offset, F f)
+{
+  if (offset < node.label.length())
+  {
+    f(node.label[offset], node, offset+1);
+    return;
+  }
+
+  for (const std::unique_ptr<Node>& child : node.children)
+  {
+    f(child->label[0], *child, 1);
+  }
+}
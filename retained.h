@@ -0,0 +1,101 @@
+#ifndef _RETAINED_H_
+#define _RETAINED_H_
+
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+/*
+ * Retained messages (3.3.1.3). Topics are kept in a radix tree, so topics sharing a prefix share nodes, and a Topic Filter
+ * is matched against every retained topic in one walk of the tree.
+ * Properties and payload are kept together in a slab arena with power of two size classes. The slabs, the tree and the
+ * entries all count against retained_max_bytes. A topic or slab that would take them over it is not stored, so memory use
+ * is bounded however many topics are retained.
+ */
+class RetainedStore
+{
+public:
+  // topic, MQTT 5 PUBLISH Properties and payload of one retained message. Only valid during the call
+  using Visitor = std::function<void(std::string_view topic, const uint8_t* properties, size_t properties_length,
+                                     const uint8_t* payload, size_t payload_length)>;
+
+private:
+  static constexpr uint32_t NONE = UINT32_MAX;
+  static constexpr size_t SLAB_LENGTH = 256*1024L;
+  static constexpr size_t MIN_ITEM_LENGTH = 32;
+  static constexpr size_t SIZE_CLASS_COUNT = 14; // 32 bytes to SLAB_LENGTH
+  static constexpr size_t NODE_OVERHEAD = 16; // Heap bookkeeping per allocation, an estimate
+
+  struct Node {
+    std::string label; // Edge from the parent
+    std::vector<std::unique_ptr<Node>> children; // Sorted by the first character of the label
+    uint32_t entry = NONE;
+  };
+
+  struct Entry {
+    uint32_t item; // Index into the slabs of size_class
+    uint32_t properties_length;
+    uint32_t payload_length;
+    uint8_t size_class;
+    uint32_t expiry_offset = 0; // Of the Message Expiry Interval value in the properties
+    int64_t expires_ms = 0;     // Clock::monotonicMs. 0 if the message does not expire
+  };
+
+  struct SizeClass {
+    std::vector<std::unique_ptr<uint8_t[]>> slabs;
+    std::vector<uint32_t> free_items;
+    uint32_t item_count = 0; // Items handed out from the last slab, or free
+  };
+
+public:
+  RetainedStore(size_t max_bytes);
+
+  // An empty payload deletes the retained message for topic. Returns false if the arena is full or the message is too large.
+  // message_expiry points into properties, at the value of the Message Expiry Interval (3.3.2.3.3), or is nullptr
+  bool store(std::string_view topic, const uint8_t* properties, size_t properties_length, const uint8_t* payload, size_t payload_length,
+             const uint8_t* message_expiry = nullptr);
+
+  // Calls visitor for every retained message matching filter, holding a read lock. Expired messages are left out, and the
+  // Message Expiry Interval of the others is what is left of it
+  void match(std::string_view filter, const Visitor& visitor) const;
+  // Calls visitor for the retained messages of topics, from next on, until they took max_bytes (or one message took more).
+  // next is advanced past the topics done. A topic that has no retained message any more is skipped
+  void get(const std::vector<std::string>& topics, size_t& next, size_t max_bytes, const Visitor& visitor) const;
+
+private:
+  [[nodiscard]] static size_t getItemLength(uint8_t size_class) {return MIN_ITEM_LENGTH << size_class;}
+  // Bytes a node takes, besides its label, and its slot in the parent's children
+  [[nodiscard]] static constexpr size_t getNodeBytes() {return sizeof(Node) + NODE_OVERHEAD + sizeof(std::unique_ptr<Node>);}
+  [[nodiscard]] size_t getUsedBytes() const {return m_slab_bytes + m_tree_bytes + m_entries.size()*(sizeof(Entry)+sizeof(uint32_t));}
+  [[nodiscard]] uint8_t* getItem(uint8_t size_class, uint32_t item) const;
+  [[nodiscard]] bool allocate(size_t length, uint8_t& size_class, uint32_t& item);
+  void release(const Entry& entry);
+
+  [[nodiscard]] uint32_t find(std::string_view topic) const;
+  [[nodiscard]] uint32_t* insert(Node& node, std::string_view topic);
+  void remove(Node& node, std::string_view topic, uint32_t& entry);
+
+  void match(const Node& node, size_t offset, std::string_view filter, bool in_single_level, std::string& topic, const Visitor& visitor) const;
+  void visitAll(const Node& node, size_t offset, std::string& topic, const Visitor& visitor) const;
+  // Returns false, without calling visitor, if the message has expired
+  bool visit(const std::string& topic, uint32_t entry, const Visitor& visitor) const;
+  template<typename F> static void forEachNext(const Node& node, size_t offset, F f);
+
+private:
+  size_t m_max_bytes;
+
+  mutable std::shared_mutex m_lock;
+  Node m_root;
+  std::vector<Entry> m_entries;
+  std::vector<uint32_t> m_free_entries;
+  SizeClass m_size_classes[SIZE_CLASS_COUNT];
+  size_t m_slab_bytes;
+  size_t m_tree_bytes; // Nodes and their labels, by getNodeBytes()
+};
+
+#endif // _RETAINED_H_
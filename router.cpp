@@ -0,0 +1,351 @@
+#include "router.h"
+
+#include <charconv>
+#include <iostream>
+
+#include "decoder.h"
+#include "escape.h"
+#include "influxdb.h"
+#include "metrics.h"
+#include "session.h"
+#include "trace.h"
+
+
+namespace
+{
+  constexpr std::string_view SOURCE_ROOT{"msg.payload"};
+
+  // Rules that only differ in server. Aggregated rules are not shared, as each server has its own aggregation window
+  bool encodesSameLine(const Properties::Rule& a, const Properties::Rule& b)
+  {
+    return a.aggregate.empty() && b.aggregate.empty() && a.source==b.source && a.destination==b.destination && a.type==b.type &&
+           a.deadband==b.deadband && a.min_interval_ms==b.min_interval_ms && a.heartbeat_ms==b.heartbeat_ms && a.precision==b.precision &&
+           a.decoder==b.decoder;
+  }
+}
+
+
+Router::Router(const Properties& properties)
+: m_series(properties.getSettings().series_cache_size)
+{
+  uint32_t rule_id = 0;
+  for (const auto& server : properties.getSettings().servers)
+  {
+    m_writers.emplace(server.first, std::make_shared<InfluxDBWriter>(server.second));
+  }
+
+  for (const auto& topic : properties.getSettings().topics)
+  {
+    m_topics.push_back(CompiledTopic());
+    CompiledTopic& compiled_topic = m_topics.back();
+    compilePattern(topic.match, compiled_topic.match);
+
+    std::vector<const Properties::Rule*> compiled_sources;
+    for (const auto& rule : topic.rules)
+    {
+      if (0 != rule.source.compare(0, SOURCE_ROOT.length(), SOURCE_ROOT) ||
+          (rule.source.length()>SOURCE_ROOT.length() && '.'!=rule.source.at(SOURCE_ROOT.length())))
+      {
+        std::cerr << "Rule \"" << topic.match << "\" has unexpected source \"" << rule.source << "\"" << std::endl;
+        continue;
+      }
+
+      CompiledRule compiled_rule;
+      compiled_rule.id = rule_id++;
+      size_t start = SOURCE_ROOT.length()+1;
+      while (start < rule.source.length()) //Parse '.'-separated path
+      {
+        size_t end = rule.source.find('.', start);
+        if (std::string::npos == end)
+          end = rule.source.length();
+        compiled_rule.source_path.push_back(rule.source.substr(start, end-start));
+        start = end+1;
+      }
+
+      compilePattern(rule.destination, compiled_rule.destination);
+      if (compiled_rule.destination.capture_count > compiled_topic.match.capture_count)
+      {
+        std::cerr << "Rule \"" << topic.match << "\" destination \"" << rule.destination << "\" references unknown captures" << std::endl;
+        continue;
+      }
+
+      if (!rule.type.empty() && Field::UNKNOWN==(compiled_rule.type=Field::parseType(rule.type)))
+      {
+        std::cerr << "Rule \"" << topic.match << "\" has unexpected type \"" << rule.type << "\"" << std::endl;
+      }
+
+      compiled_rule.filter.deadband = rule.deadband;
+      compiled_rule.filter.min_interval_ms = rule.min_interval_ms;
+      compiled_rule.filter.heartbeat_ms = rule.heartbeat_ms;
+      if (compiled_rule.filter.isEnabled() && !m_filter)
+      {
+        m_filter = std::make_unique<SeriesFilter>(m_series.getMaxSeries());
+      }
+
+      if (!rule.aggregate.empty())
+      {
+        if (!Aggregator::parseOptions(rule.aggregate, compiled_rule.aggregate))
+        {
+          std::cerr << "Rule \"" << topic.match << "\" has unexpected aggregate \"" << rule.aggregate << "\"" << std::endl;
+        }
+        else if (!m_aggregator)
+        {
+          m_aggregator = std::make_unique<Aggregator>(m_series.getMaxSeries());
+        }
+      }
+
+      if (!rule.precision.empty() && !Clock::parsePrecision(rule.precision, compiled_rule.precision))
+      {
+        std::cerr << "Rule \"" << topic.match << "\" has unexpected precision \"" << rule.precision << "\"" << std::endl;
+      }
+
+      if (!rule.decoder.empty() && !PayloadDecoder::parseFormat(rule.decoder, compiled_rule.decoder))
+      {
+        std::cerr << "Rule \"" << topic.match << "\" has unexpected decoder \"" << rule.decoder << "\"" << std::endl;
+      }
+
+      compiled_rule.writer = m_writers[rule.server->name];
+      for (size_t i=0; i<compiled_sources.size(); i++)
+      {
+        if (compiled_topic.rules[i].same_line_as==NOT_SHARED && encodesSameLine(*compiled_sources[i], rule))
+        {
+          compiled_rule.same_line_as = i;
+          compiled_topic.rules[i].shared = true;
+          break;
+        }
+      }
+      compiled_topic.rules.push_back(std::move(compiled_rule));
+      compiled_sources.push_back(&rule);
+    }
+  }
+
+  m_formats = std::make_unique<std::atomic<PayloadDecoder::Format>[]>(m_topics.size());
+  for (size_t i=0; i<m_topics.size(); i++)
+  {
+    m_formats[i].store(PayloadDecoder::AUTO, std::memory_order_relaxed);
+  }
+}
+
+void Router::route(std::string_view topic, const uint8_t* payload, size_t payload_length, std::string_view content_type,
+                   uint8_t payload_format_indicator, const std::shared_ptr<PendingAck>& ack, const std::shared_ptr<Trace>& trace,
+                   const std::shared_ptr<MemoryAccount>& account)
+{
+  const std::string_view payload_view(reinterpret_cast<const char*>(payload), payload_length);
+  const int64_t timestamp = Clock::realtimeNs();
+  const int64_t timestamp_ms = timestamp/1000000L;
+  // Rendered on first use in each precision
+  char timestamp_text[Clock::PRECISION_COUNT][24];
+  size_t timestamp_length[Clock::PRECISION_COUNT] = {};
+
+  // Reused by every message from this session thread, so the message path doesn't allocate once the buffers have grown
+  thread_local std::vector<std::string_view> captures;
+  thread_local std::string series_key;
+  thread_local std::string measurement;
+  thread_local std::string prefix;
+  thread_local std::string line;
+  thread_local std::string value_text; // Values rendered from binary payloads
+  thread_local std::vector<std::shared_ptr<const std::string>> segments; // Per rule of the matched topic, for rules sharing the line
+  for (size_t topic_index=0; topic_index<m_topics.size(); topic_index++)
+  {
+    const CompiledTopic& compiled_topic = m_topics[topic_index];
+    if (!matchPattern(compiled_topic.match, topic, captures))
+      continue;
+
+    if (trace)
+      trace->stamp(Trace::MATCHED);
+
+    // Devices that send a content type get their decoder from it. For the rest, the payload is only looked at for the first
+    // message of the topic section, or when the format last seen finds no value
+    std::atomic<PayloadDecoder::Format>& topic_format = m_formats[topic_index];
+    PayloadDecoder::Format format = PayloadDecoder::fromContentType(content_type);
+    bool format_cached = false;
+    if (format == PayloadDecoder::AUTO)
+    {
+      format = topic_format.load(std::memory_order_relaxed);
+      format_cached = format != PayloadDecoder::AUTO;
+      if (!format_cached)
+      {
+        format = PayloadDecoder::detect(payload_view, payload_format_indicator);
+        topic_format.store(format, std::memory_order_relaxed);
+      }
+    }
+
+    segments.assign(compiled_topic.rules.size(), nullptr);
+    for (size_t rule_index=0; rule_index<compiled_topic.rules.size(); rule_index++)
+    {
+      const CompiledRule& rule = compiled_topic.rules[rule_index];
+      if (rule.same_line_as != NOT_SHARED)
+      {
+        const std::shared_ptr<const std::string>& segment = segments[rule.same_line_as];
+        if (segment)
+        {
+          Metrics::add(Metrics::POINTS_WRITTEN, 1);
+          rule.writer->write(segment, ack, rule.precision, trace, account);
+        }
+        continue;
+      }
+
+      std::string_view value;
+      bool quoted;
+      const PayloadDecoder::Format rule_format = rule.decoder!=PayloadDecoder::AUTO ? rule.decoder : format;
+      bool found = PayloadDecoder::get(rule_format).extract(payload_view, rule.source_path, value, quoted, value_text);
+      if (!found && format_cached && rule.decoder==PayloadDecoder::AUTO)
+      {
+        // Another kind of device publishing to the same topic section
+        format_cached = false;
+        const PayloadDecoder::Format detected = PayloadDecoder::detect(payload_view, payload_format_indicator);
+        if (detected != format)
+        {
+          format = detected;
+          topic_format.store(format, std::memory_order_relaxed);
+          found = PayloadDecoder::get(format).extract(payload_view, rule.source_path, value, quoted, value_text);
+        }
+      }
+      if (!found || value.empty() || value.front()=='{' || value.front()=='[' || value=="null")
+        continue;
+
+      // <measurement> value=<field value> <timestamp>
+      line.clear();
+      SeriesTable::Series series;
+      SeriesTable::makeKey(rule.id, captures, series_key);
+      if (!m_series.appendPrefix(series_key, line, series))
+      {
+        expandPattern(rule.destination, captures, measurement);
+        prefix.clear();
+        if (!Escape::append(prefix, measurement, Escape::MEASUREMENT))
+          continue;
+        prefix += ' ';
+        prefix += FIELD_KEY;
+        const Field::Type type = rule.type!=Field::UNKNOWN ? rule.type : Field::detect(value);
+        m_series.insert(series_key, prefix, type, line, series);
+        if (m_filter)
+          m_filter->reset(series.id);
+        if (m_aggregator)
+          m_aggregator->reset(series.id);
+      }
+
+      if (rule.filter.isEnabled() && !m_filter->accept(series.id, rule.filter, value, timestamp_ms))
+      {
+        Metrics::add(Metrics::POINTS_FILTERED, 1);
+        continue;
+      }
+
+      // Aggregated values are held in memory until the window is emitted, so they don't hold back the PUBACK
+      if (rule.aggregate.isEnabled())
+      {
+        double number;
+        const std::from_chars_result result = std::from_chars(value.data(), value.data()+value.length(), number);
+        if (result.ec==std::errc() && result.ptr==value.data()+value.length())
+        {
+          m_aggregator->add(series.id, rule.aggregate, std::string_view(line).substr(0, line.length()-FIELD_KEY.length()), rule.writer,
+                            number, timestamp_ms);
+          Metrics::add(Metrics::POINTS_AGGREGATED, 1);
+        }
+        continue;
+      }
+
+      if (!Field::append(line, value, series.type, quoted))
+        continue;
+      if (timestamp_length[rule.precision] == 0)
+      {
+        char* text = timestamp_text[rule.precision];
+        timestamp_length[rule.precision] = std::to_chars(text, text+sizeof(timestamp_text[0]), Clock::toPrecision(timestamp, rule.precision)).ptr-text;
+      }
+      line += ' ';
+      line.append(timestamp_text[rule.precision], timestamp_length[rule.precision]);
+      line += '\n';
+
+      Metrics::add(Metrics::POINTS_WRITTEN, 1);
+      if (!rule.shared)
+      {
+        rule.writer->write(line, ack, rule.precision, trace, account);
+        continue;
+      }
+
+      // Encoded once, and referenced by the batch of every server it is written to
+      segments[rule_index] = std::make_shared<const std::string>(line);
+      rule.writer->write(segments[rule_index], ack, rule.precision, trace, account);
+    }
+    segments.clear();
+  }
+}
+
+void Router::compilePattern(const std::string& pattern, Pattern& compiled)
+{
+  compiled.parts.clear();
+  compiled.capture_count = 0;
+
+  size_t pos = 0;
+  while (pos < pattern.length())
+  {
+    const size_t open = pattern.find('{', pos);
+    const size_t close = std::string::npos==open ? std::string::npos : pattern.find('}', open);
+    size_t capture = 0;
+    if (std::string::npos != close)
+    {
+      for (size_t i=open+1; i<close && capture!=std::string::npos; i++)
+        capture = isdigit(static_cast<unsigned char>(pattern[i])) ? capture*10 + (pattern[i]-'0') : std::string::npos;
+    }
+
+    if (std::string::npos==close || std::string::npos==capture || 0==capture)
+    {
+      compiled.parts.push_back(Pattern::Part{pattern.substr(pos), 0});
+      break;
+    }
+
+    if (open > pos)
+      compiled.parts.push_back(Pattern::Part{pattern.substr(pos, open-pos), 0});
+    compiled.parts.push_back(Pattern::Part{"", capture});
+    compiled.capture_count = std::max(compiled.capture_count, capture);
+    pos = close+1;
+  }
+}
+
+bool Router::matchPattern(const Pattern& pattern, std::string_view topic, std::vector<std::string_view>& captures)
+{
+  captures.assign(pattern.capture_count+1, std::string_view());
+
+  size_t pos = 0;
+  for (size_t i=0; i<pattern.parts.size(); i++)
+  {
+    const Pattern::Part& part = pattern.parts[i];
+    if (part.capture == 0)
+    {
+      if (0 != topic.compare(pos, part.literal.length(), part.literal))
+        return false;
+      pos += part.literal.length();
+      continue;
+    }
+
+    // A capture never spans topic levels, and ends where the following literal starts
+    size_t end = topic.find('/', pos);
+    if (std::string_view::npos == end)
+      end = topic.length();
+    if (i+1<pattern.parts.size() && !pattern.parts[i+1].literal.empty() && '/'!=pattern.parts[i+1].literal[0])
+    {
+      const size_t literal_pos = topic.substr(0, end).find(pattern.parts[i+1].literal[0], pos);
+      if (std::string_view::npos != literal_pos)
+        end = literal_pos;
+    }
+
+    if (end == pos)
+      return false;
+
+    captures[part.capture] = topic.substr(pos, end-pos);
+    pos = end;
+  }
+
+  return pos == topic.length();
+}
+
+void Router::expandPattern(const Pattern& pattern, const std::vector<std::string_view>& captures, std::string& expanded)
+{
+  expanded.clear();
+  for (const Pattern::Part& part : pattern.parts)
+  {
+    if (part.capture == 0)
+      expanded += part.literal;
+    else if (part.capture < captures.size())
+      expanded += captures[part.capture];
+  }
+}
@@ -0,0 +1,86 @@
+#ifndef _ROUTER_H_
+#define _ROUTER_H_
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "aggregate.h"
+#include "clock.h"
+#include "decoder.h"
+#include "field.h"
+#include "filter.h"
+#include "properties.h"
+#include "series.h"
+
+class InfluxDBWriter;
+class MemoryAccount;
+class PendingAck;
+class Trace;
+
+
+/*
+ * Matches PUBLISH topics against the [topic] sections in application.properties, extracts the values named by
+ * each rule and hands them as line protocol to the InfluxDB writer of the rule's server.
+ */
+class Router
+{
+private:
+  static constexpr std::string_view FIELD_KEY{"value="};
+  static constexpr size_t NOT_SHARED = SIZE_MAX;
+
+  // "minidrivhus/sensor{1}/temp" or "minidrivhus.sensor{1}.temp", where {n} is capture n
+  struct Pattern {
+    struct Part {
+      std::string literal;
+      size_t capture = 0; // 0 for literals
+    };
+    std::vector<Part> parts;
+    size_t capture_count = 0;
+  };
+
+  struct CompiledRule {
+    uint32_t id;
+    std::vector<std::string> source_path; // Path below msg.payload. Empty for the whole payload
+    Pattern destination;
+    Field::Type type = Field::UNKNOWN; // UNKNOWN to detect it from the first value of each series
+    SeriesFilter::Options filter;
+    Aggregator::Options aggregate;
+    Clock::Precision precision = Clock::NANOSECONDS;
+    PayloadDecoder::Format decoder = PayloadDecoder::AUTO; // AUTO to follow the message and topic
+    std::shared_ptr<InfluxDBWriter> writer;
+    size_t same_line_as = NOT_SHARED; // An earlier rule of the topic that only differs in server. Its line is written as is
+    bool shared = false; // Later rules write the line of this one
+  };
+
+  struct CompiledTopic {
+    Pattern match;
+    std::vector<CompiledRule> rules;
+  };
+
+public:
+  Router(const Properties& properties);
+
+  // content_type and payload_format_indicator are the PUBLISH properties (3.3.2.3.9, 3.3.2.3.2), empty and 0 if not sent
+  void route(std::string_view topic, const uint8_t* payload, size_t payload_length, std::string_view content_type,
+             uint8_t payload_format_indicator, const std::shared_ptr<PendingAck>& ack, const std::shared_ptr<Trace>& trace = nullptr,
+             const std::shared_ptr<MemoryAccount>& account = nullptr);
+
+private:
+  static void compilePattern(const std::string& pattern, Pattern& compiled);
+  [[nodiscard]] static bool matchPattern(const Pattern& pattern, std::string_view topic, std::vector<std::string_view>& captures);
+  static void expandPattern(const Pattern& pattern, const std::vector<std::string_view>& captures, std::string& expanded);
+
+private:
+  std::map<std::string,std::shared_ptr<InfluxDBWriter>> m_writers;
+  std::vector<CompiledTopic> m_topics;
+  std::unique_ptr<std::atomic<PayloadDecoder::Format>[]> m_formats; // Per topic section, the format its payloads were last seen in
+  SeriesTable m_series; // Also keeps the field type detected for each series, so it is bounded by series_cache_size as well
+  std::unique_ptr<SeriesFilter> m_filter; // Only if a rule filters
+  std::unique_ptr<Aggregator> m_aggregator; // Only if a rule aggregates
+};
+
+#endif // _ROUTER_H_
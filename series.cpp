@@ -0,0 +1,81 @@
+#include "series.h"
+
+#include <algorithm>
+
+#include "metrics.h"
+
+
+SeriesTable::SeriesTable(size_t max_series)
+: m_shard_capacity(std::max<size_t>(1, (max_series+SHARD_COUNT-1)/SHARD_COUNT))
+{
+}
+
+void SeriesTable::makeKey(uint32_t rule_id, const std::vector<std::string_view>& captures, std::string& key)
+{
+  key.assign(reinterpret_cast<const char*>(&rule_id), sizeof(rule_id));
+  for (const std::string_view& capture : captures)
+  {
+    key += capture;
+    key += '/'; //Captures never span topic levels, so '/' can't be part of a capture
+  }
+}
+
+bool SeriesTable::appendPrefix(std::string_view key, std::string& line, Series& series)
+{
+  Shard& shard = m_shards[getShardIndex(key)];
+  {
+    std::lock_guard<std::mutex> lock(shard.lock);
+    auto iter = shard.index.find(key);
+    if (iter != shard.index.end())
+    {
+      shard.lru.splice(shard.lru.begin(), shard.lru, iter->second);
+      line += iter->second->prefix;
+      series = iter->second->series;
+    }
+    else
+    {
+      Metrics::add(Metrics::SERIES_MISSES, 1);
+      return false;
+    }
+  }
+
+  Metrics::add(Metrics::SERIES_HITS, 1);
+  return true;
+}
+
+void SeriesTable::insert(std::string_view key, std::string_view prefix, Field::Type type, std::string& line, Series& series)
+{
+  const size_t shard_index = getShardIndex(key);
+  Shard& shard = m_shards[shard_index];
+  std::lock_guard<std::mutex> lock(shard.lock);
+
+  // Another session thread may have interned it since the miss
+  auto iter = shard.index.find(key);
+  if (iter != shard.index.end())
+  {
+    line += iter->second->prefix;
+    series = iter->second->series;
+    return;
+  }
+
+  uint32_t id;
+  if (shard.index.size() >= m_shard_capacity)
+  {
+    Entry& evicted = shard.lru.back();
+    id = evicted.series.id;
+    shard.index.erase(evicted.key);
+    shard.lru.pop_back();
+    Metrics::add(Metrics::SERIES_EVICTIONS, 1);
+  }
+  else
+  {
+    id = static_cast<uint32_t>(shard.next_id++ * SHARD_COUNT + shard_index);
+    Metrics::add(Metrics::SERIES_COUNT, 1);
+  }
+
+  shard.lru.push_front(Entry{std::string(key), std::string(prefix), Series{id, type}});
+  shard.index.emplace(shard.lru.front().key, shard.lru.begin());
+
+  line += prefix;
+  series = shard.lru.front().series;
+}
@@ -0,0 +1,71 @@
+#ifndef _SERIES_H_
+#define _SERIES_H_
+
+#include <list>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "field.h"
+
+
+/*
+ * Interns series keys, (rule, topic captures), with their escaped line protocol prefix "<measurement> value=", so emitting
+ * a point is a copy of the prefix plus the field value and timestamp. The field type is detected from the first value of a
+ * series and kept with it, so later values are converted to it, and the type is not detected again for every point.
+ * Memory is bounded by evicting the least recently used series. The table is sharded by key hash to keep session threads
+ * from contending on one lock.
+ */
+class SeriesTable
+{
+public:
+  struct Series {
+    uint32_t id; // Stable while the series is interned, and below getMaxSeries(). The id of an evicted series is reused
+    Field::Type type;
+  };
+
+private:
+  static constexpr size_t SHARD_COUNT = 16;
+
+  struct Entry {
+    std::string key;
+    std::string prefix;
+    Series series;
+  };
+
+  struct Hash {
+    using is_transparent = void;
+    size_t operator()(std::string_view key) const {return std::hash<std::string_view>()(key);}
+  };
+
+  struct Shard {
+    std::mutex lock;
+    std::list<Entry> lru; // Most recently used first
+    std::unordered_map<std::string_view,std::list<Entry>::iterator,Hash,std::equal_to<>> index; // Keys point into Entry::key
+    uint32_t next_id = 0;
+  };
+
+public:
+  SeriesTable(size_t max_series);
+
+  [[nodiscard]] size_t getMaxSeries() const {return m_shard_capacity*SHARD_COUNT;}
+
+  static void makeKey(uint32_t rule_id, const std::vector<std::string_view>& captures, std::string& key);
+
+  // On a hit, appends the prefix to line and returns true
+  [[nodiscard]] bool appendPrefix(std::string_view key, std::string& line, Series& series);
+  // Interns a series after a miss, and appends its prefix to line. Evicts the least recently used series if the shard is full
+  void insert(std::string_view key, std::string_view prefix, Field::Type type, std::string& line, Series& series);
+
+private:
+  [[nodiscard]] size_t getShardIndex(std::string_view key) const {return Hash()(key) % SHARD_COUNT;}
+
+private:
+  size_t m_shard_capacity;
+  Shard m_shards[SHARD_COUNT];
+};
+
+#endif // _SERIES_H_
@@ -1,8 +1,16 @@
 #include "server.h"
 
 #include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <thread>
 
+#include "connection.h"
+#include "log.h"
+#include "main.h"
 #include "packets/packet.h"
+#include "session.h"
 
 
 Server::Server(const Properties& properties)
@@ -10,42 +18,309 @@ Server::Server(const Properties& properties)
   asio::signal_set signals(m_io_context, SIGINT, SIGTERM);
   signals.async_wait([&](auto, auto) {m_io_context.stop();} );
 
-  m_acceptor = std::make_unique<asio::ip::tcp::acceptor>(m_io_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), properties.getSettings().mqtt_port));
+  const Properties::Settings& settings = properties.getSettings();
+  m_cpu_affinity = settings.cpu_affinity;
+
+  // With SO_REUSEPORT on every acceptor, the kernel spreads incoming connections over the shards
+  const bool reuse_port = settings.listener_shards > 1;
+  for (int shard=0; shard<settings.listener_shards; shard++)
+  {
+    m_acceptors.push_back(createAcceptor(settings.mqtt_port, reuse_port));
+  }
+
+  if (settings.tls_certificate.empty() || settings.tls_private_key.empty())
+  {
+    std::cerr << "tls_certificate or tls_private_key is not set, not listening on mqtt_port_tls " << settings.mqtt_port_tls << std::endl;
+  }
+  else if (createTlsContext(settings))
+  {
+    for (int shard=0; shard<settings.listener_shards; shard++)
+    {
+      m_tls_acceptors.push_back(createAcceptor(settings.mqtt_port_tls, reuse_port));
+    }
+    m_handshake_pool = std::make_unique<asio::thread_pool>(settings.tls_handshake_threads);
+  }
 }
 
-void Server::session(asio::ip::tcp::socket socket)
+bool Server::createTlsContext(const Properties::Settings& settings)
+{
+  try
+  {
+    m_tls_context = std::make_unique<asio::ssl::context>(asio::ssl::context::tls_server);
+    m_tls_context->set_options(asio::ssl::context::default_workarounds |
+                               asio::ssl::context::no_sslv2 |
+                               asio::ssl::context::no_sslv3 |
+                               asio::ssl::context::no_tlsv1 |
+                               asio::ssl::context::no_tlsv1_1 |
+                               asio::ssl::context::single_dh_use);
+    m_tls_context->use_certificate_chain_file(settings.tls_certificate);
+    m_tls_context->use_private_key_file(settings.tls_private_key, asio::ssl::context::pem);
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Could not create TLS context: " << e.what() << std::endl;
+    m_tls_context.reset();
+    return false;
+  }
+
+  SSL_CTX* ctx = m_tls_context->native_handle();
+
+  // Session IDs are kept in one cache shared by all connections, so a reconnecting client gets an abbreviated handshake
+  ::SSL_CTX_set_session_id_context(ctx, reinterpret_cast<const unsigned char*>(TLS_SESSION_ID_CONTEXT.data()), TLS_SESSION_ID_CONTEXT.length());
+  ::SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  ::SSL_CTX_sess_set_cache_size(ctx, settings.tls_session_cache_size);
+  ::SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+
+  // Session tickets keep resumption state on the client. The ticket key belongs to the context, so any connection can resume any ticket
+  ::SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+
+  return true;
+}
+
+std::unique_ptr<asio::ip::tcp::acceptor> Server::createAcceptor(int port, bool reuse_port)
+{
+  const asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), port);
+  auto acceptor = std::make_unique<asio::ip::tcp::acceptor>(m_io_context);
+  acceptor->open(endpoint.protocol());
+  acceptor->set_option(asio::ip::tcp::acceptor::reuse_address(true));
+  if (reuse_port)
+    acceptor->set_option(ReusePort(true));
+  acceptor->bind(endpoint);
+  acceptor->listen();
+  return acceptor;
+}
+
+// Threads inherit the CPU affinity of the thread creating them, so session threads stay on the CPU of their acceptor
+void Server::pinToCpu(size_t shard) const
+{
+  if (m_cpu_affinity.empty())
+    return;
+
+  const int cpu = m_cpu_affinity[shard % m_cpu_affinity.size()];
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(cpu, &cpu_set);
+  if (0 != ::pthread_setaffinity_np(::pthread_self(), sizeof(cpu_set), &cpu_set))
+  {
+    Log::write(Log::CPU_PIN_FAILED, shard, cpu);
+  }
+}
+
+void Server::session(std::unique_ptr<Connection> connection)
 {
   size_t fixed_header_length;
   size_t total_length;
   std::error_code error_code;
+  std::shared_ptr<Session> session;
   while (true)
   {
     try
     {
       std::shared_ptr<BasePacket> packet;
-      if (IS_ERROR(error_code=BasePacket::createPacket(socket, packet, fixed_header_length, total_length)))
+      if (session)
+        ::getSessionManager()->pause(*session);
+      connection->getMemoryAccount()->waitForBudget();
+      if (session)
+        ::getSessionManager()->touch(*session);
+      if (IS_ERROR(error_code=BasePacket::createPacket(*connection, packet, fixed_header_length, total_length)))
+      {
+        // 3.2.2.3.6, "If a Server receives a packet whose size exceeds this limit, this is a Protocol Error, the Server uses DISCONNECT with Reason Code 0x95 (Packet too large)"
+        if (error_code==std::errc::value_too_large && session && session->getProtocolVersion()>=5)
+        {
+          std::vector<uint8_t> disconnect;
+          DisconnectPacket::encode(disconnect, 0x95);
+          (void)session->write(disconnect);
+        }
         break;
+      }
 
-      if (IS_ERROR(error_code=packet->parse()))
+      if (session)
+        ::getSessionManager()->touch(*session);
+      packet->setSession(session);
+      error_code = packet->parse();
+      session = packet->getSession(); //Also of a CONNECT whose CONNACK failed, so the session is detached below
+      if (IS_ERROR(error_code))
       {
+        if (!std::dynamic_pointer_cast<DisconnectPacket>(packet)) //A client DISCONNECT ends the session the same way
+          Log::write(Log::PACKET_REJECTED, connection->getId(), connection->getClientId(), error_code);
         break; //Error
       }
-
-      //TODO Handle packet
     }
     catch (std::exception& e)
     {
-      std::cerr << "Exception in thread: " << e.what() << "\n";
+      Log::write(Log::SESSION_EXCEPTION, e.what());
     }
   }
+
+  // Writer threads may still complete PUBACKs for this session after the connection is gone
+  if (session)
+    session->detach();
 }
 
-void Server::run()
+// Handshakes run on m_handshake_pool, so a reconnect storm of full handshakes is bounded to a fixed number of threads
+// and never delays accepting, or the session threads serving established connections
+void Server::acceptTls(size_t shard)
 {
+  pinToCpu(shard);
   while (true)
   {
     asio::ip::tcp::socket socket(m_io_context);
-    m_acceptor->accept(socket);
-    std::thread(Server::session, std::move(socket)).detach();
+    std::error_code error_code;
+    m_tls_acceptors[shard]->accept(socket, error_code);
+    if (IS_ERROR(error_code))
+    {
+      acceptFailed(shard, error_code);
+      continue;
+    }
+
+    auto connection = std::make_unique<TlsConnection>(std::move(socket), *m_tls_context);
+    asio::post(*m_handshake_pool, [connection = std::move(connection)]() mutable
+    {
+      if (IS_ERROR(connection->handshake()))
+        return;
+
+      std::thread(Server::session, std::unique_ptr<Connection>(std::move(connection))).detach();
+    });
+  }
+}
+
+void Server::accept(size_t shard)
+{
+  pinToCpu(shard);
+  while (true)
+  {
+    asio::ip::tcp::socket socket(m_io_context);
+    std::error_code error_code;
+    m_acceptors[shard]->accept(socket, error_code);
+    if (IS_ERROR(error_code))
+    {
+      acceptFailed(shard, error_code);
+      continue;
+    }
+#ifdef USE_IO_URING
+    std::thread(Server::session, UringConnection::create(std::move(socket))).detach();
+#else
+    std::thread(Server::session, std::make_unique<TcpConnection>(std::move(socket))).detach();
+#endif
+  }
+}
+
+// A connection aborted before it was accepted only costs that connection. Out of file descriptors, accept fails again at
+// once until a connection is closed, so the shard waits instead of spinning
+void Server::acceptFailed(size_t shard, const std::error_code& error_code)
+{
+  Log::write(Log::ACCEPT_FAILED, shard, error_code);
+  if (error_code==std::errc::too_many_files_open || error_code==std::errc::too_many_files_open_in_system ||
+      error_code==std::errc::no_buffer_space || error_code==std::errc::not_enough_memory)
+    std::this_thread::sleep_for(ACCEPT_BACKOFF);
+}
+
+// Loopback connections served by both backends. Most are idle. The busy ones get bursts of small packets, and post a 4 byte
+// answer to each, as PUBACKs are posted. The client sockets are never read, their receive buffers hold all answers
+void Server::benchmark(std::ostream& out)
+{
+  static constexpr size_t CONNECTIONS = 2000;
+  static constexpr size_t BUSY_CONNECTIONS = 100;
+  static constexpr size_t PACKETS = 200000;
+  static constexpr size_t BURST = 4; // Packets per client write
+  static constexpr uint8_t PACKET_LENGTH = 32;
+
+  std::vector<uint8_t> burst;
+  for (size_t i=0; i<BURST; i++)
+  {
+    burst.push_back(0x30); //PUBLISH
+    burst.push_back(PACKET_LENGTH-2);
+    burst.insert(burst.end(), PACKET_LENGTH-2, 'x');
+  }
+
+  out << "backend\tconnections\tbusy\tpackets\tus_per_packet\tcpu_us_per_packet\tcontext_switches_per_packet\n";
+  for (const bool io_uring : {false, true})
+  {
+    std::string backend = io_uring ? "io_uring" : "poll";
+#ifndef USE_IO_URING
+    if (io_uring)
+    {
+      out << "io_uring\tnot built, make IO_URING=YES\n";
+      continue;
+    }
+#endif
+
+    asio::io_context io_context;
+    asio::ip::tcp::acceptor acceptor(io_context, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    std::vector<asio::ip::tcp::socket> clients;
+    std::vector<std::thread> sessions;
+    std::atomic<size_t> received(0);
+    for (size_t i=0; i<CONNECTIONS; i++)
+    {
+      clients.emplace_back(io_context);
+      clients.back().connect(acceptor.local_endpoint());
+      asio::ip::tcp::socket socket(io_context);
+      acceptor.accept(socket);
+
+      std::unique_ptr<Connection> connection;
+#ifdef USE_IO_URING
+      if (io_uring)
+      {
+        connection = UringConnection::create(std::move(socket));
+        if (!dynamic_cast<UringConnection*>(connection.get()))
+          backend = "io_uring (unavailable, poll)";
+      }
+      else
+#endif
+        connection = std::make_unique<TcpConnection>(std::move(socket));
+      sessions.emplace_back([connection = std::move(connection), &received]()
+      {
+        static constexpr uint8_t ANSWER[] = {0x40, 0x02, 0x00, 0x01};
+        uint8_t packet[PACKET_LENGTH];
+        while (IS_OK(connection->read(packet, 2)) && IS_OK(connection->read(packet+2, packet[1])))
+        {
+          (void)connection->post(ANSWER, sizeof(ANSWER), SIZE_MAX);
+          received.fetch_add(1, std::memory_order_relaxed);
+        }
+      });
+    }
+
+    struct rusage usage_before, usage_after;
+    ::getrusage(RUSAGE_SELF, &usage_before);
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t sent=0; sent<PACKETS; sent+=BURST)
+    {
+      asio::write(clients[(sent/BURST) % BUSY_CONNECTIONS], asio::buffer(burst));
+    }
+    while (received.load(std::memory_order_relaxed) < PACKETS)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    const double us = std::chrono::duration<double,std::micro>(std::chrono::steady_clock::now()-start).count();
+    ::getrusage(RUSAGE_SELF, &usage_after);
+
+    const auto cpu_us = [](const struct rusage& usage)
+    {
+      return usage.ru_utime.tv_sec*1e6 + usage.ru_utime.tv_usec + usage.ru_stime.tv_sec*1e6 + usage.ru_stime.tv_usec;
+    };
+    const long context_switches = usage_after.ru_nvcsw+usage_after.ru_nivcsw - usage_before.ru_nvcsw-usage_before.ru_nivcsw;
+    out << backend << '\t' << CONNECTIONS << '\t' << BUSY_CONNECTIONS << '\t' << PACKETS << '\t' << us/PACKETS << '\t'
+        << (cpu_us(usage_after)-cpu_us(usage_before))/PACKETS << '\t' << static_cast<double>(context_switches)/PACKETS << '\n';
+    out.flush();
+
+    clients.clear(); //Ends the sessions
+    for (std::thread& session : sessions)
+    {
+      session.join();
+    }
+  }
+}
+
+void Server::run()
+{
+  for (size_t shard=0; shard<m_tls_acceptors.size(); shard++)
+  {
+    std::thread(&Server::acceptTls, this, shard).detach();
+  }
+
+  for (size_t shard=1; shard<m_acceptors.size(); shard++)
+  {
+    std::thread(&Server::accept, this, shard).detach();
   }
+  accept(0);
 }
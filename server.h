@@ -2,25 +2,54 @@
 #define _SERVER_H_
 
 #include <asio.hpp>
+#include <asio/ssl.hpp>
+#include <chrono>
 #include <memory>
+#include <ostream>
+#include <string_view>
+#include <vector>
 
 #include "properties.h"
 
+class Connection;
+
 
 class Server
 {
+private:
+  static constexpr std::string_view TLS_SESSION_ID_CONTEXT{"MQTTtoInfluxDB"};
+  static constexpr long TLS_SESSION_TIMEOUT = 24*60*60L; // Seconds. Battery devices may sleep for hours between reconnects
+
+  static constexpr std::chrono::milliseconds ACCEPT_BACKOFF{100}; // After running out of file descriptors
+
+  using ReusePort = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
 public:
   Server(const Properties& properties);
 
 private:
-  static void session(asio::ip::tcp::socket socket);
+  [[nodiscard]] bool createTlsContext(const Properties::Settings& settings);
+  [[nodiscard]] std::unique_ptr<asio::ip::tcp::acceptor> createAcceptor(int port, bool reuse_port);
+  void pinToCpu(size_t shard) const;
+  static void session(std::unique_ptr<Connection> connection);
+  void accept(size_t shard);
+  void acceptTls(size_t shard);
+  static void acceptFailed(size_t shard, const std::error_code& error_code);
 
 public:
   void run();
 
+  // Time per packet for many mostly idle connections, with each connection backend built in
+  static void benchmark(std::ostream& out);
+
 private:
   asio::io_context m_io_context;
-  std::unique_ptr<asio::ip::tcp::acceptor> m_acceptor;
+  std::vector<std::unique_ptr<asio::ip::tcp::acceptor>> m_acceptors; // One per listener shard, all on mqtt_port
+  std::vector<int> m_cpu_affinity;
+
+  std::unique_ptr<asio::ssl::context> m_tls_context;
+  std::vector<std::unique_ptr<asio::ip::tcp::acceptor>> m_tls_acceptors;
+  std::unique_ptr<asio::thread_pool> m_handshake_pool;
 };
 
 #endif // _SERVER_H_
@@ -3,50 +3,361 @@
 #include <algorithm>
 #include <cmath>
 #include <random>
+#include <thread>
 
+#include "connection.h"
+#include "main.h"
+#include "metrics.h"
+#include "properties.h"
+#include "subscriptions.h"
+#include "packets/packet.h"
 
-void Session::disconnect()
+
+PendingAck::PendingAck(std::weak_ptr<Session> session, uint16_t packet_identifier)
+: m_session(session),
+  m_packet_identifier(packet_identifier),
+  m_outstanding(1),
+  m_failed(false)
+{
+}
+
+void PendingAck::release(bool stored)
 {
+  if (!stored)
+    m_failed.store(true, std::memory_order_release);
+
+  if (m_outstanding.fetch_sub(1, std::memory_order_acq_rel) == 1)
+  {
+    std::shared_ptr<Session> session = m_session.lock();
+    if (session)
+      session->sendCompletedPubAcks();
+  }
 }
 
 
-void SessionManager::expireOldSessions()
+Session::Session(uint32_t slot)
+: m_slot(slot),
+  m_connection(nullptr),
+  m_protocol_version(0),
+  m_maximum_packet_size(UINT32_MAX),
+  m_receive_maximum(0)
 {
 }
 
-void SessionManager::expireSession(const std::string& client_id)
+void Session::attach(Connection* connection, uint8_t protocol_version, uint16_t receive_maximum, uint32_t maximum_packet_size)
 {
   {
-    std::lock_guard<std::mutex> lock(m_session_map_lock);
-    auto iter = m_session_map.find(client_id);
-    if (iter != m_session_map.end())
+    std::lock_guard<std::mutex> lock(m_connection_lock);
+    m_connection = connection;
+    m_protocol_version = protocol_version;
+    m_maximum_packet_size = maximum_packet_size;
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_ack_lock);
+    m_receive_maximum = receive_maximum;
+  }
+}
+
+void Session::detach()
+{
+  ::getSubscriptions()->unsubscribeAll(this);
+
+  {
+    std::lock_guard<std::mutex> lock(m_ack_lock);
+    m_pending_acks.clear(); //Unacknowledged PUBLISH packets are resent by the client when it reconnects
+  }
+  m_ack_window_available.notify_all();
+  ::getSessionManager()->setInFlight(*this, 0);
+
+  {
+    std::lock_guard<std::mutex> lock(m_connection_lock);
+    m_connection = nullptr;
+  }
+  ::getSessionManager()->disconnected(*this);
+}
+
+// Called from any thread, so the DISCONNECT is posted. The session thread writes it if the client takes it at once
+void Session::disconnect(uint8_t reason_code)
+{
+  std::lock_guard<std::mutex> lock(m_connection_lock);
+  if (m_connection)
+  {
+    if (reason_code!=0x00 && m_protocol_version>=5)
     {
-      std::shared_ptr<Session> session = iter->second;
-      session->disconnect();
-      m_session_map.erase(client_id);
+      std::vector<uint8_t> disconnect;
+      DisconnectPacket::encode(disconnect, reason_code);
+      (void)m_connection->post(disconnect.data(), disconnect.size(), SIZE_MAX);
     }
+    m_connection->close();
   }
 }
 
-bool SessionManager::createSession(std::string& client_id, std::shared_ptr<Session>& session)
+std::error_code Session::write(const std::vector<uint8_t>& data)
 {
+  if (!m_connection)
+    return std::make_error_code(std::errc::not_connected);
+
+  return m_connection->write(data.data(), data.size());
+}
+
+std::error_code Session::post(const std::vector<uint8_t>& data)
+{
+  std::lock_guard<std::mutex> lock(m_connection_lock);
+  if (!m_connection)
+    return std::make_error_code(std::errc::not_connected);
+
+  return m_connection->post(data.data(), data.size(), ::getProperties()->getSettings().max_queued_length);
+}
+
+std::shared_ptr<PendingAck> Session::beginPubAck(uint16_t packet_identifier)
+{
+  std::shared_ptr<PendingAck> ack = std::make_shared<PendingAck>(weak_from_this(), packet_identifier);
+
+  std::unique_lock<std::mutex> lock(m_ack_lock);
+  const auto window_available = [this] {return m_pending_acks.size() < std::max<size_t>(m_receive_maximum, 1);};
+  if (!window_available())
+  {
+    ::getSessionManager()->pause(*this);
+    m_ack_window_available.wait(lock, window_available);
+    ::getSessionManager()->touch(*this);
+  }
+  m_pending_acks.push_back(ack);
+  ::getSessionManager()->setInFlight(*this, m_pending_acks.size());
+  return ack;
+}
+
+// Runs on the InfluxDB writer thread that completed the last batch of a PUBLISH, so the PUBACKs are only posted
+void Session::sendCompletedPubAcks()
+{
+  std::vector<uint8_t> pubacks;
+  std::vector<uint8_t> puback;
+  std::error_code error_code;
+  bool window_changed = false;
+  bool unacknowledged = false;
   {
-    std::lock_guard<std::mutex> lock(m_session_map_lock);
-    if (client_id.empty())
-      generateClientId(client_id);
+    std::lock_guard<std::mutex> lock(m_ack_lock);
+    while (!m_pending_acks.empty() && m_pending_acks.front()->isComplete())
+    {
+      std::shared_ptr<PendingAck> ack = m_pending_acks.front();
+      m_pending_acks.pop_front();
+      window_changed = true;
+
+      if (ack->isStored())
+      {
+        PubAckPacket::encode(puback, m_protocol_version, ack->getPacketIdentifier(), 0x00);
+      }
+      else if (m_protocol_version >= 5)
+      {
+        PubAckPacket::encode(puback, m_protocol_version, ack->getPacketIdentifier(), 0x80); //Unspecified error
+      }
+      else
+      {
+        // MQTT 3.1.1 has no negative PUBACK, and a client only resends on a new connection (4.4). So it is left
+        // unacknowledged, and the connection is closed below
+        unacknowledged = true;
+        continue;
+      }
+      pubacks.insert(pubacks.end(), puback.begin(), puback.end());
+    }
+
+    // Posted under the lock, so PUBACKs completed on two threads are not reordered
+    if (!pubacks.empty())
+      error_code = post(pubacks);
+    if (window_changed)
+      ::getSessionManager()->setInFlight(*this, m_pending_acks.size());
+  }
+
+  if (window_changed)
+    m_ack_window_available.notify_all();
+  if (unacknowledged || error_code==std::errc::no_buffer_space) //A PUBACK can't be dropped
+    disconnect();
+}
+
 
-    if (m_session_map.contains(client_id))
+void SessionManager::startSweeping()
+{
+  std::thread([this]()
+  {
+    while (true)
+    {
+      std::this_thread::sleep_for(SWEEP_INTERVAL);
+      sweep(Clock::monotonicMs());
+    }
+  }).detach();
+}
+
+void SessionManager::expireSession(const std::string& client_id)
+{
+  std::shared_ptr<Session> session;
+  {
+    std::lock_guard<std::mutex> lock(m_table_lock);
+    auto iter = m_slots.find(client_id);
+    if (iter == m_slots.end())
+      return;
+
+    session = m_cold[iter->second].session;
+    releaseSlot(iter->second);
+  }
+  session->disconnect();
+}
+
+// 3.1.4, CONNECT Actions. "If the ClientID represents a Client already connected to the Server, the Server sends a
+// DISCONNECT packet to the existing Client with Reason Code of 0x8E (Session taken over)"
+// The existing session leaves the table here, and is disconnected after the table lock is released, so a reconnect storm
+// does not wait on the writes to old, often dead, connections
+bool SessionManager::createSession(std::string& client_id, uint16_t keep_alive, uint32_t session_expiry_interval, std::shared_ptr<Session>& session)
+{
+  if (client_id.empty())
+    generateClientId(client_id);
+
+  std::shared_ptr<Session> taken_over;
+  {
+    std::lock_guard<std::mutex> lock(m_table_lock);
+    auto iter = m_slots.find(client_id);
+    if (iter != m_slots.end())
+    {
+      if (getPage(iter->second).flags[iter->second%SLOTS_PER_PAGE] & CONNECTED)
+        taken_over = m_cold[iter->second].session;
+
+      releaseSlot(iter->second); //Session state is not resumed, so the existing session is replaced
+    }
+
+    uint32_t slot;
+    if (!allocateSlot(slot))
       return false;
 
-    session = std::make_shared<Session>();
-    m_session_map.emplace(client_id, session);
+    session = std::make_shared<Session>(slot);
+    Page& page = getPage(slot);
+    const size_t index = slot%SLOTS_PER_PAGE;
+    page.last_activity_ms[index].store(Clock::monotonicMs(), std::memory_order_relaxed);
+    page.in_flight[index].store(0, std::memory_order_relaxed);
+    page.keep_alive[index] = keep_alive;
+    page.session_expiry_interval[index] = session_expiry_interval;
+    page.expires_at_ms[index] = INT64_MAX;
+    page.flags[index] = IN_USE | CONNECTED;
+    m_cold[slot] = Cold{client_id, session};
+    m_slots.emplace(client_id, slot);
+  }
+
+  if (taken_over)
+  {
+    Metrics::add(Metrics::SESSIONS_TAKEN_OVER, 1);
+    taken_over->disconnect(0x8E);
+  }
+  return true;
+}
+
+void SessionManager::disconnected(const Session& session)
+{
+  std::lock_guard<std::mutex> lock(m_table_lock);
+  const uint32_t slot = session.getSlot();
+  if (!isSlotOf(slot, session)) //Expired or replaced already
+    return;
+
+  // 3.1.2.11.2, Session Expiry Interval. 0 ends the session with the Network Connection, 0xFFFFFFFF never expires it
+  Page& page = getPage(slot);
+  const size_t index = slot%SLOTS_PER_PAGE;
+  const uint32_t session_expiry_interval = page.session_expiry_interval[index];
+  if (session_expiry_interval==0 || (page.flags[index] & TAKEN_OVER))
+  {
+    freeSlot(slot);
+    return;
+  }
+
+  page.flags[index] &= ~CONNECTED;
+  page.expires_at_ms[index] = session_expiry_interval==UINT32_MAX ? INT64_MAX : Clock::monotonicMs() + session_expiry_interval*1000LL;
+}
+
+bool SessionManager::allocateSlot(uint32_t& slot)
+{
+  if (!m_free_slots.empty())
+  {
+    slot = m_free_slots.back();
+    m_free_slots.pop_back();
     return true;
   }
+
+  slot = static_cast<uint32_t>(m_cold.size());
+  if (slot%SLOTS_PER_PAGE == 0)
+  {
+    if (slot/SLOTS_PER_PAGE >= MAX_PAGES)
+      return false;
+    m_pages[slot/SLOTS_PER_PAGE] = std::make_unique<Page>();
+  }
+  m_cold.emplace_back();
+  return true;
+}
+
+void SessionManager::freeSlot(uint32_t slot)
+{
+  getPage(slot).flags[slot%SLOTS_PER_PAGE] = 0;
+  auto iter = m_slots.find(m_cold[slot].client_id);
+  if (iter!=m_slots.end() && iter->second==slot) //A taken over slot left the index already
+    m_slots.erase(iter);
+  m_cold[slot] = Cold();
+  m_free_slots.push_back(slot);
+}
+
+// The session thread of a connected session still calls touch() and setInFlight() until it is detached. Were the slot
+// reused before, as the next allocateSlot() would, those writes would land in the columns of the new session
+void SessionManager::releaseSlot(uint32_t slot)
+{
+  uint8_t& flags = getPage(slot).flags[slot%SLOTS_PER_PAGE];
+  if (!(flags & CONNECTED))
+  {
+    freeSlot(slot);
+    return;
+  }
+
+  m_slots.erase(m_cold[slot].client_id);
+  flags = IN_USE | TAKEN_OVER;
+}
+
+// 3.1.2.10, Keep Alive. "If the Keep Alive value is non-zero and the Server does not receive an MQTT Control Packet from the
+// Client within one and a half times the Keep Alive time period, it MUST close the Network Connection to the Client"
+void SessionManager::sweep(int64_t now)
+{
+  std::vector<std::shared_ptr<Session>> timed_out;
+  uint64_t connected = 0;
+  uint64_t in_flight = 0;
+  {
+    std::lock_guard<std::mutex> lock(m_table_lock);
+    const uint32_t slot_count = static_cast<uint32_t>(m_cold.size());
+    for (uint32_t first=0; first<slot_count; first+=SLOTS_PER_PAGE)
+    {
+      Page& page = getPage(first);
+      const size_t count = std::min<size_t>(SLOTS_PER_PAGE, slot_count-first);
+      for (size_t index=0; index<count; index++)
+      {
+        const uint8_t flags = page.flags[index];
+        if (!(flags & CONNECTED))
+        {
+          if ((flags & IN_USE) && !(flags & TAKEN_OVER) && page.expires_at_ms[index]<=now)
+            freeSlot(first+index);
+          continue;
+        }
+
+        connected++;
+        in_flight += page.in_flight[index].load(std::memory_order_relaxed);
+        if (page.keep_alive[index]!=0 && now-page.last_activity_ms[index].load(std::memory_order_relaxed) > page.keep_alive[index]*1500LL)
+          timed_out.push_back(m_cold[first+index].session);
+      }
+    }
+    Metrics::set(Metrics::SESSIONS, m_slots.size());
+  }
+
+  Metrics::set(Metrics::SESSIONS_CONNECTED, connected);
+  Metrics::set(Metrics::PUBACKS_IN_FLIGHT, in_flight);
+  Metrics::add(Metrics::KEEP_ALIVE_TIMEOUTS, timed_out.size());
+  for (const std::shared_ptr<Session>& session : timed_out)
+  {
+    session->disconnect(0x8D); //Keep Alive timeout
+  }
 }
 
 void SessionManager::generateClientId(std::string& client_id)
 {
-  int required_id_length = std::min(static_cast<int>(::log10(m_session_map.size()+1)) + 2, 23);
+  int required_id_length = std::min(static_cast<int>(::log10(m_slots.size()+1)) + 2, 23);
   constexpr int LEGAL_CLIENT_ID_CHARS_length = sizeof(LEGAL_CLIENT_ID_CHARS)/sizeof(LEGAL_CLIENT_ID_CHARS[0]) - 1;
 
   std::random_device random_device;
@@ -54,7 +365,7 @@ void SessionManager::generateClientId(std::string& client_id)
   std::uniform_int_distribution<int> random_provider(0, LEGAL_CLIENT_ID_CHARS_length);
 
   {
-    std::lock_guard<std::mutex> lock(m_session_map_lock);
+    std::lock_guard<std::mutex> lock(m_table_lock);
     do
     {
       client_id.clear();
@@ -62,6 +373,6 @@ void SessionManager::generateClientId(std::string& client_id)
       {
         client_id += LEGAL_CLIENT_ID_CHARS[random_provider(random_engine)];
       }
-    } while (m_session_map.contains(client_id));
+    } while (m_slots.contains(client_id));
   }
 }
@@ -1,35 +1,161 @@
 #ifndef _SESSION_H_
 #define _SESSION_H_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
+#include <stdint.h>
 #include <string>
+#include <system_error>
 #include <unordered_map>
+#include <vector>
 
+#include "clock.h"
 
-class Session
+class Connection;
+class Session;
+
+/*
+ * A PUBACK waiting for every InfluxDB batch holding points from its PUBLISH to be acknowledged.
+ * The publishing thread holds one reference until routing is done, each batch holds one more.
+ */
+class PendingAck
+{
+public:
+  PendingAck(std::weak_ptr<Session> session, uint16_t packet_identifier);
+
+  void retain() {m_outstanding.fetch_add(1, std::memory_order_relaxed);}
+  void release(bool stored);
+
+  [[nodiscard]] uint16_t getPacketIdentifier() const {return m_packet_identifier;}
+  [[nodiscard]] bool isComplete() const {return m_outstanding.load(std::memory_order_acquire) == 0;}
+  [[nodiscard]] bool isStored() const {return !m_failed.load(std::memory_order_acquire);}
+
+private:
+  std::weak_ptr<Session> m_session;
+  uint16_t m_packet_identifier;
+  std::atomic<uint32_t> m_outstanding;
+  std::atomic<bool> m_failed;
+};
+
+
+/*
+ * The state of one session that only its own threads use. What the periodic sweeps read lives in the SessionManager slot.
+ */
+class Session : public std::enable_shared_from_this<Session>
 {
 public:
-  void disconnect();
+  Session(uint32_t slot);
+
+  [[nodiscard]] uint32_t getSlot() const {return m_slot;}
+
+  void attach(Connection* connection, uint8_t protocol_version, uint16_t receive_maximum, uint32_t maximum_packet_size);
+  void detach();
+  // For MQTT 5 clients, a reason_code other than 0x00 is sent in a DISCONNECT first
+  void disconnect(uint8_t reason_code = 0x00);
+
+  [[nodiscard]] uint8_t getProtocolVersion() const {return m_protocol_version;}
+  // 3.1.2.11.4, of the client
+  [[nodiscard]] uint32_t getMaximumPacketSize() const {return m_maximum_packet_size;}
+
+  // Only from the session thread. Blocks until the client has taken data
+  [[nodiscard]] std::error_code write(const std::vector<uint8_t>& data);
+  // From any thread. Queued for the session thread, never waits for the client. Fails with no_buffer_space when
+  // max_queued_length bytes are waiting for the client already
+  [[nodiscard]] std::error_code post(const std::vector<uint8_t>& data);
+
+  // Blocks while the Receive Maximum window is full, so a session keeps publishing while earlier batches are in flight
+  [[nodiscard]] std::shared_ptr<PendingAck> beginPubAck(uint16_t packet_identifier);
+  // PUBACKs are posted in the order the PUBLISH packets were received (4.6, Message ordering)
+  void sendCompletedPubAcks();
+
+private:
+  uint32_t m_slot;
+
+  std::mutex m_connection_lock; // Only changed by the session thread, which reads it without the lock
+  Connection* m_connection;
+  uint8_t m_protocol_version;
+  uint32_t m_maximum_packet_size;
+
+  std::mutex m_ack_lock;
+  std::condition_variable m_ack_window_available;
+  std::deque<std::shared_ptr<PendingAck>> m_pending_acks;
+  uint16_t m_receive_maximum;
 };
 
 
+/*
+ * Sessions are kept in a table of slots, looked up by client id through a separate index. The fields the keep-alive and
+ * expiry sweeps read, and those updated for every packet, are stored column by column in pages of SLOTS_PER_PAGE slots, so
+ * a sweep over 100k sessions reads a few MB of contiguous memory instead of chasing a pointer per session. Pages are never
+ * moved or freed, so session threads update their own slot without taking the table lock. For the same reason a slot is
+ * not reused before its session is detached.
+ */
 class SessionManager
 {
 private:
   static constexpr char LEGAL_CLIENT_ID_CHARS[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+  static constexpr size_t SLOTS_PER_PAGE = 4096;
+  static constexpr size_t MAX_PAGES = 256;
+  static constexpr std::chrono::milliseconds SWEEP_INTERVAL{1000};
+  static constexpr int64_t PAUSED = INT64_MAX; // last_activity_ms of a session thread waiting for memory or its PUBACK window, which never times out
+
+  enum Flags : uint8_t {
+    IN_USE = 0x01,
+    CONNECTED = 0x02,
+    TAKEN_OVER = 0x04 // Out of the index, and freed once its session is detached. Until then its threads still write the slot
+  };
+
+  struct Page {
+    std::atomic<int64_t> last_activity_ms[SLOTS_PER_PAGE]; // Clock::monotonicMs of the last packet read, or PAUSED
+    std::atomic<uint16_t> in_flight[SLOTS_PER_PAGE];       // PUBACKs waiting for InfluxDB
+    uint16_t keep_alive[SLOTS_PER_PAGE];                   // Seconds, 0 for none. The rest are only used under the table lock
+    uint32_t session_expiry_interval[SLOTS_PER_PAGE];      // Seconds
+    int64_t expires_at_ms[SLOTS_PER_PAGE];                 // Of a disconnected session
+    uint8_t flags[SLOTS_PER_PAGE];
+  };
+
+  // Only used under the table lock
+  struct Cold {
+    std::string client_id;
+    std::shared_ptr<Session> session;
+  };
 
 public:
-  void expireOldSessions();
+  // Closes connections past their keep-alive, and frees expired sessions, every SWEEP_INTERVAL from a background thread.
+  // The manager must outlive the thread, so only call it for a server that runs until the process exits
+  void startSweeping();
   void expireSession(const std::string& client_id);
-  [[nodiscard]] bool createSession(std::string& client_id, std::shared_ptr<Session>& session);
+  // Takes over a session with the same client id. Fails if the table is full. keep_alive and session_expiry_interval are in seconds
+  [[nodiscard]] bool createSession(std::string& client_id, uint16_t keep_alive, uint32_t session_expiry_interval, std::shared_ptr<Session>& session);
+  // Called when the connection of session is closed
+  void disconnected(const Session& session);
+
+  void touch(const Session& session) {getPage(session.getSlot()).last_activity_ms[session.getSlot()%SLOTS_PER_PAGE].store(Clock::monotonicMs(), std::memory_order_relaxed);}
+  // A paused session thread reads nothing, so its keep-alive is stopped until the next touch()
+  void pause(const Session& session) {getPage(session.getSlot()).last_activity_ms[session.getSlot()%SLOTS_PER_PAGE].store(PAUSED, std::memory_order_relaxed);}
+  void setInFlight(const Session& session, size_t count) {getPage(session.getSlot()).in_flight[session.getSlot()%SLOTS_PER_PAGE].store(static_cast<uint16_t>(count), std::memory_order_relaxed);}
 
   void generateClientId(std::string& client_id);
 
 private:
-  std::mutex m_session_map_lock;
-  std::unordered_map<std::string,std::shared_ptr<Session>> m_session_map;
+  [[nodiscard]] Page& getPage(uint32_t slot) const {return *m_pages[slot/SLOTS_PER_PAGE];}
+  [[nodiscard]] bool isSlotOf(uint32_t slot, const Session& session) const {return slot<m_cold.size() && m_cold[slot].session.get()==&session;}
+  [[nodiscard]] bool allocateSlot(uint32_t& slot);
+  void freeSlot(uint32_t slot);
+  // Frees the slot of a session that is not connected. That of a connected session is only freed by disconnected()
+  void releaseSlot(uint32_t slot);
+  void sweep(int64_t now);
 
+private:
+  std::mutex m_table_lock;
+  std::unordered_map<std::string,uint32_t> m_slots;
+  std::unique_ptr<Page> m_pages[MAX_PAGES];
+  std::vector<Cold> m_cold;
+  std::vector<uint32_t> m_free_slots;
 };
 
 #endif // _SESSION_H_
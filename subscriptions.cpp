@@ -0,0 +1,332 @@
+#include "subscriptions.h"
+
+#include <algorithm>
+
+#include "main.h"
+#include "memory_account.h"
+#include "metrics.h"
+#include "properties.h"
+#include "session.h"
+#include "packets/packet_publish.h"
+
+
+/*
+ * Any documentation references below, references the document https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html
+ */
+
+namespace
+{
+  void splitLevels(std::string_view topic, std::vector<std::string_view>& levels)
+  {
+    levels.clear();
+    size_t start = 0;
+    while (true)
+    {
+      const size_t end = topic.find('/', start);
+      if (std::string_view::npos == end)
+      {
+        levels.push_back(topic.substr(start));
+        return;
+      }
+      levels.push_back(topic.substr(start, end-start));
+      start = end+1;
+    }
+  }
+}
+
+
+Subscriptions::Subscriptions()
+: m_root(std::make_shared<const Node>())
+{
+}
+
+bool Subscriptions::isValidFilter(std::string_view filter)
+{
+  if (isShared(filter)) // 4.8.2, $share/{ShareName}/{filter}
+  {
+    const size_t slash = filter.find('/', SHARE_PREFIX.length());
+    if (std::string_view::npos==slash || slash==SHARE_PREFIX.length() ||
+        std::string_view::npos!=filter.substr(SHARE_PREFIX.length(), slash-SHARE_PREFIX.length()).find_first_of("+#"))
+      return false;
+    filter.remove_prefix(slash+1);
+  }
+
+  if (filter.empty()) // 4.7.3, "All Topic Names and Topic Filters MUST be at least one character long"
+    return false;
+
+  std::vector<std::string_view> levels;
+  splitLevels(filter, levels);
+  for (size_t i=0; i<levels.size(); i++)
+  {
+    // 4.7.1.2, "The multi-level wildcard character MUST be specified either on its own or following a topic level separator. In either case it MUST be the last character specified in the Topic Filter"
+    // 4.7.1.3, "The single-level wildcard can be used at any level in the Topic Filter ... Where it is used, it MUST occupy an entire level of the filter"
+    if (std::string_view::npos!=levels[i].find('#') && (levels[i]!="#" || i+1!=levels.size()))
+      return false;
+    if (std::string_view::npos!=levels[i].find('+') && levels[i]!="+")
+      return false;
+  }
+  return true;
+}
+
+bool Subscriptions::subscribe(const std::shared_ptr<Session>& session, const std::string& filter, uint8_t options)
+{
+  std::string_view share_name;
+  std::vector<std::string_view> levels;
+  splitFilter(filter, share_name, levels);
+
+  std::lock_guard<std::mutex> lock(m_update_lock);
+  bool added = false;
+  m_root.store(insert(m_root.load().get(), levels, 0, share_name, Subscriber{session, session.get(), options}, added));
+  if (added)
+    m_session_filters[session.get()].push_back(filter);
+  return added;
+}
+
+bool Subscriptions::unsubscribe(const Session* session, const std::string& filter)
+{
+  std::string_view share_name;
+  std::vector<std::string_view> levels;
+  splitFilter(filter, share_name, levels);
+
+  std::lock_guard<std::mutex> lock(m_update_lock);
+  bool removed = false;
+  std::shared_ptr<const Node> root = remove(m_root.load().get(), levels, 0, share_name, session, removed);
+  if (!removed)
+    return false;
+
+  m_root.store(root ? root : std::make_shared<const Node>());
+  auto iter = m_session_filters.find(session);
+  if (iter != m_session_filters.end())
+  {
+    std::erase(iter->second, filter);
+    if (iter->second.empty())
+      m_session_filters.erase(iter);
+  }
+  return true;
+}
+
+void Subscriptions::unsubscribeAll(const Session* session)
+{
+  std::lock_guard<std::mutex> lock(m_update_lock);
+  auto iter = m_session_filters.find(session);
+  if (iter == m_session_filters.end())
+    return;
+
+  std::shared_ptr<const Node> root = m_root.load();
+  std::string_view share_name;
+  std::vector<std::string_view> levels;
+  for (const std::string& filter : iter->second)
+  {
+    bool removed = false;
+    splitFilter(filter, share_name, levels);
+    root = remove(root.get(), levels, 0, share_name, session, removed);
+  }
+  m_root.store(root ? root : std::make_shared<const Node>());
+  m_session_filters.erase(iter);
+}
+
+void Subscriptions::publish(const Message& message, const Session* publisher)
+{
+  const std::shared_ptr<const Node> root = m_root.load();
+  if (root->isEmpty())
+    return;
+
+  thread_local std::vector<std::string_view> levels;
+  thread_local std::vector<const Subscriber*> matches;
+  splitLevels(message.topic, levels);
+  matches.clear();
+  match(*root, levels, 0, matches);
+  if (matches.empty())
+    return;
+
+  // A session with overlapping subscriptions gets the message once (3.3.4)
+  std::sort(matches.begin(), matches.end(), [](const Subscriber* a, const Subscriber* b) {return a->id < b->id;});
+  matches.erase(std::unique(matches.begin(), matches.end(), [](const Subscriber* a, const Subscriber* b) {return a->id == b->id;}), matches.end());
+
+  // A slow publisher must not hold up writes to the subscribers, so the payload is read in full before the first one
+  const uint8_t* payload = message.payload;
+  if (message.payload_buffered_length < message.payload_length)
+  {
+    if (std::all_of(matches.begin(), matches.end(), [publisher](const Subscriber* s) {return (s->options & NO_LOCAL) && s->id==publisher;}) ||
+        IS_ERROR(message.spool_payload(payload)))
+      return;
+  }
+
+  // Every delivery is QoS 0, so it has no Packet Identifier. The PUBLISH is encoded once per protocol and retain flag, and posted as is to every session
+  const bool overflow_disconnects = ::getProperties()->getSettings().queue_overflow_disconnects;
+  std::vector<uint8_t> encoded[2][2];
+  for (const Subscriber* subscriber : matches)
+  {
+    if ((subscriber->options & NO_LOCAL) && subscriber->id==publisher)
+      continue;
+
+    const std::shared_ptr<Session> session = subscriber->session.lock();
+    if (!session)
+      continue;
+
+    const bool mqtt5 = session->getProtocolVersion() >= 5;
+    const bool retain = message.retain && (subscriber->options & RETAIN_AS_PUBLISHED); // 3.3.1.3
+    std::vector<uint8_t>& packet = encoded[mqtt5][retain];
+    if (packet.empty())
+    {
+      PublishPacket::encode(packet, session->getProtocolVersion(), message.topic, retain,
+                            message.properties, message.properties_length, payload, message.payload_length);
+    }
+
+    // 3.1.2.11.4, "Where a Packet is too large to send, the Server MUST discard it without sending it and then behave as if it
+    // had completed sending that Application Message"
+    if (packet.size() > session->getMaximumPacketSize())
+    {
+      Metrics::add(Metrics::MESSAGES_DROPPED, 1);
+      continue;
+    }
+
+    // Posted to the session thread of the subscriber, so a slow subscriber only ever holds up itself. Queued output is charged
+    // to memory_budget, and a message that would exceed it is not queued either
+    const std::error_code error_code = MemoryAccount::isOverBudget(packet.size()) ? std::make_error_code(std::errc::no_buffer_space)
+                                                                                   : session->post(packet);
+    if (IS_OK(error_code))
+    {
+      Metrics::add(Metrics::MESSAGES_DELIVERED, 1);
+    }
+    else if (error_code == std::errc::no_buffer_space)
+    {
+      Metrics::add(Metrics::MESSAGES_DROPPED, 1);
+      if (overflow_disconnects)
+        session->disconnect();
+    }
+  }
+}
+
+void Subscriptions::splitFilter(std::string_view filter, std::string_view& share_name, std::vector<std::string_view>& levels)
+{
+  share_name = std::string_view();
+  if (isShared(filter))
+  {
+    const size_t slash = filter.find('/', SHARE_PREFIX.length());
+    share_name = filter.substr(SHARE_PREFIX.length(), slash-SHARE_PREFIX.length());
+    filter.remove_prefix(slash+1);
+  }
+  splitLevels(filter, levels);
+}
+
+std::shared_ptr<const Subscriptions::Node> Subscriptions::insert(const Node* node, const std::vector<std::string_view>& levels, size_t level,
+                                                                 std::string_view share_name, const Subscriber& subscriber, bool& added)
+{
+  std::shared_ptr<Node> copy = node ? std::make_shared<Node>(*node) : std::make_shared<Node>();
+  if (level < levels.size())
+  {
+    auto child = copy->children.find(levels[level]);
+    if (child == copy->children.end())
+      child = copy->children.emplace(std::string(levels[level]), nullptr).first;
+    child->second = insert(child->second.get(), levels, level+1, share_name, subscriber, added);
+    return copy;
+  }
+
+  std::vector<Subscriber>* subscribers = &copy->subscribers;
+  if (!share_name.empty())
+  {
+    auto group = copy->shared_groups.find(share_name);
+    std::shared_ptr<SharedGroup> group_copy = std::make_shared<SharedGroup>();
+    if (group == copy->shared_groups.end())
+      group = copy->shared_groups.emplace(std::string(share_name), nullptr).first;
+    else
+      group_copy->subscribers = group->second->subscribers;
+    group->second = group_copy;
+    subscribers = &group_copy->subscribers;
+  }
+
+  // 3.8.4, "If a Server receives a SUBSCRIBE packet containing a Topic Filter that is identical to a Non-shared Subscription's Topic Filter for the current Session, then it MUST replace that existing Subscription with a new Subscription"
+  auto existing = std::find_if(subscribers->begin(), subscribers->end(), [&subscriber](const Subscriber& s) {return s.id == subscriber.id;});
+  added = existing == subscribers->end();
+  if (added)
+    subscribers->push_back(subscriber);
+  else
+    *existing = subscriber;
+  return copy;
+}
+
+// Returns nullptr if the node is left empty
+std::shared_ptr<const Subscriptions::Node> Subscriptions::remove(const Node* node, const std::vector<std::string_view>& levels, size_t level,
+                                                                 std::string_view share_name, const Session* session, bool& removed)
+{
+  if (!node)
+    return nullptr;
+
+  std::shared_ptr<Node> copy = std::make_shared<Node>(*node);
+  if (level < levels.size())
+  {
+    auto child = copy->children.find(levels[level]);
+    if (child == copy->children.end())
+      return copy;
+
+    child->second = remove(child->second.get(), levels, level+1, share_name, session, removed);
+    if (!child->second)
+      copy->children.erase(child);
+  }
+  else if (share_name.empty())
+  {
+    removed = 0 < std::erase_if(copy->subscribers, [session](const Subscriber& s) {return s.id == session;});
+  }
+  else
+  {
+    auto group = copy->shared_groups.find(share_name);
+    if (group == copy->shared_groups.end())
+      return copy;
+
+    std::shared_ptr<SharedGroup> group_copy = std::make_shared<SharedGroup>();
+    group_copy->subscribers = group->second->subscribers;
+    removed = 0 < std::erase_if(group_copy->subscribers, [session](const Subscriber& s) {return s.id == session;});
+    if (group_copy->subscribers.empty())
+      copy->shared_groups.erase(group);
+    else
+      group->second = group_copy;
+  }
+
+  return copy->isEmpty() ? nullptr : copy;
+}
+
+void Subscriptions::match(const Node& node, const std::vector<std::string_view>& levels, size_t level, std::vector<const Subscriber*>& matches)
+{
+  // 4.7.2, "The Server MUST NOT match Topic Filters starting with a wildcard character (# or +) with Topic Names beginning with a $ character"
+  const bool wildcards = level>0 || levels[0].empty() || levels[0][0]!='$';
+
+  // 4.7.1.2, "sport/#" also matches "sport", so "#" is checked before the end of the topic
+  if (wildcards)
+  {
+    auto multi_level = node.children.find("#");
+    if (multi_level != node.children.end())
+      collect(*multi_level->second, matches);
+  }
+
+  if (level == levels.size())
+  {
+    collect(node, matches);
+    return;
+  }
+
+  if (wildcards)
+  {
+    auto single_level = node.children.find("+");
+    if (single_level != node.children.end())
+      match(*single_level->second, levels, level+1, matches);
+  }
+
+  auto child = node.children.find(levels[level]);
+  if (child != node.children.end())
+    match(*child->second, levels, level+1, matches);
+}
+
+void Subscriptions::collect(const Node& node, std::vector<const Subscriber*>& matches)
+{
+  for (const Subscriber& subscriber : node.subscribers)
+  {
+    matches.push_back(&subscriber);
+  }
+
+  for (const auto& group : node.shared_groups)
+  {
+    const std::vector<Subscriber>& subscribers = group.second->subscribers;
+    matches.push_back(&subscribers[group.second->next.fetch_add(1, std::memory_order_relaxed) % subscribers.size()]);
+  }
+}
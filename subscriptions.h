@@ -0,0 +1,103 @@
+#ifndef _SUBSCRIPTIONS_H_
+#define _SUBSCRIPTIONS_H_
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+class Session;
+
+
+/*
+ * Topic Filters from SUBSCRIBE, in a trie with one node per topic level.
+ * Publishers match against an immutable snapshot of the trie, loaded with one atomic operation, so fan-out never waits for
+ * SUBSCRIBE or UNSUBSCRIBE. Those copy the nodes along the path of the changed filter, and publish a new root.
+ */
+class Subscriptions
+{
+public:
+  enum Option : uint8_t { // 3.8.3.1, Subscription Options
+    MAXIMUM_QOS_MASK     = 0x03,
+    NO_LOCAL             = 0x04,
+    RETAIN_AS_PUBLISHED  = 0x08,
+    RETAIN_HANDLING_MASK = 0x30
+  };
+
+  struct Message {
+    std::string_view topic;
+    bool retain;
+    const uint8_t* properties; // MQTT 5 PUBLISH Properties, forwarded as they were received
+    size_t properties_length;
+    const uint8_t* payload; // The first payload_buffered_length bytes of the payload
+    size_t payload_length;
+    size_t payload_buffered_length;
+    std::function<std::error_code(const uint8_t*& payload)> spool_payload; // Reads a streamed payload in full, and points to it
+  };
+
+private:
+  static constexpr std::string_view SHARE_PREFIX{"$share/"};
+
+  struct Subscriber {
+    std::weak_ptr<Session> session;
+    const Session* id;
+    uint8_t options;
+  };
+
+  // 4.8.2, a message matching a Shared Subscription is delivered to one session in the group
+  struct SharedGroup {
+    std::vector<Subscriber> subscribers;
+    mutable std::atomic<uint32_t> next{0};
+  };
+
+  struct Node {
+    std::map<std::string,std::shared_ptr<const Node>,std::less<>> children;
+    std::vector<Subscriber> subscribers;
+    std::map<std::string,std::shared_ptr<const SharedGroup>,std::less<>> shared_groups;
+
+    [[nodiscard]] bool isEmpty() const {return children.empty() && subscribers.empty() && shared_groups.empty();}
+  };
+
+public:
+  Subscriptions();
+
+  // 4.7, Topic Names and Topic Filters
+  [[nodiscard]] static bool isValidFilter(std::string_view filter);
+  [[nodiscard]] static bool isShared(std::string_view filter) {return 0 == filter.compare(0, SHARE_PREFIX.length(), SHARE_PREFIX);}
+
+  // Returns false if the subscription replaced an existing one with the same filter (3.8.4)
+  bool subscribe(const std::shared_ptr<Session>& session, const std::string& filter, uint8_t options);
+  // Returns false if there was no such subscription
+  bool unsubscribe(const Session* session, const std::string& filter);
+  void unsubscribeAll(const Session* session);
+
+  // Delivers message at QoS 0 to every matching session except, for No Local subscriptions, the publisher. A session with
+  // max_queued_length bytes waiting for it misses the message, or is disconnected with queue_overflow=disconnect. So does
+  // every session while queueing the message would exceed memory_budget.
+  // A streamed payload is spooled through message.spool_payload only if some session gets it, and before any is written to
+  void publish(const Message& message, const Session* publisher);
+
+private:
+  static void splitFilter(std::string_view filter, std::string_view& share_name, std::vector<std::string_view>& levels);
+  [[nodiscard]] static std::shared_ptr<const Node> insert(const Node* node, const std::vector<std::string_view>& levels, size_t level,
+                                                          std::string_view share_name, const Subscriber& subscriber, bool& added);
+  [[nodiscard]] static std::shared_ptr<const Node> remove(const Node* node, const std::vector<std::string_view>& levels, size_t level,
+                                                          std::string_view share_name, const Session* session, bool& removed);
+  static void match(const Node& node, const std::vector<std::string_view>& levels, size_t level, std::vector<const Subscriber*>& matches);
+  static void collect(const Node& node, std::vector<const Subscriber*>& matches);
+
+private:
+  std::atomic<std::shared_ptr<const Node>> m_root;
+
+  std::mutex m_update_lock; // Serializes changes. Guards m_session_filters
+  std::unordered_map<const Session*,std::vector<std::string>> m_session_filters; // For unsubscribeAll
+};
+
+#endif // _SUBSCRIPTIONS_H_
@@ -0,0 +1,50 @@
+#!/bin/sh
+
+# Subscribes over MQTT 5 with a Maximum Packet Size of 64 bytes, then publishes a message over that size and one under it.
+# Only the small one may be delivered (3.1.2.11.4). The same holds for retained messages sent on SUBSCRIBE
+python3 - <<'PYTHON'
+import socket, struct, sys
+
+def packet(fixed_header, body):
+    return bytes([fixed_header, len(body)]) + body
+
+def string(text):
+    return struct.pack("!H", len(text)) + text.encode()
+
+def connect(client_id, properties):
+    mqtt = socket.create_connection(("localhost", 1883), timeout=5)
+    mqtt.sendall(packet(0x10, string("MQTT") + b"\x05\x02" + struct.pack("!H", 5) + bytes([len(properties)]) + properties + string(client_id)))
+    connack = mqtt.recv(2)
+    if len(connack) != 2 or connack[0] != 0x20:
+        sys.exit("max_packet_size: no CONNACK")
+    mqtt.recv(connack[1], socket.MSG_WAITALL)
+    return mqtt
+
+subscriber = connect("maxsizesub", b"\x27" + struct.pack("!I", 64)) # Maximum Packet Size
+subscriber.sendall(packet(0x82, struct.pack("!H", 1) + b"\x00" + string("test/maxsize") + b"\x00"))
+if subscriber.recv(2)[0] != 0x90:
+    sys.exit("max_packet_size: no SUBACK")
+subscriber.recv(4)
+
+publisher = connect("maxsizepub", b"")
+publisher.sendall(packet(0x30, string("test/maxsize") + b"\x00" + b"x"*100))
+publisher.sendall(packet(0x30, string("test/maxsize") + b"\x00" + b"small"))
+
+publish = subscriber.recv(2)
+body = subscriber.recv(publish[1], socket.MSG_WAITALL)
+if publish[0] != 0x30 or not body.endswith(b"small"):
+    sys.exit(f"max_packet_size: FAILED, got {publish + body}")
+
+publisher.sendall(packet(0x31, string("test/maxsize/retained/big") + b"\x00" + b"x"*100))
+publisher.sendall(packet(0x31, string("test/maxsize/retained/small") + b"\x00" + b"small"))
+publisher.sendall(packet(0xC0, b"")) # PINGREQ, answered after both PUBLISH packets were handled
+publisher.recv(2)
+subscriber.sendall(packet(0x82, struct.pack("!H", 2) + b"\x00" + string("test/maxsize/retained/#") + b"\x00"))
+suback = subscriber.recv(2)
+subscriber.recv(suback[1], socket.MSG_WAITALL)
+publish = subscriber.recv(2)
+body = subscriber.recv(publish[1], socket.MSG_WAITALL)
+if publish[0] != 0x31 or not body.endswith(b"small"):
+    sys.exit(f"max_packet_size: FAILED for retained, got {publish + body}")
+print("max_packet_size: ok")
+PYTHON
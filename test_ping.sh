@@ -0,0 +1,26 @@
+#!/bin/sh
+
+# Sends PINGREQ on an MQTT 3.1.1 and an MQTT 5 connection. Each must be answered with PINGRESP, and the connection kept open
+python3 - <<'PYTHON'
+import socket, struct, sys
+
+def connect(version):
+    mqtt = socket.create_connection(("localhost", 1883), timeout=5)
+    variable_header = b"\x00\x04MQTT" + bytes([version, 0x02]) + struct.pack("!H", 5) + (b"\x00" if version >= 5 else b"")
+    payload = struct.pack("!H", 8) + f"pingv{version:03}".encode()
+    mqtt.sendall(bytes([0x10, len(variable_header)+len(payload)]) + variable_header + payload)
+    connack = mqtt.recv(2)
+    if len(connack) != 2 or connack[0] != 0x20:
+        sys.exit(f"ping: no CONNACK for MQTT version {version}")
+    mqtt.recv(connack[1], socket.MSG_WAITALL)
+    return mqtt
+
+for version in (4, 5):
+    mqtt = connect(version)
+    for _ in range(2):
+        mqtt.sendall(b"\xc0\x00")
+        if mqtt.recv(2) != b"\xd0\x00":
+            sys.exit(f"ping: FAILED for MQTT version {version}")
+    mqtt.close()
+print("ping: ok")
+PYTHON
@@ -0,0 +1,14 @@
+#!/bin/sh
+
+# Stores, deletes and stores retained messages again, so freed entries are reused. Every topic must keep its own payload
+BIG=$(head -c 5000 /dev/zero | tr '\0' x)
+mosquitto_pub -V 5 -h localhost -p 1883 -r -t "test/retained/a" -m "a"
+mosquitto_pub -V 5 -h localhost -p 1883 -r -t "test/retained/b" -m "b"
+mosquitto_pub -V 5 -h localhost -p 1883 -r -t "test/retained/a" -n
+mosquitto_pub -V 5 -h localhost -p 1883 -r -t "test/retained/c" -m "c"
+mosquitto_pub -V 5 -h localhost -p 1883 -r -t "test/retained/b" -n
+mosquitto_pub -V 5 -h localhost -p 1883 -r -t "test/retained/d" -m "$BIG"
+
+EXPECTED=$(printf "test/retained/c c\ntest/retained/d %s" "$BIG")
+ACTUAL=$(mosquitto_sub -V 5 -h localhost -p 1883 -t "test/retained/#" -v -C 2 -W 2 | sort)
+if [ "$ACTUAL" = "$EXPECTED" ]; then echo "retained: ok"; else echo "retained: FAILED"; exit 1; fi
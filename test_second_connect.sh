@@ -0,0 +1,33 @@
+#!/bin/sh
+
+# Sends a second CONNECT on an MQTT 3.1.1 and an MQTT 5 connection. The connection must be closed, after a DISCONNECT with
+# Reason Code 0x82 (Protocol Error) for MQTT 5
+python3 - <<'PYTHON'
+import socket, struct, sys
+
+def connect_packet(version):
+    variable_header = b"\x00\x04MQTT" + bytes([version, 0x02]) + struct.pack("!H", 5) + (b"\x00" if version >= 5 else b"")
+    payload = struct.pack("!H", 10) + f"secondv{version:03}".encode()
+    return bytes([0x10, len(variable_header)+len(payload)]) + variable_header + payload
+
+for version in (4, 5):
+    mqtt = socket.create_connection(("localhost", 1883), timeout=5)
+    mqtt.sendall(connect_packet(version))
+    connack = mqtt.recv(2)
+    if len(connack) != 2 or connack[0] != 0x20:
+        sys.exit(f"second connect: no CONNACK for MQTT version {version}")
+    mqtt.recv(connack[1], socket.MSG_WAITALL)
+
+    mqtt.sendall(connect_packet(version))
+    received = b""
+    while True:
+        data = mqtt.recv(64)
+        if not data:
+            break
+        received += data
+    expected = b"\xe0\x02\x82\x00" if version >= 5 else b""
+    if received != expected:
+        sys.exit(f"second connect: FAILED for MQTT version {version}, got {received.hex()}")
+    mqtt.close()
+print("second connect: ok")
+PYTHON
@@ -0,0 +1,172 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <random>
+#include <thread>
+
+
+namespace
+{
+  std::atomic<bool> s_dump_requested(false);
+
+  void requestDump(int)
+  {
+    s_dump_requested.store(true, std::memory_order_relaxed);
+  }
+
+  int64_t now()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+}
+
+
+Trace::Trace()
+: m_stamps()
+{
+  m_stamps[READ].store(now(), std::memory_order_relaxed);
+}
+
+Trace::~Trace()
+{
+  Tracing::record(*this);
+}
+
+void Trace::stamp(Stage stage)
+{
+  int64_t expected = 0;
+  m_stamps[stage].compare_exchange_strong(expected, now(), std::memory_order_relaxed);
+}
+
+
+std::atomic<uint32_t> Tracing::s_sample_rate(0);
+std::atomic<uint64_t> Tracing::s_histograms[Trace::STAGE_COUNT][Tracing::BUCKET_COUNT];
+std::mutex Tracing::s_slowest_lock;
+std::vector<Tracing::Slow> Tracing::s_slowest;
+
+
+void Tracing::start(uint32_t sample_rate)
+{
+  s_sample_rate.store(sample_rate, std::memory_order_relaxed);
+  if (sample_rate == 0)
+    return;
+
+  std::signal(SIGUSR1, requestDump);
+  std::thread([]()
+  {
+    while (true)
+    {
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+      if (s_dump_requested.exchange(false, std::memory_order_relaxed))
+        dump(std::cout);
+    }
+  }).detach();
+}
+
+// The first call on a thread starts its countdown at a random point, so connections that publish in step are not all
+// sampled on the same message
+std::shared_ptr<Trace> Tracing::begin(uint32_t& countdown)
+{
+  thread_local bool started = false;
+  const uint32_t sample_rate = s_sample_rate.load(std::memory_order_relaxed);
+  if (sample_rate == 0)
+  {
+    countdown = UINT32_MAX;
+    return nullptr;
+  }
+
+  if (!started)
+  {
+    started = true;
+    thread_local std::minstd_rand random(std::random_device{}());
+    countdown = 1 + random()%sample_rate;
+    return nullptr;
+  }
+
+  countdown = sample_rate;
+  return std::make_shared<Trace>();
+}
+
+void Tracing::record(const Trace& trace)
+{
+  int64_t previous = trace.getStamp(Trace::READ);
+  int64_t last = previous;
+  for (int stage=Trace::READ+1; stage<Trace::STAGE_COUNT; stage++)
+  {
+    const int64_t stamp = trace.getStamp(static_cast<Trace::Stage>(stage));
+    if (stamp == 0)
+      continue;
+
+    s_histograms[stage][getBucket(stamp-previous)].fetch_add(1, std::memory_order_relaxed);
+    previous = stamp;
+    last = std::max(last, stamp);
+  }
+
+  const int64_t total = last - trace.getStamp(Trace::READ);
+  std::lock_guard<std::mutex> lock(s_slowest_lock);
+  auto fastest = std::min_element(s_slowest.begin(), s_slowest.end(), [](const Slow& a, const Slow& b) {return a.total < b.total;});
+  if (s_slowest.size()==SLOWEST_COUNT && fastest->total>=total)
+    return;
+
+  Slow& slow = s_slowest.size()<SLOWEST_COUNT ? s_slowest.emplace_back() : *fastest;
+  slow.total = total;
+  slow.topic = trace.getTopic();
+  for (int stage=0; stage<Trace::STAGE_COUNT; stage++)
+  {
+    slow.stamps[stage] = trace.getStamp(static_cast<Trace::Stage>(stage));
+  }
+}
+
+// Percentiles are the upper bound of their histogram bucket
+void Tracing::dump(std::ostream& out)
+{
+  out << "stage\tcount\tp50_us\tp99_us\tmax_us\n";
+  for (int stage=Trace::READ+1; stage<Trace::STAGE_COUNT; stage++)
+  {
+    uint64_t counts[BUCKET_COUNT];
+    uint64_t count = 0;
+    for (size_t bucket=0; bucket<BUCKET_COUNT; bucket++)
+    {
+      counts[bucket] = s_histograms[stage][bucket].load(std::memory_order_relaxed);
+      count += counts[bucket];
+    }
+
+    out << STAGE_NAMES[stage] << '\t' << count;
+    for (const double percentile : {0.5, 0.99, 1.0})
+    {
+      uint64_t seen = 0;
+      size_t bucket = 0;
+      while (bucket<BUCKET_COUNT-1 && (seen+=counts[bucket]) < std::max<uint64_t>(1, percentile*count))
+        bucket++;
+      out << '\t' << (count==0 ? 0.0 : (1LL<<bucket)/1000.0);
+    }
+    out << '\n';
+  }
+
+  std::vector<Slow> slowest;
+  {
+    std::lock_guard<std::mutex> lock(s_slowest_lock);
+    slowest = s_slowest;
+  }
+  std::sort(slowest.begin(), slowest.end(), [](const Slow& a, const Slow& b) {return a.total > b.total;});
+  for (const Slow& slow : slowest)
+  {
+    out << "slow " << slow.total/1000.0 << " us, topic " << slow.topic << ':';
+    for (int stage=Trace::READ+1; stage<Trace::STAGE_COUNT; stage++)
+    {
+      if (slow.stamps[stage] != 0)
+        out << ' ' << STAGE_NAMES[stage] << " +" << (slow.stamps[stage]-slow.stamps[Trace::READ])/1000.0;
+    }
+    out << '\n';
+  }
+  out.flush();
+}
+
+size_t Tracing::getBucket(int64_t ns)
+{
+  return std::min<size_t>(BUCKET_COUNT-1, std::bit_width(static_cast<uint64_t>(std::max<int64_t>(ns, 0))));
+}
@@ -0,0 +1,94 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+/*
+ * Timestamps of one sampled PUBLISH on its way from the socket to InfluxDB. A message routed by several rules, or to several
+ * servers, passes some stages more than once. The first time counts.
+ * The trace is recorded in Tracing when the last batch holding it is acknowledged, or when routing is done if no batch took it.
+ */
+class Trace
+{
+public:
+  enum Stage {
+    READ,     // The whole packet is in the Buffer
+    PARSED,
+    MATCHED,  // A topic section matched
+    ENQUEUED, // Handed to an InfluxDB writer
+    BATCHED,  // Appended to a batch, after waiting for the batch lock
+    FLUSHED,  // The batch was handed to the HTTP client
+    ACKED,    // InfluxDB answered
+    STAGE_COUNT
+  };
+
+public:
+  Trace();
+  ~Trace();
+
+  void stamp(Stage stage);
+  // Called before the trace is shared with other threads
+  void setTopic(std::string_view topic) {m_topic = topic;}
+
+  [[nodiscard]] int64_t getStamp(Stage stage) const {return m_stamps[stage].load(std::memory_order_relaxed);}
+  [[nodiscard]] const std::string& getTopic() const {return m_topic;}
+
+private:
+  std::atomic<int64_t> m_stamps[STAGE_COUNT]; // Steady clock ns. 0 if the stage was not reached
+  std::string m_topic;
+};
+
+
+/*
+ * Samples 1 in trace_sample_rate PUBLISH packets, and keeps a latency histogram per stage (time since the previous stage
+ * reached) and the slowest traces. SIGUSR1 dumps them to stdout.
+ */
+class Tracing
+{
+private:
+  static constexpr size_t BUCKET_COUNT = 40; // Powers of two ns, up to about 9 minutes
+  static constexpr size_t SLOWEST_COUNT = 10;
+  static constexpr const char* STAGE_NAMES[Trace::STAGE_COUNT] = {"read", "parsed", "matched", "enqueued", "batched", "flushed", "acked"};
+
+  struct Slow {
+    int64_t total;
+    std::string topic;
+    int64_t stamps[Trace::STAGE_COUNT];
+  };
+
+public:
+  // 0 disables tracing
+  static void start(uint32_t sample_rate);
+
+  // One branch for a message that is not sampled
+  [[nodiscard]] static std::shared_ptr<Trace> sample()
+  {
+    thread_local uint32_t countdown = 1;
+    if (--countdown != 0) [[likely]]
+      return nullptr;
+    return begin(countdown);
+  }
+
+  static void record(const Trace& trace);
+  static void dump(std::ostream& out);
+
+private:
+  [[nodiscard]] static std::shared_ptr<Trace> begin(uint32_t& countdown);
+  [[nodiscard]] static size_t getBucket(int64_t ns);
+
+private:
+  static std::atomic<uint32_t> s_sample_rate;
+  static std::atomic<uint64_t> s_histograms[Trace::STAGE_COUNT][BUCKET_COUNT];
+  static std::mutex s_slowest_lock;
+  static std::vector<Slow> s_slowest;
+};
+
+#endif // _TRACE_H_
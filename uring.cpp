@@ -0,0 +1,145 @@
+#include "uring.h"
+
+#ifdef USE_IO_URING
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+
+Uring::Uring()
+: m_fd(-1),
+  m_rings(MAP_FAILED),
+  m_rings_length(0),
+  m_sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+  m_sqes_length(0),
+  m_sq_head(nullptr),
+  m_sq_tail(nullptr),
+  m_sq_array(nullptr),
+  m_sq_mask(0),
+  m_sq_entries(0),
+  m_sq_next_tail(0),
+  m_cq_head(nullptr),
+  m_cq_tail(nullptr),
+  m_cqes(nullptr),
+  m_cq_mask(0)
+{
+}
+
+// Closing the ring cancels what is still queued on it. Memory requests write to must stay valid until they completed
+Uring::~Uring()
+{
+  if (m_sqes != MAP_FAILED)
+    ::munmap(m_sqes, m_sqes_length);
+  if (m_rings != MAP_FAILED)
+    ::munmap(m_rings, m_rings_length);
+  if (m_fd >= 0)
+    ::close(m_fd);
+}
+
+std::error_code Uring::setup(unsigned int entries)
+{
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  m_fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+  if (m_fd < 0)
+    return std::error_code(errno, std::generic_category());
+
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+    return std::make_error_code(std::errc::function_not_supported);
+
+  m_rings_length = std::max<size_t>(params.sq_off.array + params.sq_entries*sizeof(unsigned int),
+                                    params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe));
+  m_rings = ::mmap(nullptr, m_rings_length, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+  if (m_rings == MAP_FAILED)
+    return std::error_code(errno, std::generic_category());
+
+  m_sqes_length = params.sq_entries*sizeof(io_uring_sqe);
+  m_sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, m_sqes_length, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_fd, IORING_OFF_SQES));
+  if (m_sqes == MAP_FAILED)
+    return std::error_code(errno, std::generic_category());
+
+  uint8_t* rings = static_cast<uint8_t*>(m_rings);
+  m_sq_head = reinterpret_cast<unsigned int*>(rings + params.sq_off.head);
+  m_sq_tail = reinterpret_cast<unsigned int*>(rings + params.sq_off.tail);
+  m_sq_array = reinterpret_cast<unsigned int*>(rings + params.sq_off.array);
+  m_sq_mask = *reinterpret_cast<unsigned int*>(rings + params.sq_off.ring_mask);
+  m_sq_entries = params.sq_entries;
+  m_sq_next_tail = *m_sq_tail;
+
+  m_cq_head = reinterpret_cast<unsigned int*>(rings + params.cq_off.head);
+  m_cq_tail = reinterpret_cast<unsigned int*>(rings + params.cq_off.tail);
+  m_cqes = reinterpret_cast<io_uring_cqe*>(rings + params.cq_off.cqes);
+  m_cq_mask = *reinterpret_cast<unsigned int*>(rings + params.cq_off.ring_mask);
+  return std::error_code();
+}
+
+std::error_code Uring::registerBufferRing(io_uring_buf* ring, unsigned int entries, uint16_t group)
+{
+  io_uring_buf_reg registration;
+  std::memset(&registration, 0, sizeof(registration));
+  registration.ring_addr = reinterpret_cast<uint64_t>(ring);
+  registration.ring_entries = entries;
+  registration.bgid = group;
+  if (0 != ::syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PBUF_RING, &registration, 1))
+    return std::error_code(errno, std::generic_category());
+  return std::error_code();
+}
+
+io_uring_sqe* Uring::getSqe()
+{
+  if (m_sq_next_tail-std::atomic_ref<unsigned int>(*m_sq_head).load(std::memory_order_acquire) >= m_sq_entries)
+    return nullptr;
+
+  const unsigned int index = m_sq_next_tail & m_sq_mask;
+  io_uring_sqe* sqe = &m_sqes[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  m_sq_array[index] = index;
+  m_sq_next_tail++;
+  return sqe;
+}
+
+std::error_code Uring::enter(bool wait, int timeout_ms)
+{
+  std::atomic_ref<unsigned int>(*m_sq_tail).store(m_sq_next_tail, std::memory_order_release);
+  // Counted from the kernel's head, so entries a failed call did not take are submitted again
+  const unsigned int to_submit = m_sq_next_tail-std::atomic_ref<unsigned int>(*m_sq_head).load(std::memory_order_acquire);
+  if (to_submit==0 && !wait)
+    return std::error_code();
+
+  struct __kernel_timespec timeout = {timeout_ms/1000, (timeout_ms%1000)*1000000L};
+  io_uring_getevents_arg arg;
+  std::memset(&arg, 0, sizeof(arg));
+  if (timeout_ms >= 0)
+    arg.ts = reinterpret_cast<uint64_t>(&timeout);
+
+  const unsigned int flags = IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0);
+  if (::syscall(__NR_io_uring_enter, m_fd, to_submit, wait ? 1 : 0, flags, &arg, sizeof(arg)) < 0)
+  {
+    // EBUSY and EAGAIN: completions must be reaped before more is submitted
+    if (errno==ETIME || errno==EINTR || errno==EBUSY || errno==EAGAIN)
+      return std::error_code();
+    return std::error_code(errno, std::generic_category());
+  }
+  return std::error_code();
+}
+
+const io_uring_cqe* Uring::peekCqe() const
+{
+  const unsigned int head = *m_cq_head; //Only this thread moves it
+  if (head == std::atomic_ref<unsigned int>(*m_cq_tail).load(std::memory_order_acquire))
+    return nullptr;
+  return &m_cqes[head & m_cq_mask];
+}
+
+void Uring::popCqe()
+{
+  std::atomic_ref<unsigned int>(*m_cq_head).store(*m_cq_head+1, std::memory_order_release);
+}
+
+#endif // USE_IO_URING
@@ -0,0 +1,61 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#ifdef USE_IO_URING
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <system_error>
+
+
+/*
+ * One io_uring, driven through the raw system calls, for use by a single thread. Entries taken with getSqe() are submitted
+ * by the next enter(), which also waits for completions, so queueing I/O and waiting for it is one system call.
+ */
+class Uring
+{
+public:
+  Uring();
+  ~Uring();
+
+  Uring(const Uring&) = delete;
+  Uring& operator=(const Uring&) = delete;
+
+  // Fails if the kernel has no io_uring, it is disabled, or it lacks a single mmap for both rings or timed waits (5.11)
+  [[nodiscard]] std::error_code setup(unsigned int entries);
+  // Buffers the kernel picks from for IOSQE_BUFFER_SELECT requests of group (5.19). ring must be page aligned
+  [[nodiscard]] std::error_code registerBufferRing(io_uring_buf* ring, unsigned int entries, uint16_t group);
+
+  // A cleared entry, or nullptr if the submission queue is full
+  [[nodiscard]] io_uring_sqe* getSqe();
+  // Submits the entries taken since the last call. If wait, then also waits for a completion, for at most timeout_ms
+  // (-1 for no limit). Timeouts and signals are not errors, the caller checks for completions and its own deadline
+  [[nodiscard]] std::error_code enter(bool wait, int timeout_ms);
+  // The oldest completion, or nullptr if there is none. Each one must be followed by popCqe()
+  [[nodiscard]] const io_uring_cqe* peekCqe() const;
+  void popCqe();
+
+private:
+  int m_fd;
+  void* m_rings;
+  size_t m_rings_length;
+  io_uring_sqe* m_sqes;
+  size_t m_sqes_length;
+
+  unsigned int* m_sq_head;
+  unsigned int* m_sq_tail;
+  unsigned int* m_sq_array;
+  unsigned int m_sq_mask;
+  unsigned int m_sq_entries;
+  unsigned int m_sq_next_tail; // Entries up to here are taken. They are published to the kernel by enter()
+
+  unsigned int* m_cq_head;
+  unsigned int* m_cq_tail;
+  io_uring_cqe* m_cqes;
+  unsigned int m_cq_mask;
+};
+
+#endif // USE_IO_URING
+
+#endif // _URING_H_
@@ -0,0 +1,96 @@
+#include "write_controller.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "clock.h"
+#include "log.h"
+#include "metrics.h"
+
+
+// Starts with one write in flight, and the batch length used before it adapted
+WriteController::WriteController(const std::string& server_name, size_t max_in_flight, int64_t target_latency_ms)
+: m_server_name(server_name),
+  m_max_in_flight(std::max<size_t>(1, max_in_flight)),
+  m_target_latency_ms(std::max<int64_t>(1, target_latency_ms)),
+  m_batch_length(INITIAL_BATCH_LENGTH),
+  m_in_flight_limit(1),
+  m_in_flight(0),
+  m_answered_in_time(0),
+  m_decreased_ms(0),
+  m_resume_ms(0),
+  m_stop(false)
+{
+}
+
+int64_t WriteController::begin()
+{
+  std::unique_lock<std::mutex> lock(m_lock);
+  while (!m_stop)
+  {
+    const int64_t now = Clock::monotonicMs();
+    if (now < m_resume_ms)
+      m_changed.wait_for(lock, std::chrono::milliseconds(m_resume_ms-now));
+    else if (m_in_flight >= m_in_flight_limit)
+      m_changed.wait(lock);
+    else
+      break;
+  }
+
+  m_in_flight++;
+  return Clock::monotonicMs();
+}
+
+void WriteController::end(int64_t begin_ms, bool failed, int status, int retry_after)
+{
+  const int64_t now = Clock::monotonicMs();
+  const int64_t latency_ms = now - begin_ms;
+  const bool overloaded = failed || status==429 || status>=500 || latency_ms>2*m_target_latency_ms;
+  bool decreased = false;
+  size_t batch_length;
+  size_t in_flight_limit;
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_in_flight--;
+
+    if (retry_after>=0 && (status==429 || status==503))
+      m_resume_ms = std::max(m_resume_ms, now + std::min<int64_t>(retry_after*1000L, MAX_RETRY_AFTER_MS));
+
+    if (overloaded && begin_ms>=m_decreased_ms)
+    {
+      m_decreased_ms = now;
+      m_in_flight_limit = std::max<size_t>(1, m_in_flight_limit/2);
+      m_batch_length.store(std::max(MIN_BATCH_LENGTH, getBatchLength()/2), std::memory_order_relaxed);
+      m_answered_in_time = 0;
+      decreased = true;
+    }
+    else if (!overloaded && status>=200 && status<=299 && latency_ms<=m_target_latency_ms)
+    {
+      m_batch_length.store(std::min(MAX_BATCH_LENGTH, getBatchLength()+BATCH_LENGTH_STEP), std::memory_order_relaxed);
+      if (++m_answered_in_time>=m_in_flight_limit && m_in_flight_limit<m_max_in_flight)
+      {
+        m_in_flight_limit++;
+        m_answered_in_time = 0;
+      }
+    }
+
+    batch_length = getBatchLength();
+    in_flight_limit = m_in_flight_limit;
+  }
+  m_changed.notify_all();
+
+  if (decreased)
+  {
+    Metrics::add(Metrics::INFLUXDB_BACKOFFS, 1);
+    Log::write(Log::INFLUXDB_BACKING_OFF, m_server_name, status, latency_ms, batch_length, in_flight_limit);
+  }
+}
+
+void WriteController::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_stop = true;
+  }
+  m_changed.notify_all();
+}
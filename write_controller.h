@@ -0,0 +1,59 @@
+#ifndef _WRITE_CONTROLLER_H_
+#define _WRITE_CONTROLLER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+
+/*
+ * Adapts the batch length and the number of concurrent writes of one InfluxDB server to how fast it answers, like TCP
+ * congestion control does with its window. Both grow additively while writes are answered within the target latency, and
+ * are halved when a write fails, is answered with 429 or 5xx, or takes more than twice the target. A Retry-After on 429 or
+ * 503 holds back every write until it has passed.
+ * Only answers to writes sent after the last decrease can decrease again, so one slow period halves the limits once.
+ */
+class WriteController
+{
+public:
+  static constexpr size_t MIN_BATCH_LENGTH = 16*1024L;
+  static constexpr size_t MAX_BATCH_LENGTH = 4*1024*1024L;
+
+private:
+  static constexpr size_t INITIAL_BATCH_LENGTH = 256*1024L;
+  static constexpr size_t BATCH_LENGTH_STEP = 16*1024L; // Per write answered in time
+  static constexpr int64_t MAX_RETRY_AFTER_MS = 60*1000L;
+
+public:
+  WriteController(const std::string& server_name, size_t max_in_flight, int64_t target_latency_ms);
+
+  // Uncompressed line protocol bytes a batch is sent at
+  [[nodiscard]] size_t getBatchLength() const {return m_batch_length.load(std::memory_order_relaxed);}
+
+  // Blocks until another write may be sent. Returns the time it was sent at, for end()
+  [[nodiscard]] int64_t begin();
+  // status and retry_after as in HttpClient::Response. failed if there was no answer, as when a deadline of HttpClient passed
+  void end(int64_t begin_ms, bool failed, int status, int retry_after);
+  // begin() returns at once from now on, so batches are flushed at shutdown without waiting for Retry-After
+  void stop();
+
+private:
+  std::string m_server_name;
+  size_t m_max_in_flight;
+  int64_t m_target_latency_ms;
+  std::atomic<size_t> m_batch_length;
+
+  std::mutex m_lock;
+  std::condition_variable m_changed;
+  size_t m_in_flight_limit;
+  size_t m_in_flight;
+  size_t m_answered_in_time; // Since the in-flight limit last grew. It grows by one per limit writes answered in time
+  int64_t m_decreased_ms;
+  int64_t m_resume_ms; // Retry-After
+  bool m_stop;
+};
+
+#endif // _WRITE_CONTROLLER_H_